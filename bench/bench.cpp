@@ -0,0 +1,479 @@
+/*
+	Copyright (c) 2015 by Darcy Shen
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+// Times each stage of rendering on a set of documents, and compares the
+// results with ones saved earlier. Run it without arguments for the built-in
+// documents (plus the CommonMark spec, if the submodule is checked out), or
+// give it files of your own. If the library was built with MARKDOWN_STATS,
+// each document's phases are shown too.
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "markdown.h"
+#include "libmdcpp.h"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+
+// Every allocation the library makes goes through these, so they can be
+// counted for each stage, and for each phase in the DocumentStats. Each block
+// starts with its size, for operator delete to take off again.
+namespace {
+const size_t cBlockHeader=alignof(std::max_align_t);
+}
+
+void* operator new(size_t size) {
+    char *p=static_cast<char*>(std::malloc(cBlockHeader+size));
+    if (p==0) throw std::bad_alloc();
+    *reinterpret_cast<size_t*>(p)=size;
+    markdown::noteAllocation(size);
+    return p+cBlockHeader;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept {
+    if (p==0) return;
+    char *block=static_cast<char*>(p)-cBlockHeader;
+    markdown::noteDeallocation(*reinterpret_cast<size_t*>(block));
+    std::free(block);
+}
+void operator delete[](void *p) noexcept { operator delete(p); }
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const char *cStageNames[]= { "read", "process", "write" };
+enum Stage { cRead, cProcess, cWrite, cStageCount };
+
+struct Result {
+    double mbPerSecond;
+    double allocationsPerKB;
+    double peakPerKB; // Bytes in use at once, at most, above what was before
+};
+
+// What's measured, and what it's compared to, by "document/parser stage".
+typedef std::map<std::string, Result> Results;
+typedef std::vector<std::pair<std::string, Result> > ResultList;
+
+struct Input {
+    std::string name, text;
+};
+
+// The built-in documents are generated, so that they're the same everywhere
+// and don't have to be kept in the repository. Each is about `size` bytes.
+
+std::string readme(size_t size) {
+    std::ostringstream out;
+    for (size_t i=0; out.tellp()<static_cast<std::streamoff>(size); ++i) {
+        out << "## Section " << i << "\n\n"
+            << "This library turns *Markdown* into **HTML**, with `inline code`, "
+            << "[inline links](http://example.com/" << i << " \"Title\"), "
+            << "[reference links][ref" << i%20 << "] and <http://example.com/auto>.\n"
+            << "A second line of the same paragraph, with an escaped \\*star\\* and "
+            << "an HTML <span class=\"x\">span</span>.\n\n"
+            << "- First point\n- Second point, with _emphasis_\n- Third point\n\n"
+            << "```cpp\nint main() {\n    return " << i << ";\n}\n```\n\n"
+            << "> A quoted remark,\n> over two lines.\n\n";
+    }
+    for (size_t i=0; i<20; ++i)
+        out << "[ref" << i << "]: http://example.com/ref/" << i << " \"Reference " << i << "\"\n";
+    return out.str();
+}
+
+std::string lists(size_t size) {
+    std::ostringstream out;
+    for (size_t i=0; out.tellp()<static_cast<std::streamoff>(size); ++i) {
+        out << "- Item " << i << " with *some* text\n"
+            << "    - Nested item\n"
+            << "        - Deeper, with a [link](http://example.com/)\n"
+            << "    - Another nested item\n"
+            << "- Item " << i << "b\n\n"
+            << "1. Ordered\n2. List, **loose**\n\n3. After a blank line\n\n";
+    }
+    return out.str();
+}
+
+// There's no table syntax, so these come out as paragraphs; they're still
+// what a lot of real documents look like.
+std::string tables(size_t size) {
+    std::ostringstream out;
+    for (size_t i=0; out.tellp()<static_cast<std::streamoff>(size); ++i) {
+        out << "| Name | Value | Notes |\n|------|------:|:------|\n";
+        for (size_t r=0; r<8; ++r)
+            out << "| row " << r << " | " << i*r << " | *note* `" << r << "` |\n";
+        out << "\n";
+    }
+    return out.str();
+}
+
+std::string code(size_t size) {
+    std::ostringstream out;
+    for (size_t i=0; out.tellp()<static_cast<std::streamoff>(size); ++i) {
+        out << "Some code:\n\n```python\n";
+        for (size_t l=0; l<10; ++l)
+            out << "def f" << l << "(x):\n    return x < " << l << " and x > 0 & 1\n";
+        out << "```\n\nIndented:\n\n";
+        for (size_t l=0; l<6; ++l) out << "    if (a<b && c>d) { return \"" << l << "\"; }\n";
+        out << "\n";
+    }
+    return out.str();
+}
+
+// Nested lists and block quotes, for --scaling: each line is one level deeper
+// than the one before, `depth` levels down and then back to the top.
+const char *cOutlineText="with *some* text in it, a [link](http://example.com/) "
+    "and enough words after that to make it about as long as a line in a real outline";
+
+std::string outline(size_t size, size_t depth) {
+    std::ostringstream out;
+    for (size_t i=0; out.tellp()<static_cast<std::streamoff>(size); ++i) {
+        out << std::string(4*(i%depth), ' ') << "- Item " << i << ' ' << cOutlineText << '\n';
+    }
+    return out.str();
+}
+
+std::string quotes(size_t size, size_t depth) {
+    std::ostringstream out;
+    for (size_t i=0; out.tellp()<static_cast<std::streamoff>(size); ++i) {
+        for (size_t d=0; d<=i%depth; ++d) out << "> ";
+        out << "Line " << i << ' ' << cOutlineText << '\n';
+    }
+    return out.str();
+}
+
+std::string pathological(size_t size) {
+    const char *cLines[]= {
+        "[a]([a]([a]([a]([a]([a]([a]([a]([a]([a]([a]([a](",
+        "*a _b *a _b *a _b *a _b *a _b *a _b *a _b *a _b *a _b",
+        "<a <a <a <a <a <a <a <a <a <a <a <a <a <a <a <a <a <a",
+        "> > > > > > > > > > > > > > > > > > > > > > > > > x",
+        "``a``` ```a`` `a```` ``a` ```a```` ``a`"
+    };
+    std::string r;
+    for (size_t i=0; r.length()<size; ++i) {
+        r+=cLines[i%(sizeof(cLines)/sizeof(cLines[0]))];
+        r+="\n\n";
+    }
+    return r;
+}
+
+// The most that's been in use at once since the last call, above what was in
+// use then.
+size_t peakSince(ptrdiff_t& start) {
+    markdown::HeapCounters& heap=markdown::heapCounters();
+    const size_t peak=static_cast<size_t>(heap.peak-start);
+    heap.peak=start=heap.bytes;
+    return peak;
+}
+
+// Renders `input` in stages, `rounds` times, keeping the quickest time for
+// each (the others have more of whatever else the machine was doing in them)
+// and the allocations, which are the same every time. The second write() of
+// a document does nothing but write, so processing is the difference between
+// the two, except for the peak: that's just the first write()'s.
+void measure(const std::string& input, markdown::SpanParser parser, size_t rounds,
+    double seconds[cStageCount], size_t allocations[cStageCount], size_t peaks[cStageCount])
+{
+    SyntaxHighlighter highlighter;
+    std::string output, discarded;
+    const size_t& allocated=markdown::heapCounters().allocations;
+
+    for (size_t x=0; x<rounds; ++x) {
+        output.clear();
+        discarded.clear();
+
+        ptrdiff_t inUse=0;
+        peakSince(inUse);
+        size_t a=allocated;
+        Clock::time_point t0=Clock::now();
+        markdown::Document doc(&highlighter);
+        doc.setSpanParser(parser);
+        doc.read(input);
+        Clock::time_point t1=Clock::now();
+        size_t a1=allocated;
+        peaks[cRead]=peakSince(inUse);
+        {
+            StringSink sink(discarded);
+            doc.write(sink);
+        }
+        Clock::time_point t2=Clock::now();
+        size_t a2=allocated;
+        peaks[cProcess]=peakSince(inUse);
+        {
+            StringSink sink(output);
+            doc.write(sink);
+        }
+        Clock::time_point t3=Clock::now();
+        size_t a3=allocated;
+        peaks[cWrite]=peakSince(inUse);
+
+        const double t[cStageCount]= {
+            std::chrono::duration<double>(t1-t0).count(),
+            std::chrono::duration<double>((t2-t1)-(t3-t2)).count(),
+            std::chrono::duration<double>(t3-t2).count()
+        };
+        for (size_t s=0; s<cStageCount; ++s)
+            if (x==0 || t[s]<seconds[s]) seconds[s]=t[s];
+        allocations[cRead]=a1-a;
+        allocations[cProcess]=(a2-a1)-(a3-a2);
+        allocations[cWrite]=a3-a2;
+    }
+}
+
+void run(const Input& input, markdown::SpanParser parser, ResultList& results) {
+    // One round to see how long it takes, then enough for about half a second.
+    double seconds[cStageCount];
+    size_t allocations[cStageCount], peaks[cStageCount];
+    measure(input.text, parser, 1, seconds, allocations, peaks);
+    double once=seconds[cRead]+seconds[cProcess]+seconds[cWrite];
+    size_t rounds=(once>0 ? static_cast<size_t>(0.5/once) : 1000);
+    if (rounds<5) rounds=5;
+    measure(input.text, parser, rounds, seconds, allocations, peaks);
+
+    const double bytes=static_cast<double>(input.text.length());
+    const std::string name=input.name+(parser==markdown::cScannerSpanParser ? "/scanner" : "/regex");
+    for (size_t s=0; s<cStageCount; ++s) {
+        Result r;
+        r.mbPerSecond=(seconds[s]>0 ? bytes/seconds[s]/1e6 : 0);
+        r.allocationsPerKB=allocations[s]/(bytes/1024);
+        r.peakPerKB=peaks[s]/(bytes/1024);
+        results.push_back(std::make_pair(name+' '+cStageNames[s], r));
+    }
+}
+
+// With a library built with MARKDOWN_STATS, shows where the time of one more
+// rendering goes, phase by phase.
+void showPhases(const Input& input, markdown::SpanParser parser) {
+    SyntaxHighlighter highlighter;
+    markdown::DocumentStats stats;
+    std::string output;
+    {
+        markdown::Document doc(&highlighter);
+        doc.setSpanParser(parser);
+        doc.setStats(&stats);
+        doc.read(input.text);
+        StringSink sink(output);
+        doc.write(sink);
+    }
+
+    const std::string name=input.name+(parser==markdown::cScannerSpanParser ? "/scanner" : "/regex");
+    for (size_t p=0; p<markdown::DocumentStats::cPhaseCount; ++p) {
+        cout << "  " << std::left << std::setw(42) << name+' '+markdown::DocumentStats::phaseName(p)
+            << std::right << std::fixed << std::setprecision(2) << std::setw(10)
+            << stats.seconds[p]*1e3 << " ms" << std::setw(10) << stats.regexCalls[p]
+            << " regex" << std::setw(8) << stats.arenaBytes[p]/1024 << " KB arena"
+            << std::setw(8) << stats.heapBytes[p]/1024 << " KB heap" << std::setw(8)
+            << stats.heapPeak[p]/1024 << " KB peak" << endl;
+    }
+}
+
+// For --scaling: renders nested lists and block quotes of each size and
+// depth, and fails if any goes less than half as fast as the smallest (or the
+// shallowest) of its kind, which would mean the time is growing faster than
+// the input. The depths stay within the default nesting limit.
+int runScaling() {
+    typedef std::string (*Generator)(size_t, size_t);
+    const struct { const char *name; Generator generate; } cKinds[]= {
+        { "outline", outline }, { "quotes", quotes }
+    };
+    const size_t cSizes[]= { 64*1024, 256*1024, 1024*1024 };
+    const size_t cDepths[]= { 1, 4, 16, 30 };
+    const size_t cSizeCount=sizeof(cSizes)/sizeof(cSizes[0]);
+    const size_t cDepthCount=sizeof(cDepths)/sizeof(cDepths[0]);
+
+    int failures=0;
+    for (size_t k=0; k<sizeof(cKinds)/sizeof(cKinds[0]); ++k) {
+        cout << std::left << std::setw(20) << std::string(cKinds[k].name)+" MB/s" << std::right;
+        for (size_t s=0; s<cSizeCount; ++s)
+            cout << std::setw(12) << std::to_string(cSizes[s]/1024)+" KB";
+        cout << endl;
+
+        double speed[cDepthCount][cSizeCount];
+        for (size_t d=0; d<cDepthCount; ++d) {
+            cout << std::left << std::setw(20) << "  depth "+std::to_string(cDepths[d]) << std::right;
+            for (size_t s=0; s<cSizeCount; ++s) {
+                const std::string text=cKinds[k].generate(cSizes[s], cDepths[d]);
+                double seconds[cStageCount];
+                size_t allocations[cStageCount], peaks[cStageCount];
+                measure(text, markdown::cScannerSpanParser, 3, seconds, allocations, peaks);
+                speed[d][s]=text.length()/(seconds[cRead]+seconds[cProcess]+seconds[cWrite])/1e6;
+                cout << std::fixed << std::setprecision(2) << std::setw(12) << speed[d][s];
+                if (speed[d][s]<speed[d][0]/2 || speed[d][s]<speed[0][s]/2) {
+                    cout << '*';
+                    ++failures;
+                }
+            }
+            cout << endl;
+        }
+    }
+    if (failures!=0) cerr << failures << " result(s) (marked *) didn't keep up with the input." << endl;
+    return (failures!=0 ? 1 : 0);
+}
+
+bool readFile(const std::string& path, std::string& text) {
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in) return false;
+    std::ostringstream s;
+    s << in.rdbuf();
+    text=s.str();
+    return true;
+}
+
+// One result per line: its name, then MB/s, allocations per KB, and peak
+// bytes per KB. Results saved before there were peaks don't have them, and
+// don't compare them.
+bool loadResults(const std::string& path, Results& results) {
+    std::ifstream in(path.c_str());
+    if (!in) return false;
+    std::string line, document, stage;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        Result r;
+        if (!(fields >> document >> stage >> r.mbPerSecond >> r.allocationsPerKB)) continue;
+        if (!(fields >> r.peakPerKB)) r.peakPerKB=-1;
+        results[document+' '+stage]=r;
+    }
+    return true;
+}
+
+bool saveResults(const std::string& path, const Results& results) {
+    std::ofstream out(path.c_str());
+    for (auto i=results.cbegin(), ie=results.cend(); i!=ie; ++i)
+        out << i->first << ' ' << i->second.mbPerSecond << ' '
+            << i->second.allocationsPerKB << ' ' << i->second.peakPerKB << '\n';
+    return static_cast<bool>(out);
+}
+
+void showHelp() {
+    cerr << "Usage: libmdcpp_bench [<option>...] [input-file...]\n"
+        "\n"
+        "    --save FILE         Save the results, to compare later ones with.\n"
+        "    --baseline FILE     Compare the results with saved ones, and fail if\n"
+        "                        any is slower, or allocates more, than allowed.\n"
+        "    --tolerance N       How much slower than the baseline (as a fraction)\n"
+        "                        a stage can be; the default is 0.25. Allocations\n"
+        "                        and peak memory don't depend on the machine, so\n"
+        "                        any more than 1% extra count as worse.\n"
+        "    --size N            Bytes in each built-in document; the default is\n"
+        "                        256 KB. Pass 0 to leave them out.\n"
+        "    --scaling           Instead, time nested lists and block quotes of\n"
+        "                        growing size and depth, and fail if any is less\n"
+        "                        than half as fast as the smallest or shallowest.\n";
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    std::string savePath, baselinePath;
+    double tolerance=0.25;
+    size_t size=256*1024;
+    std::vector<std::string> files;
+    for (int x=1; x<argc; ++x) {
+        std::string opt(argv[x]);
+        if (opt=="--scaling") return runScaling();
+        if ((opt=="--save" || opt=="--baseline" || opt=="--tolerance" || opt=="--size") && x+1<argc) {
+            std::string value(argv[++x]);
+            if (opt=="--save") savePath=value;
+            else if (opt=="--baseline") baselinePath=value;
+            else if (opt=="--tolerance") tolerance=std::atof(value.c_str());
+            else size=std::strtoul(value.c_str(), 0, 10);
+        } else if (opt[0]=='-') {
+            showHelp();
+            return 1;
+        } else files.push_back(opt);
+    }
+
+    std::vector<Input> inputs;
+    if (size!=0) {
+        Input generated[]= {
+            { "readme", readme(size) },
+            { "lists", lists(size) },
+            { "tables", tables(size) },
+            { "code", code(size) },
+            { "pathological", pathological(size) }
+        };
+        inputs.assign(generated, generated+sizeof(generated)/sizeof(generated[0]));
+    }
+    if (files.empty()) {
+        Input spec;
+        spec.name="spec";
+        if (readFile(LIBMDCPP_SOURCE_DIR "/test/CommonMark/spec.txt", spec.text))
+            inputs.push_back(spec);
+    }
+    for (auto i=files.cbegin(), ie=files.cend(); i!=ie; ++i) {
+        Input file;
+        file.name=i->substr(i->find_last_of("/\\")+1);
+        if (!readFile(*i, file.text)) {
+            cerr << "Error: Can't open file '" << *i << "'." << endl;
+            return 1;
+        }
+        inputs.push_back(file);
+    }
+
+    Results results, baseline;
+    if (!baselinePath.empty() && !loadResults(baselinePath, baseline)) {
+        cerr << "Error: Can't read the baseline '" << baselinePath << "'." << endl;
+        return 1;
+    }
+
+    int regressions=0;
+    cout << std::left << std::setw(36) << "document/parser stage" << std::right
+        << std::setw(10) << "MB/s" << std::setw(12) << "allocs/KB" << std::setw(12)
+        << "peak/KB" << endl;
+    for (auto i=inputs.cbegin(), ie=inputs.cend(); i!=ie; ++i) {
+        ResultList r;
+        run(*i, markdown::cRegexSpanParser, r);
+        run(*i, markdown::cScannerSpanParser, r);
+        for (auto j=r.cbegin(), je=r.cend(); j!=je; ++j) {
+            cout << std::left << std::setw(36) << j->first << std::right << std::fixed
+                << std::setprecision(2) << std::setw(10) << j->second.mbPerSecond
+                << std::setw(12) << j->second.allocationsPerKB << std::setw(12)
+                << j->second.peakPerKB;
+
+            Results::const_iterator b=baseline.find(j->first);
+            if (b!=baseline.end()) {
+                bool slower=(j->second.mbPerSecond<b->second.mbPerSecond*(1-tolerance));
+                bool bigger=(j->second.allocationsPerKB>b->second.allocationsPerKB*1.01+0.01);
+                bool fatter=(b->second.peakPerKB>=0 &&
+                    j->second.peakPerKB>b->second.peakPerKB*1.01+1);
+                cout << "  (was " << b->second.mbPerSecond << ", " << b->second.allocationsPerKB;
+                if (b->second.peakPerKB>=0) cout << ", " << b->second.peakPerKB;
+                cout << ')';
+                if (slower) cout << " slower";
+                if (bigger) cout << " allocates more";
+                if (fatter) cout << " needs more memory";
+                if (slower || bigger || fatter) ++regressions;
+            }
+            cout << endl;
+        }
+        results.insert(r.begin(), r.end());
+
+        if (markdown::DocumentStats::enabled()) {
+            showPhases(*i, markdown::cRegexSpanParser);
+            showPhases(*i, markdown::cScannerSpanParser);
+        }
+    }
+
+    if (!savePath.empty() && !saveResults(savePath, results)) {
+        cerr << "Error: Can't save the results to '" << savePath << "'." << endl;
+        return 1;
+    }
+    if (regressions!=0) {
+        cerr << regressions << " result(s) worse than the baseline." << endl;
+        return 1;
+    }
+    return 0;
+}
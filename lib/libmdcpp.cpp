@@ -1,6 +1,215 @@
 #include "libmdcpp.h"
 #include "markdown.h"
 
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <sstream>
+#include <thread>
+
+OutputSink& OutputSink::operator<<(size_t n) {
+    char digits[24];
+    char *p=digits+sizeof(digits);
+    do {
+        *--p='0'+n%10;
+        n/=10;
+    } while (n!=0);
+    write(p, digits+sizeof(digits)-p);
+    return *this;
+}
+
+StringSink::StringSink(string& target): mTarget(target) {
+    // Nothing is buffered until the first write, so that a sink that's never
+    // used leaves the string alone.
+}
+
+void StringSink::flush() {
+    if (mCurrent!=0) {
+        mTarget.resize(mCurrent-&mTarget[0]);
+        mCurrent=mEnd=0;
+    }
+}
+
+void StringSink::_grow(size_t needed) {
+    const size_t used=(mCurrent!=0 ? mCurrent-&mTarget[0] : mTarget.size());
+    size_t size=mTarget.capacity();
+    if (size<256) size=256;
+    while (size<used+needed) size*=2;
+    mTarget.resize(size);
+    mCurrent=&mTarget[0]+used;
+    mEnd=&mTarget[0]+size;
+}
+
+void StringSink::_overflow(const char *data, size_t size) {
+    _grow(size);
+    std::copy(data, data+size, mCurrent);
+    mCurrent+=size;
+}
+
+StreamSink::StreamSink(std::ostream& out): mOut(out) {
+    mCurrent=mBuffer;
+    mEnd=mBuffer+cBufferSize;
+}
+
+void StreamSink::flush() {
+    mOut.write(mBuffer, mCurrent-mBuffer);
+    mCurrent=mBuffer;
+}
+
+void StreamSink::_overflow(const char *data, size_t size) {
+    flush();
+    if (size<cBufferSize) {
+        std::copy(data, data+size, mCurrent);
+        mCurrent+=size;
+    } else mOut.write(data, size);
+}
+
+ChunkSink::ChunkSink(size_t chunkSize): mChunkSize(chunkSize) {
+}
+
+ChunkSink::~ChunkSink() {
+    clear();
+}
+
+const std::vector<ChunkSink::Chunk>& ChunkSink::chunks() {
+    _syncLastChunk();
+    return mChunks;
+}
+
+size_t ChunkSink::size() const {
+    size_t r=0;
+    for (size_t i=0; i+1<mChunks.size(); ++i) r+=mChunks[i].size;
+    if (!mBlocks.empty()) r+=mCurrent-mBlocks.back();
+    return r;
+}
+
+void ChunkSink::clear() {
+    for (size_t i=0; i<mBlocks.size(); ++i) std::free(mBlocks[i]);
+    mBlocks.clear();
+    mChunks.clear();
+    mCurrent=mEnd=0;
+}
+
+void ChunkSink::_syncLastChunk() {
+    if (!mBlocks.empty()) mChunks.back().size=mCurrent-mBlocks.back();
+}
+
+void ChunkSink::_overflow(const char *data, size_t size) {
+    // Whatever fits finishes the current block; the rest starts a new one,
+    // which is made big enough for all of it.
+    const size_t room=mEnd-mCurrent;
+    std::copy(data, data+room, mCurrent);
+    mCurrent+=room;
+    data+=room;
+    size-=room;
+    _syncLastChunk();
+
+    const size_t blockSize=(size>mChunkSize ? size : mChunkSize);
+    char *block=static_cast<char*>(std::malloc(blockSize));
+    if (block==0) throw std::bad_alloc();
+    mBlocks.push_back(block);
+    Chunk c={ block, 0 };
+    mChunks.push_back(c);
+    std::copy(data, data+size, block);
+    mCurrent=block+size;
+    mEnd=block+blockSize;
+}
+
+void SyntaxHighlighter::highlightAll(std::vector<Snippet>& snippets) {
+    for (auto i=snippets.begin(), ie=snippets.end(); i!=ie; ++i) {
+        std::ostringstream out;
+        highlight(i->code, i->lang, out);
+        i->html=out.str();
+    }
+}
+
+CachingHighlighter::CachingHighlighter(SyntaxHighlighter& highlighter, size_t maxBytes)
+    : mHighlighter(highlighter), mMaxBytes(maxBytes), mBytes(0), mHits(0), mMisses(0)
+{
+}
+
+void CachingHighlighter::highlight(const string& code, const string lang, std::ostream& out) {
+    Snippet snippet(code, lang);
+    if (!_find(snippet)) {
+        std::ostringstream html;
+        mHighlighter.highlight(code, lang, html);
+        snippet.html=html.str();
+        _add(snippet);
+    }
+    out << snippet.html;
+}
+
+void CachingHighlighter::highlightAll(std::vector<Snippet>& snippets) {
+    // Only the ones that aren't known go on to the other highlighter, in a
+    // batch of their own; the lock isn't held while it works on them.
+    std::vector<Snippet> unknown;
+    std::vector<size_t> unknownAt;
+    for (size_t i=0; i<snippets.size(); ++i) {
+        if (!_find(snippets[i])) {
+            unknown.push_back(snippets[i]);
+            unknownAt.push_back(i);
+        }
+    }
+    if (unknown.empty()) return;
+
+    mHighlighter.highlightAll(unknown);
+    for (size_t i=0; i<unknown.size(); ++i) {
+        _add(unknown[i]);
+        snippets[unknownAt[i]].html.swap(unknown[i].html);
+    }
+}
+
+size_t CachingHighlighter::hits() const {
+    std::lock_guard<std::mutex> guard(mLock);
+    return mHits;
+}
+
+size_t CachingHighlighter::misses() const {
+    std::lock_guard<std::mutex> guard(mLock);
+    return mMisses;
+}
+
+void CachingHighlighter::clear() {
+    std::lock_guard<std::mutex> guard(mLock);
+    mResults.clear();
+    mBytes=0;
+}
+
+bool CachingHighlighter::_find(Snippet& snippet) {
+    const string key=snippet.lang+'\n'+snippet.code;
+    std::lock_guard<std::mutex> guard(mLock);
+    auto found=mResults.find(key);
+    if (found==mResults.end()) {
+        ++mMisses;
+        return false;
+    }
+    ++mHits;
+    snippet.html=found->second;
+    return true;
+}
+
+void CachingHighlighter::_add(const Snippet& snippet) {
+    const size_t bytes=snippet.lang.size()+snippet.code.size()+snippet.html.size();
+    if (bytes>mMaxBytes) return;
+    std::lock_guard<std::mutex> guard(mLock);
+    if (mBytes+bytes>mMaxBytes) {
+        mResults.clear();
+        mBytes=0;
+    }
+    if (mResults.insert(std::make_pair(snippet.lang+'\n'+snippet.code, snippet.html)).second)
+        mBytes+=bytes;
+}
+
+void Dokumento::renderTo(string& target) {
+    target.clear();
+    StringSink sink(target);
+    write(sink);
+    sink.flush();
+}
+
 Procesoro::Procesoro(SyntaxHighlighter *highlighter, const string type)
 {
     if (type == "markdown") {
@@ -25,7 +234,123 @@ void Procesoro::write(std::ostream& aOstream)
     mDocument->write(aOstream);
 }
 
+void Procesoro::write(OutputSink& aSink)
+{
+    mDocument->write(aSink);
+}
+
+string Procesoro::renderToString()
+{
+    string r;
+    mDocument->renderTo(r);
+    return r;
+}
+
+void Procesoro::renderTo(string& target)
+{
+    mDocument->renderTo(target);
+}
+
+void Procesoro::reset()
+{
+    mDocument->reset();
+}
+
 
 Procesoro::~Procesoro() {
     delete mDocument;
 }
+
+namespace {
+
+// Hands out the indices of a batch. Every worker starts with an equal share
+// and takes from the front of it; one that runs dry steals the back half of
+// someone else's, so a few big documents can't leave the others idle.
+class WorkQueues {
+public:
+    WorkQueues(size_t count, size_t workers) {
+        for (size_t w=0; w<workers; ++w) {
+            mRanges.emplace_back(new Range);
+            mRanges.back()->begin=count*w/workers;
+            mRanges.back()->end=count*(w+1)/workers;
+        }
+    }
+
+    bool next(size_t worker, size_t& index) {
+        Range& own=*mRanges[worker];
+        {
+            std::lock_guard<std::mutex> guard(own.lock);
+            if (own.begin!=own.end) {
+                index=own.begin++;
+                return true;
+            }
+        }
+
+        // Only one lock is held at a time, so thieves can't deadlock.
+        for (size_t n=1; n<mRanges.size(); ++n) {
+            Range& victim=*mRanges[(worker+n)%mRanges.size()];
+            size_t begin, end;
+            {
+                std::lock_guard<std::mutex> guard(victim.lock);
+                if (victim.begin==victim.end) continue;
+                end=victim.end;
+                begin=victim.end-(victim.end-victim.begin+1)/2;
+                victim.end=begin;
+            }
+            std::lock_guard<std::mutex> guard(own.lock);
+            own.begin=begin+1;
+            own.end=end;
+            index=begin;
+            return true;
+        }
+        return false;
+    }
+
+private:
+    struct Range {
+        std::mutex lock;
+        size_t begin, end;
+    };
+
+    std::vector<std::unique_ptr<Range> > mRanges;
+};
+
+} // namespace
+
+std::vector<string> Procesoro::renderMany(const std::vector<string>& inputs,
+    SyntaxHighlighter *highlighter, const string type, size_t threads)
+{
+    std::vector<string> outputs(inputs.size());
+    if (type != "markdown" || inputs.empty()) return outputs;
+
+    if (threads==0) threads=std::thread::hardware_concurrency();
+    if (threads==0) threads=1;
+    if (threads>inputs.size()) threads=inputs.size();
+
+    WorkQueues queues(inputs.size(), threads);
+    std::exception_ptr error;
+    std::mutex errorLock;
+
+    auto worker=[&](size_t self) {
+        try {
+            markdown::Document doc(highlighter);
+            size_t i;
+            while (queues.next(self, i)) {
+                doc.reset();
+                doc.read(inputs[i]);
+                doc.renderTo(outputs[i]);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> guard(errorLock);
+            if (!error) error=std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t t=1; t<threads; ++t) pool.emplace_back(worker, t);
+    worker(0);
+    for (size_t t=0; t<pool.size(); ++t) pool[t].join();
+
+    if (error) std::rethrow_exception(error);
+    return outputs;
+}
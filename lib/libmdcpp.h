@@ -1,25 +1,192 @@
 #ifndef LIBMDCPP_H_INCLUDED
 #define LIBMDCPP_H_INCLUDED
 
+#include <algorithm>
+#include <cstring>
+#include <iosfwd>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 using std::string;
 
+// Where rendered HTML goes. Output is copied into a buffer that the sink
+// provides, and the sink itself is only called when that's full, so that
+// small writes don't cost a virtual call each.
+class OutputSink {
+public:
+    OutputSink(): mCurrent(0), mEnd(0) {}
+    virtual ~OutputSink() {}
+
+    void write(const char *data, size_t size) {
+        if (size<=static_cast<size_t>(mEnd-mCurrent)) {
+            std::copy(data, data+size, mCurrent);
+            mCurrent+=size;
+        } else _overflow(data, size);
+    }
+    void put(char c) {
+        if (mCurrent!=mEnd) *mCurrent++=c;
+        else _overflow(&c, 1);
+    }
+
+    OutputSink& operator<<(const string& s) { write(s.data(), s.size()); return *this; }
+    OutputSink& operator<<(const char *s) { write(s, std::strlen(s)); return *this; }
+    OutputSink& operator<<(char c) { put(c); return *this; }
+    OutputSink& operator<<(size_t n);
+
+    // Passes on anything that's still in the buffer.
+    virtual void flush() {}
+
+protected:
+    // Called when the data doesn't fit between mCurrent and mEnd. It has to
+    // take all of it, and normally sets up a new buffer.
+    virtual void _overflow(const char *data, size_t size)=0;
+
+    char *mCurrent, *mEnd;
+
+private:
+    OutputSink(const OutputSink&);
+    OutputSink& operator=(const OutputSink&);
+};
+
+// Appends to a string, writing straight into its spare capacity. The string
+// only has its final length after flush(), or once the sink is gone.
+class StringSink: public OutputSink {
+public:
+    explicit StringSink(string& target);
+    ~StringSink() { flush(); }
+
+    void flush() override;
+
+private:
+    void _overflow(const char *data, size_t size) override;
+    void _grow(size_t needed);
+
+    string& mTarget;
+};
+
+// The adapter for std::ostream; what goes into it reaches the stream in
+// blocks.
+class StreamSink: public OutputSink {
+public:
+    explicit StreamSink(std::ostream& out);
+    ~StreamSink() { flush(); }
+
+    void flush() override;
+
+private:
+    void _overflow(const char *data, size_t size) override;
+
+    static const size_t cBufferSize=8192;
+
+    std::ostream& mOut;
+    char mBuffer[cBufferSize];
+};
+
+// Keeps the output as a chain of blocks, which can be given to writev() (or
+// anything like it) without putting them together first.
+class ChunkSink: public OutputSink {
+public:
+    struct Chunk {
+        const char *data;
+        size_t size;
+    };
+
+    explicit ChunkSink(size_t chunkSize=cDefaultChunkSize);
+    ~ChunkSink();
+
+    // The chunks stay valid until the sink is cleared or destroyed.
+    const std::vector<Chunk>& chunks();
+    size_t size() const;
+    void clear();
+
+    static const size_t cDefaultChunkSize=16*1024;
+
+private:
+    void _overflow(const char *data, size_t size) override;
+    void _syncLastChunk();
+
+    const size_t mChunkSize;
+    std::vector<char*> mBlocks;
+    std::vector<Chunk> mChunks;
+};
+
+// A highlighter can be given to any number of documents. If they're written
+// on different threads, highlight() has to be safe to call from all of them
+// at once; the default one is. Documents without one just escape the code.
 class SyntaxHighlighter {
 public:
+    // One fenced code block with a language, for highlightAll().
+    struct Snippet {
+        Snippet(const string& code_, const string& lang_): code(code_), lang(lang_) {}
+
+        string code, lang;
+        string html; // What highlightAll() made of it
+    };
+
     SyntaxHighlighter() {}
     virtual ~SyntaxHighlighter() {}
     virtual void highlight(const string& code, const string lang, std::ostream& out) {
         out << code;
     }
+
+    // Highlights all of a document's code blocks at once, once it has been
+    // processed and before any of it is written; each block that's the same
+    // as another is only in there once. The default calls highlight() for
+    // each in turn. One that hands the work to something else can send it
+    // all in one go, or do them in parallel, instead.
+    virtual void highlightAll(std::vector<Snippet>& snippets);
+};
+
+// Remembers what another highlighter made of each (language, code) pair, so
+// repeated snippets, in one document or in many, are only highlighted once.
+// When the results add up to more than `maxBytes`, they're all forgotten and
+// it starts again. It can be shared by documents on different threads if the
+// other highlighter can.
+class CachingHighlighter: public SyntaxHighlighter {
+public:
+    explicit CachingHighlighter(SyntaxHighlighter& highlighter,
+        size_t maxBytes=cDefaultMaxBytes);
+
+    void highlight(const string& code, const string lang, std::ostream& out) override;
+    void highlightAll(std::vector<Snippet>& snippets) override;
+
+    size_t hits() const;
+    size_t misses() const;
+    void clear();
+
+    static const size_t cDefaultMaxBytes=16*1024*1024;
+
+private:
+    bool _find(Snippet& snippet);
+    void _add(const Snippet& snippet);
+
+    SyntaxHighlighter& mHighlighter;
+    const size_t mMaxBytes;
+    mutable std::mutex mLock;
+    std::unordered_map<string, string> mResults; // By language, '\n', code
+    size_t mBytes, mHits, mMisses;
 };
 
+// Separate documents (and Procesoros) share no mutable state, so they can be
+// read and written on different threads at the same time. A single one must
+// only be used by one thread at a time.
 class Dokumento {
 public:
     Dokumento() = default;
+    virtual ~Dokumento() { }
     virtual bool read(const string&) { return true; };
     virtual bool read(std::istream&) { return true; };
     virtual void write(std::ostream&) {};
+    virtual void write(OutputSink&) {};
+
+    // Writes the whole output into `target`, replacing what was in it but
+    // keeping its capacity.
+    virtual void renderTo(string& target);
+
+    // Gets ready to read a new document.
+    virtual void reset() {};
 };
 
 class Procesoro {
@@ -30,6 +197,24 @@ public:
     bool read(const string& aString);
     bool read(std::istream& aIstream);
     void write(std::ostream& aOstream);
+    void write(OutputSink& aSink);
+
+    // The output as one string, which documents that can tell how big it
+    // will be allocate only once; renderTo() writes it into a buffer the
+    // caller keeps between documents.
+    string renderToString();
+    void renderTo(string& target);
+
+    // Starts over with a new document, keeping the memory the last one used.
+    void reset();
+
+    // Renders every input on its own and returns the outputs in the same
+    // order. The work is spread over `threads` threads (0 means one per
+    // core), each of which reset()s one document for every input; the
+    // highlighter is shared by all of them. Only "markdown" is handled so
+    // far, anything else gives empty outputs.
+    static std::vector<string> renderMany(const std::vector<string>& inputs,
+        SyntaxHighlighter *highlighter, const string type="markdown", size_t threads=0);
     
 private:
     Dokumento *mDocument;
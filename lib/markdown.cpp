@@ -6,88 +6,122 @@
 */
 
 #include "markdown.h"
+#include "markdown_binary.h"
+#include "markdown_html.h"
+#include "markdown_regex.h"
 #include "markdown_tokens.h"
 
 #include <sstream>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
 
 #include <boost/regex.hpp>
 #include <boost/lexical_cast.hpp>
-#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/noncopyable.hpp>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 using std::cerr;
 using std::endl;
 using boost::regex;
-using boost::smatch;
-using boost::regex_match;
-using boost::regex_search;
+using boost::cmatch;
+using boost::csub_match;
+using markdown::regex_match;
+using markdown::regex_search;
 
 using boost::optional;
 using boost::none;
+using markdown::string_view;
 using markdown::TokenPtr;
 using markdown::CTokenGroupIter;
 
 namespace {
 
+#ifndef _WIN32
+// A read-only view of a whole file, unmapped when the arena that holds it is
+// cleared.
+class MappedFile: public boost::noncopyable {
+public:
+    MappedFile(void *data, size_t size): mData(data), mSize(size) { }
+    ~MappedFile() { munmap(mData, mSize); }
+
+    string_view view() const { return string_view(static_cast<const char*>(mData), mSize); }
+
+private:
+    void *mData;
+    size_t mSize;
+};
+#endif
+
 struct HtmlTagInfo {
     string tagName, extra;
     bool isClosingTag;
     size_t lengthOfToken; // In original string
 };
 
-const string cHtmlTokenSource("<((/?)([a-zA-Z0-9]+)(?:( +[a-zA-Z0-9]+?(?: ?= ?(\"|').*?\\5))*? */? *))>");
-const regex cHtmlTokenExpression(cHtmlTokenSource),
-      cStartHtmlTokenExpression("^"+cHtmlTokenSource),
-      cOneHtmlTokenExpression("^"+cHtmlTokenSource+"$");
-
 enum ParseHtmlTagFlags { cAlone, cStarts };
 
-optional<HtmlTagInfo> parseHtmlTag(string::const_iterator begin,
-                                   string::const_iterator end, ParseHtmlTagFlags flags)
+// A tag at the start of a line, or one that's all there is on it.
+optional<HtmlTagInfo> parseHtmlTag(const char *begin, const char *end,
+                                   ParseHtmlTagFlags flags)
 {
-    smatch m;
-    if (regex_search(begin, end, m, (flags==cAlone ?
-                                     cOneHtmlTokenExpression : cStartHtmlTokenExpression)))
-    {
+    markdown::HtmlTagLexer lexer(string_view(begin, end-begin), (flags==cAlone ?
+        markdown::HtmlTagLexer::cLineEnd : markdown::HtmlTagLexer::cAnywhere));
+    markdown::HtmlTagLexer::Tag tag;
+    if (lexer.search(0, tag, true)) {
         HtmlTagInfo r;
-        r.tagName=m[3];
-        if (m[4].matched) r.extra = m[4];
-        r.isClosingTag = (m[2].length()>0);
-        r.lengthOfToken = m[0].length();
+        r.tagName=tag.name.to_string();
+        r.extra=tag.lastAttribute.to_string();
+        r.isClosingTag=tag.closing;
+        r.lengthOfToken=tag.end-tag.begin;
         return r;
     }
     return none;
 }
 
-markdown::TokenGroup parseInlineHtmlText(const string& src) {
+markdown::TokenGroup parseInlineHtmlText(string_view src, markdown::Arena& arena) {
     markdown::TokenGroup r;
-    auto prev=src.cbegin(), end=src.cend();
+    markdown::HtmlTagLexer lexer(src);
+    size_t prev=0;
     while (1) {
-        smatch m;
-        if (regex_search(prev, end, m, cHtmlTokenExpression)) {
-            if (prev!=m[0].first) {
-                //cerr << "  Non-tag (" << std::distance(prev, m[0].first) << "): " << string(prev, m[0].first) << endl;
-                r.push_back(TokenPtr(new markdown::token::InlineHtmlContents(string(prev, m[0].first))));
+        markdown::HtmlTagLexer::Tag tag;
+        if (lexer.search(prev, tag)) {
+            if (prev!=tag.begin) {
+                //cerr << "  Non-tag (" << tag.begin-prev << "): " << src.substr(prev, tag.begin-prev) << endl;
+                r.push_back(arena.make<markdown::token::InlineHtmlContents>(src.substr(prev, tag.begin-prev).to_string()));
             }
-            //cerr << "  Tag: " << m[1] << endl;
-            r.push_back(TokenPtr(new markdown::token::HtmlTag(m[1])));
-            prev=m[0].second;
+            r.push_back(arena.make<markdown::token::HtmlTag>(src.substr(tag.begin+1, tag.end-tag.begin-2).to_string()));
+            prev=tag.end;
         } else {
             string eol;
-            if (prev!=end) {
-                eol=string(prev, end);
+            if (prev!=src.size()) {
+                eol=src.substr(prev).to_string();
                 //cerr << "  Non-tag: " << eol << endl;
             }
             eol+='\n';
-            r.push_back(TokenPtr(new markdown::token::InlineHtmlContents(eol)));
+            r.push_back(arena.make<markdown::token::InlineHtmlContents>(eol));
             break;
         }
     }
     return r;
 }
 
-bool isHtmlCommentStart(string::const_iterator begin,
-                        string::const_iterator end)
+bool isHtmlCommentStart(const char *begin, const char *end)
 {
     // It can't be a single-line comment, those will already have been parsed
     // by isBlankLine.
@@ -95,22 +129,32 @@ bool isHtmlCommentStart(string::const_iterator begin,
     return regex_search(begin, end, cExpression);
 }
 
-bool isHtmlCommentEnd(string::const_iterator begin,
-                      string::const_iterator end)
+bool isHtmlCommentEnd(const char *begin, const char *end)
 {
     static const regex cExpression(".*-- *>$");
     return regex_match(begin, end, cExpression);
 }
 
-bool isBlankLine(const string& line) {
+bool isBlankLine(string_view line) {
+    // Only a line with a comment in it needs the expression; a long run of
+    // spaces, without one, makes it backtrack for nothing.
     static const regex cExpression(" {0,3}(<--(.*)-- *> *)* *");
-    return regex_match(line, cExpression);
+    const size_t text=line.find_first_not_of(' ');
+    if (text==string_view::npos) return true;
+    if (line[text]!='<') return false;
+    return regex_match(line.begin(), line.end(), cExpression);
+}
+
+// Sub-matches of regexes run on a token's text can be handed on as views,
+// since the text outlives the line.
+string_view matchedView(const csub_match& m) {
+    return string_view(m.first, m.length());
 }
 
-optional<TokenPtr> parseInlineHtml(CTokenGroupIter& i, CTokenGroupIter end) {
+optional<TokenPtr> parseInlineHtml(CTokenGroupIter& i, CTokenGroupIter end, markdown::Arena& arena) {
     // Preconditions: Previous line was blank, or this is the first line.
     if ((*i)->text()) {
-        const string& line(*(*i)->text());
+        string_view line(*(*i)->text());
 
         bool tag = false, comment = false;
         optional<HtmlTagInfo> tagInfo = parseHtmlTag(line.cbegin(), line.cend(), cStarts);
@@ -132,8 +176,8 @@ optional<TokenPtr> parseInlineHtml(CTokenGroupIter& i, CTokenGroupIter end) {
                 // We encode HTML tags so that their contents gets properly
                 // handled -- i.e. "<div style=">"/>" becomes <div style="&gt;"/>
                 if ((*i)->text()) {
-                    markdown::TokenGroup t = parseInlineHtmlText(*(*i)->text());
-                    contents.splice(contents.end(), t);
+                    markdown::TokenGroup t = parseInlineHtmlText(*(*i)->text(), arena);
+                    contents.insert(contents.end(), t.begin(), t.end());
                 } else contents.push_back(*i);
 
                 prevLine = i;
@@ -144,7 +188,7 @@ optional<TokenPtr> parseInlineHtml(CTokenGroupIter& i, CTokenGroupIter end) {
                     if (prevLine == firstLine) {
                         done=true;
                     } else {
-                        const string& text(*(*prevLine)->text());
+                        string_view text(*(*prevLine)->text());
                         if (parseHtmlTag(text.cbegin(), text.cend(), cAlone))
                             done=true;
                     }
@@ -153,7 +197,7 @@ optional<TokenPtr> parseInlineHtml(CTokenGroupIter& i, CTokenGroupIter end) {
 
             if (lines>1 || markdown::token::isValidTag(tagInfo->tagName, true)>1) {
                 i=prevLine;
-                return TokenPtr(new markdown::token::InlineHtmlBlock(contents));
+                return arena.make<markdown::token::InlineHtmlBlock>(contents);
             } else {
                 // Single-line HTML "blocks" whose initial tags are span-tags
                 // don't qualify as inline HTML.
@@ -169,7 +213,7 @@ optional<TokenPtr> parseInlineHtml(CTokenGroupIter& i, CTokenGroupIter end) {
 
             bool done=false;
             do {
-                if ((*i)->text()) contents.push_back(TokenPtr(new markdown::token::InlineHtmlComment(*(*i)->text()+'\n')));
+                if ((*i)->text()) contents.push_back(arena.make<markdown::token::InlineHtmlComment>((*i)->text()->to_string()+'\n'));
                 else contents.push_back(*i);
 
                 prevLine=i;
@@ -179,13 +223,13 @@ optional<TokenPtr> parseInlineHtml(CTokenGroupIter& i, CTokenGroupIter end) {
                     if (prevLine==firstLine) {
                         done=true;
                     } else {
-                        const string& text(*(*prevLine)->text());
+                        string_view text(*(*prevLine)->text());
                         if (isHtmlCommentEnd(text.begin(), text.end())) done=true;
                     }
                 }
             } while (i!=end && !done);
             i=prevLine;
-            return TokenPtr(new markdown::token::InlineHtmlBlock(contents));
+            return arena.make<markdown::token::InlineHtmlBlock>(contents);
         }
     }
 
@@ -197,17 +241,25 @@ optional<TokenPtr> parseInlineHtml(CTokenGroupIter& i, CTokenGroupIter end) {
  */
 optional<string> isCodeBlockLine(CTokenGroupIter& i, CTokenGroupIter end) {
     if ((*i)->isBlankLine()) {
-        // If we get here, we're already in a code block.
-        ++i;
-        if (i!=end) {
-            optional<string> r=isCodeBlockLine(i, end);
-            if (r) return string("\n"+*r);
+        // If we get here, we're already in a code block. The blank lines are
+        // only part of it if more of it comes after them.
+        auto ii=i;
+        size_t blanks=0;
+        while (ii!=end && (*ii)->isBlankLine()) {
+            ++ii;
+            ++blanks;
+        }
+        if (ii!=end) {
+            optional<string> r=isCodeBlockLine(ii, end);
+            if (r) {
+                i=ii;
+                return string(blanks, '\n')+*r;
+            }
         }
-        --i;
     } else if ((*i)->text() && (*i)->canContainMarkup()) {
         // test if the line starts with 4 spaces
         // tabs behave as if replaced by spaces with a tab stop of 4 characters
-        const string& line(*(*i)->text());
+        string_view line(*(*i)->text());
         if (line.length() >= 4) {
             auto si = line.begin(), sie = si+4;
             int cnt = 0;
@@ -229,7 +281,7 @@ optional<string> isCodeBlockLine(CTokenGroupIter& i, CTokenGroupIter end) {
     return none;
 }
 
-optional<TokenPtr> parseCodeBlock(CTokenGroupIter& i, CTokenGroupIter end) {
+optional<TokenPtr> parseCodeBlock(CTokenGroupIter& i, CTokenGroupIter end, markdown::Arena& arena) {
     if (!(*i)->isBlankLine()) {
         optional<string> contents=isCodeBlockLine(i, end);
         if (contents) {
@@ -241,20 +293,20 @@ optional<TokenPtr> parseCodeBlock(CTokenGroupIter& i, CTokenGroupIter end) {
                 else break;
             }
             i--;
-            return TokenPtr(new markdown::token::CodeBlock(out.str()));
+            return arena.make<markdown::token::CodeBlock>(out.str());
         }
     }
     return none;
 }
 
-bool isCodeFenceBeginLine(const string& line, int& indent, int& length, char& fence, string& info) {
+bool isCodeFenceBeginLine(string_view line, int& indent, int& length, char& fence, string& info) {
     indent = 0;
     auto si = line.begin(), sie = line.end();
     while (si!=sie && *si==' ') {
         si++;
         indent++;
     }
-    if (indent > 3)
+    if (indent > 3 || si==sie)
         return false;
 
 
@@ -282,7 +334,7 @@ bool isCodeFenceBeginLine(const string& line, int& indent, int& length, char& fe
     return true;
 }
 
-bool isCodeFenceEndLine(const string& line, int indent, int openLen, char fence, std::ostringstream& out) {
+bool isCodeFenceEndLine(string_view line, int indent, int openLen, char fence, std::ostringstream& out) {
     int maxIndent = 0;
     auto si = line.begin(), sie = line.end();
     while (si!=sie && *si==' ' && indent) {
@@ -320,42 +372,243 @@ bool isCodeFenceEndLine(const string& line, int indent, int openLen, char fence,
     return true;
 }
 
-bool parseBlockQuote(markdown::TokenGroup& subTokens,CTokenGroupIter& i, CTokenGroupIter end) {
-    static const regex cBlockQuoteExpression("^( {0,3}> ?)(.*)$");
-    // Useful captures: 1=prefix, 2=content
+// Splits text into lines at \n, \r, \r\n or \n\r, whichever is there. Most
+// text has no \r at all, so it's only looked for again once the last one
+// found has been passed.
+class LineSplitter {
+public:
+    LineSplitter(const char *begin, const char *end): mPos(begin), mEnd(end),
+        mCr(static_cast<const char*>(std::memchr(begin, '\r', end-begin))) { }
+
+    // Gets the next line, without its ending. With `needEnding`, a line only
+    // counts once the character after its ending is there too, so that it's
+    // known whether the ending is one character or two.
+    bool next(string_view& line, bool needEnding=false) {
+        if (mPos==mEnd) return false;
+        if (mCr!=0 && mCr<mPos) mCr=static_cast<const char*>(std::memchr(mPos, '\r', mEnd-mPos));
+        const char *lineEnd=static_cast<const char*>(std::memchr(mPos, '\n', (mCr!=0 ? mCr : mEnd)-mPos));
+        if (lineEnd==0) lineEnd=(mCr!=0 ? mCr : mEnd);
+        if (needEnding && mEnd-lineEnd<2) return false;
+
+        line=string_view(mPos, lineEnd-mPos);
+        mPos=lineEnd;
+        if (mPos!=mEnd) {
+            const char other=(*mPos=='\n' ? '\r' : '\n');
+            if (++mPos!=mEnd && *mPos==other) ++mPos;
+        }
+        return true;
+    }
+
+    // Where the next line starts.
+    const char* position() const { return mPos; }
+
+private:
+    const char *mPos, *mEnd, *mCr;
+};
+
+// The same test as isCodeFenceEndLine, for DocumentStream, which only needs
+// to know where the block ends.
+bool closesCodeFence(string_view line, int openLen, char fence) {
+    auto si=line.begin(), sie=line.end();
+    int indent=0;
+    while (si!=sie && *si==' ' && indent<4) {
+        si++;
+        indent++;
+    }
+    if (indent>3) return false;
+
+    int closeLen=0;
+    while (si!=sie && *si==fence) {
+        si++;
+        closeLen++;
+    }
+    if (closeLen<openLen) return false;
+
+    while (si!=sie && (*si==' ' || *si=='\t')) si++;
+    return (si==sie);
+}
+
+// Whether a line that follows a blank one can only be the start of a new
+// top-level block. Anything indented, and anything that could carry on a
+// list or a block quote, might still belong to the one before.
+bool canOnlyStartBlock(string_view line) {
+    const char c=line[0];
+    return !(c==' ' || c=='\t' || c=='>' || c=='*' || c=='+' || c=='-' ||
+             (c>='0' && c<='9'));
+}
 
+// Whether a piece has a line that might be a reference definition (see
+// parseReference). It's only a hint, so it errs on the side of yes.
+bool mightDefineReference(string_view piece) {
+    if (!markdown::Features::cReferences) return false;
+    LineSplitter lines(piece.begin(), piece.end());
+    string_view line;
+    while (lines.next(line)) {
+        const size_t indent=line.find_first_not_of(' ');
+        if (indent<=3 && line[indent]=='[' && line.find("]:", indent)!=string_view::npos)
+            return true;
+    }
+    return false;
+}
+
+// FNV-1a, with 64 bits so that two different blocks don't get the same key
+// by chance. The length goes in last, so that where one piece of text ends
+// and the next begins makes a difference too.
+markdown::FragmentCache::Key fragmentHash(string_view s, markdown::FragmentCache::Key h) {
+    const markdown::FragmentCache::Key cPrime=1099511628211ULL;
+    for (auto i=s.begin(), ie=s.end(); i!=ie; ++i) {
+        h^=static_cast<unsigned char>(*i);
+        h*=cPrime;
+    }
+    return (h^s.size())*cPrime;
+}
+
+markdown::FragmentCache::Key fragmentSettingsHash(size_t parser, size_t spacesPerTab,
+    size_t maxNesting, size_t maxDelimiters)
+{
+    const size_t settings[]={ parser, spacesPerTab, maxNesting, maxDelimiters };
+    return fragmentHash(string_view(reinterpret_cast<const char*>(settings), sizeof(settings)),
+        14695981039346656037ULL);
+}
+
+unsigned int foldTwoByteCharacter(unsigned int c) {
+    // The upper-case letters of the alphabets whose characters all take two
+    // bytes in UTF-8, and whose lower-case ones do too.
+    if (c>=0xC0 && c<=0xDE && c!=0xD7) return c+0x20; // Latin-1
+    if ((c>=0x100 && c<=0x137 && c!=0x130) || (c>=0x14A && c<=0x177))
+        return (c%2==0 ? c+1 : c); // Latin Extended-A, in pairs
+    if ((c>=0x139 && c<=0x148) || (c>=0x179 && c<=0x17E))
+        return (c%2==1 ? c+1 : c);
+    if (c==0x178) return 0xFF;
+    if (c>=0x391 && c<=0x3A9 && c!=0x3A2) return c+0x20; // Greek
+    if (c==0x3C2) return 0x3C3; // Final sigma
+    if (c>=0x410 && c<=0x42F) return c+0x20; // Cyrillic
+    if (c>=0x400 && c<=0x40F) return c+0x50;
+    return c;
+}
+
+// Case-folds the character at `i` into `out`, and moves past it. Returns how
+// many bytes it took, which folding never changes. Anything that isn't ASCII
+// or one of the alphabets above (or isn't valid UTF-8) is left alone.
+size_t foldCharacter(string_view s, size_t& i, char *out) {
+    const unsigned char c=s[i];
+    if (c>=0xC0 && c<0xE0 && i+1<s.size() && (s[i+1]&0xC0)==0x80) {
+        const unsigned int f=foldTwoByteCharacter(((c&0x1F)<<6)|(s[i+1]&0x3F));
+        out[0]=static_cast<char>(0xC0|(f>>6));
+        out[1]=static_cast<char>(0x80|(f&0x3F));
+        i+=2;
+        return 2;
+    }
+    out[0]=static_cast<char>(c>='A' && c<='Z' ? c+('a'-'A') : c);
+    ++i;
+    return 1;
+}
+
+// Throws away whatever is written to it.
+class DiscardSink: public OutputSink {
+protected:
+    void _overflow(const char*, size_t) override { }
+};
+
+
+// What the first character of a line, after up to three spaces, says about
+// the blocks it could start. The parsers for the others needn't be tried.
+enum BlockStarts { cFenceStart=1, cQuoteStart=2, cRuleStart=4, cListStart=8,
+    cHeaderStart=0x10, cUnderlineStart=0x20 };
+
+struct BlockStartTable {
+    BlockStartTable() {
+        std::fill(starts, starts+256, 0);
+        starts['`']=starts['~']=cFenceStart;
+        starts['>']=cQuoteStart;
+        starts['*']=cRuleStart|cListStart;
+        starts['-']=cRuleStart|cListStart|cUnderlineStart;
+        starts['_']=cRuleStart;
+        starts['+']=cListStart;
+        for (int c='0'; c<='9'; ++c) starts[c]=cListStart;
+        starts['#']=cHeaderStart;
+        starts['=']=cUnderlineStart;
+    }
+
+    unsigned char starts[256];
+};
+
+const BlockStartTable cBlockStartTable;
+
+unsigned int blockStarts(TokenPtr t) {
+    if (t->isBlankLine() || !t->text() || !t->canContainMarkup()) return 0;
+    const string_view line=*t->text();
+    size_t indent=0;
+    while (indent<line.size() && indent<4 && line[indent]==' ') ++indent;
+    if (indent>3 || indent==line.size()) return 0;
+    return cBlockStartTable.starts[static_cast<unsigned char>(line[indent])];
+}
+
+// How long the `>` that starts a line of a block quote is, with the spaces
+// around it, as "^( {0,3}> ?)(.*)$" would match it; 0 if the line isn't one.
+// Only the start of the line is looked at, so the lines of quotes within
+// quotes aren't read to the end again at every level.
+size_t blockQuotePrefix(string_view line) {
+    size_t p=0;
+    while (p<line.size() && p<3 && line[p]==' ') ++p;
+    if (p==line.size() || line[p]!='>') return 0;
+    ++p;
+    if (p<line.size() && line[p]==' ') ++p;
+    return p;
+}
+
+bool parseBlockQuote(markdown::TokenGroup& subTokens,CTokenGroupIter& i, CTokenGroupIter end, markdown::Arena& arena) {
     if (!(*i)->isBlankLine() && (*i)->text() && (*i)->canContainMarkup()) {
-        const string& line(*(*i)->text());
-        smatch m;
-        if (regex_match(line, m, cBlockQuoteExpression)) {
-            if (!isBlankLine(m[2]))
-                subTokens.push_back(TokenPtr(new markdown::token::RawText(m[2], m[1].length()+(*i)->pos())));
-            else
-                subTokens.push_back(TokenPtr(new markdown::token::BlankLine(m[2])));
-            
-            ++i;
-            while (i!=end) {
-                const string& line(*(*i)->text());
-                if (regex_match(line, m, cBlockQuoteExpression)) {
-                    assert(m[2].matched);
-                    if (!isBlankLine(m[2]))
-                        subTokens.push_back(TokenPtr(new markdown::token::RawText(m[2], m[1].length()+(*i)->pos())));
-                    else
-                        subTokens.push_back(TokenPtr(new markdown::token::BlankLine(m[2])));
-                    ++i;
-                } else {
-                    //--i;
-                    break;
-                }
-            }
+        string_view line(*(*i)->text());
+        size_t prefix=blockQuotePrefix(line);
+        if (prefix!=0) {
+            while (true) {
+                string_view content=line.substr(prefix);
+                if (!isBlankLine(content))
+                    subTokens.push_back(arena.make<markdown::token::RawText>(content, prefix+(*i)->pos()));
+                else
+                    subTokens.push_back(arena.make<markdown::token::BlankLine>(content));
 
+                if (++i==end || !(*i)->text()) break;
+                line=*(*i)->text();
+                prefix=blockQuotePrefix(line);
+                if (prefix==0) break;
+            }
             return true;
         }
     }
     return false;
 }
 
-optional<TokenPtr> parseListBlock(CTokenGroupIter& i, CTokenGroupIter& end) {
+// Where the text of a line starts if it begins another item of a list, as
+// "^( {0,3})c( +)(.*)$" would match it for an unordered list that uses `c`,
+// and "^( {0,3}[0-9]+)c( +)(.*)$" for an ordered one; 0 if it doesn't. This,
+// and not a regex made for each list, keeps the work for each line down to
+// its start.
+size_t nextListItemIndent(string_view line, bool ordered, char c) {
+    size_t p=0;
+    while (p<line.size() && p<3 && line[p]==' ') ++p;
+    if (ordered) {
+        const size_t digits=p;
+        while (p<line.size() && line[p]>='0' && line[p]<='9') ++p;
+        if (p==digits) return 0;
+    }
+    if (p==line.size() || line[p]!=c) return 0;
+    const size_t spaces=++p;
+    while (p<line.size() && line[p]==' ') ++p;
+    return (p>spaces ? p : 0);
+}
+
+// Whether the line starts with at least `indent` spaces, as "^ {indent}(.*)$"
+// would match it.
+bool isListContinuation(string_view line, size_t indent) {
+    if (line.size()<indent) return false;
+    for (size_t p=0; p<indent; ++p)
+        if (line[p]!=' ') return false;
+    return true;
+}
+
+optional<TokenPtr> parseListBlock(CTokenGroupIter& i, CTokenGroupIter& end, markdown::Arena& arena) {
     static const regex cUnorderedListExpression("^( {0,3})([*+-])( +)([^*-].*)$");
     static const regex cOrderedListExpression("^( {0,3})([0-9]+)([.)])( +)(.*)$");
     
@@ -363,41 +616,26 @@ optional<TokenPtr> parseListBlock(CTokenGroupIter& i, CTokenGroupIter& end) {
     ListType type = cNone;
     if (!(*i)->isBlankLine() && (*i)->text() && (*i)->canContainMarkup()) {
         bool isLooseOrTight = false;
-        regex nextItemExpression, nextContentExpression;
+        char startChar = 0;
         size_t indent = 0;
-        const string& firstLine(*(*i)->text());
+        string_view firstLine(*(*i)->text());
         markdown::TokenGroup contentTokens, itemTokens;
-        std::ostringstream next;
         
-        smatch m;
-        if (regex_match(firstLine, m, cUnorderedListExpression)) {
+        cmatch m;
+        if (regex_match(firstLine.begin(), firstLine.end(), m, cUnorderedListExpression)) {
             type = cUnordered;
-            char startChar = *m[2].first;
+            startChar = *m[2].first;
             indent = m[1].length() + m[3].length() + 1;
-            contentTokens.push_back(TokenPtr(new markdown::token::RawText(m[4].str(), (*i)->pos()+indent)));
-            
-            next << "^( {0,3})\\" << startChar << "( +)(.*)$";
-            nextItemExpression = next.str();
-            next.str("");
-            next.clear();
-        } else if (regex_match(firstLine, m, cOrderedListExpression)) {
+            contentTokens.push_back(arena.make<markdown::token::RawText>(matchedView(m[4]), (*i)->pos()+indent));
+        } else if (regex_match(firstLine.begin(), firstLine.end(), m, cOrderedListExpression)) {
             type = cOrdered;
-            char startChar = *m[3].first;
+            startChar = *m[3].first;
             indent = m[1].length() + m[2].length() + m[4].length() + 1;
-            contentTokens.push_back(TokenPtr(new markdown::token::RawText(m[5].str(), (*i)->pos()+indent)));
-            
-            next << "^( {0,3}[0-9]+)\\" << startChar << "( +)(.*)$";
-            nextItemExpression = next.str();
-            next.str("");
-            next.clear();
+            contentTokens.push_back(arena.make<markdown::token::RawText>(matchedView(m[5]), (*i)->pos()+indent));
         }
         
         if (type == cNone)
             return none;
-        next << "^ {" << indent << "}(.*)$";
-        nextContentExpression = next.str();
-        next.str("");
-        next.clear();
         ++i;
         bool isPrevBlankLine = false;
         while (i != end) {
@@ -418,11 +656,11 @@ optional<TokenPtr> parseListBlock(CTokenGroupIter& i, CTokenGroupIter& end) {
                 continue;
             }
             
-            const string& line(*(*i)->text());
-            if (regex_match(line, m, nextContentExpression)) {
+            string_view line(*(*i)->text());
+            if (isListContinuation(line, indent)) {
                 if (isPrevBlankLine)
-                    contentTokens.push_back(TokenPtr(new markdown::token::BlankLine()));
-                contentTokens.push_back(TokenPtr(new markdown::token::RawText(m[1].str(), (*i)->pos()+indent)));
+                    contentTokens.push_back(arena.make<markdown::token::BlankLine>());
+                contentTokens.push_back(arena.make<markdown::token::RawText>(line.substr(indent), (*i)->pos()+indent));
                 ++i;
                 // if one of the items directly contains two block-level
                 // elements with a blank line between them, the lists are loose
@@ -430,15 +668,12 @@ optional<TokenPtr> parseListBlock(CTokenGroupIter& i, CTokenGroupIter& end) {
                 isPrevBlankLine = false;
                 continue;
             }
-            if (regex_match(line, m, nextItemExpression)) {
-                itemTokens.push_back(TokenPtr(new markdown::token::ListItem(contentTokens)));
+            const size_t itemIndent = nextListItemIndent(line, type == cOrdered, startChar);
+            if (itemIndent != 0) {
+                itemTokens.push_back(arena.make<markdown::token::ListItem>(contentTokens));
                 contentTokens.clear();
-                indent = m[1].length() + m[2].length() + 1;
-                contentTokens.push_back(TokenPtr(new markdown::token::RawText(m[3].str(), (*i)->pos()+indent)));
-                next << "^ {" << indent << "}(.*)$";
-                nextContentExpression = next.str();
-                next.str("");
-                next.clear();
+                indent = itemIndent;
+                contentTokens.push_back(arena.make<markdown::token::RawText>(line.substr(indent), (*i)->pos()+indent));
                 ++i;
                 // if a blank line is between two of the list items
                 // the lists are loose
@@ -452,13 +687,13 @@ optional<TokenPtr> parseListBlock(CTokenGroupIter& i, CTokenGroupIter& end) {
             break;
         } // end of while loop
         assert(!contentTokens.empty());
-        itemTokens.push_back(TokenPtr(new markdown::token::ListItem(contentTokens)));
+        itemTokens.push_back(arena.make<markdown::token::ListItem>(contentTokens));
         contentTokens.clear();
         
         if (type == cUnordered)
-            return TokenPtr(new markdown::token::UnorderedList(itemTokens, isLooseOrTight));
+            return arena.make<markdown::token::UnorderedList>(itemTokens, isLooseOrTight);
         else if (type == cOrdered)
-            return TokenPtr(new markdown::token::OrderedList(itemTokens, isLooseOrTight));
+            return arena.make<markdown::token::OrderedList>(itemTokens, isLooseOrTight);
     }
     return none;
 }
@@ -468,9 +703,9 @@ bool parseReference(CTokenGroupIter& i, CTokenGroupIter end, markdown::LinkIds &
         static const regex cReference("^ {0,3}\\[(.+)\\]: +<?([^ >]+)>?(?: *(?:('|\")(.*)\\3)|(?:\\((.*)\\)))?$");
         // Useful captures: 1=id, 2=url, 4/5=title
 
-        const string& line1(*(*i)->text());
-        smatch m;
-        if (regex_match(line1, m, cReference)) {
+        string_view line1(*(*i)->text());
+        cmatch m;
+        if (regex_match(line1.begin(), line1.end(), m, cReference)) {
             string id(m[1]), url(m[2]), title;
             if (m[4].matched) title=m[4];
             else if (m[5].matched) title=m[5];
@@ -482,8 +717,8 @@ bool parseReference(CTokenGroupIter& i, CTokenGroupIter end, markdown::LinkIds &
                     static const regex cSeparateTitle("^ *(?:(?:('|\")(.*)\\1)|(?:\\((.*)\\))) *$");
                     // Useful Captures: 2/3=title
 
-                    const string& line2(*(*ii)->text());
-                    if (regex_match(line2, m, cSeparateTitle)) {
+                    string_view line2(*(*ii)->text());
+                    if (regex_match(line2.begin(), line2.end(), m, cSeparateTitle)) {
                         ++i;
                         title=(m[2].matched ? m[2] : m[3]);
                     }
@@ -498,30 +733,31 @@ bool parseReference(CTokenGroupIter& i, CTokenGroupIter end, markdown::LinkIds &
 }
 
 void flushParagraph(markdown::TokenGroup& paragraphTokens,
-                    markdown::TokenGroup& finalTokens, bool noParagraphs)
+                    markdown::TokenGroup& finalTokens, bool noParagraphs,
+                    markdown::Arena& arena)
 {
     if (!paragraphTokens.empty()) {
         if (noParagraphs) {
             if (paragraphTokens.size()>1) {
-                finalTokens.push_back(TokenPtr(new markdown::token::Container(paragraphTokens)));
+                finalTokens.push_back(arena.make<markdown::token::Container>(paragraphTokens));
             } else
                 finalTokens.push_back(*paragraphTokens.begin());
         } else
-            finalTokens.push_back(TokenPtr(new markdown::token::Paragraph(paragraphTokens)));
+            finalTokens.push_back(arena.make<markdown::token::Paragraph>(paragraphTokens));
         paragraphTokens.clear();
     }
 }
 
-optional<TokenPtr> parseHeader(CTokenGroupIter& i, CTokenGroupIter end) {
+optional<TokenPtr> parseHeader(CTokenGroupIter& i, CTokenGroupIter end, markdown::Arena& arena) {
     if (!(*i)->isBlankLine() && (*i)->text() && (*i)->canContainMarkup()) {
         // Hash-mark type
         static const regex cHashHeaders("^ {0,3}(#{1,6}) +(.*?)( +#* *)?$");
-        const string& line=*(*i)->text();
-        smatch m1, m2;
-        if (regex_match(line, m1, cHashHeaders)) {
+        string_view line=*(*i)->text();
+        cmatch m1, m2;
+        if (regex_match(line.begin(), line.end(), m1, cHashHeaders)) {
             markdown::TokenGroup g;
-            g.push_back(TokenPtr(new markdown::token::RawText(m1[2])));
-            return TokenPtr(new markdown::token::Header(m1[1].length(), g));
+            g.push_back(arena.make<markdown::token::RawText>(matchedView(m1[2])));
+            return arena.make<markdown::token::Header>(m1[1].length(), g);
         }
 
         // Underlined type
@@ -530,14 +766,14 @@ optional<TokenPtr> parseHeader(CTokenGroupIter& i, CTokenGroupIter end) {
         if (ii!=end && !(*ii)->isBlankLine() && (*ii)->text() && (*ii)->canContainMarkup()) {
             static const regex cUnderlinedHeaders("^ {0,3}([-=])\\1* *$");
             static const regex titleWithSpaces("^ {0,3}(.*[^ ]) *$");
-            const string& line=*(*ii)->text();
-            const string& title=*(*i)->text();
-            if (regex_match(line, m1, cUnderlinedHeaders)) {
-                char typeChar = m1.str(1)[0];
-                regex_match(title, m2, titleWithSpaces);
+            string_view line=*(*ii)->text();
+            string_view title=*(*i)->text();
+            if (regex_match(line.begin(), line.end(), m1, cUnderlinedHeaders)) {
+                char typeChar = *m1[1].first;
+                regex_match(title.begin(), title.end(), m2, titleWithSpaces);
                 markdown::TokenGroup g;
-                g.push_back(TokenPtr(new markdown::token::RawText(m2.str(1))));
-                TokenPtr p=TokenPtr(new markdown::token::Header((typeChar=='='? 1 : 2), g));
+                g.push_back(arena.make<markdown::token::RawText>(matchedView(m2[1])));
+                TokenPtr p=arena.make<markdown::token::Header>((typeChar=='='? 1 : 2), g);
                 i=ii;
                 return p;
             }
@@ -546,114 +782,766 @@ optional<TokenPtr> parseHeader(CTokenGroupIter& i, CTokenGroupIter end) {
     return none;
 }
 
-optional<TokenPtr> parseHorizontalRule(CTokenGroupIter& i, CTokenGroupIter end) {
+optional<TokenPtr> parseHorizontalRule(CTokenGroupIter& i, CTokenGroupIter end, markdown::Arena& arena) {
     if (!(*i)->isBlankLine() && (*i)->text() && (*i)->canContainMarkup()) {
         static const regex cHorizontalRules("^ {0,3}((\\* *){3,}|(- *){3,}|(_ *){3,})$");
-        const string& line=*(*i)->text();
-        if (regex_match(line, cHorizontalRules)) {
-            return TokenPtr(new markdown::token::HtmlTag("hr /"));
+        string_view line=*(*i)->text();
+        if (regex_match(line.begin(), line.end(), cHorizontalRules)) {
+            return arena.make<markdown::token::HtmlTag>("hr /");
         }
     }
     return none;
 }
 
+void findHighlightedBlocks(TokenPtr t, std::vector<markdown::token::FencedCodeBlock*>& blocks) {
+    if (t->kind()==markdown::Token::cFencedCodeBlock) {
+        markdown::token::FencedCodeBlock *block=static_cast<markdown::token::FencedCodeBlock*>(t);
+        if (block->isHighlighted()) blocks.push_back(block);
+    } else if (t->isContainer()) {
+        const markdown::TokenGroup& sub=static_cast<markdown::token::Container*>(t)->subTokens();
+        for (CTokenGroupIter i=sub.begin(), ie=sub.end(); i!=ie; ++i) findHighlightedBlocks(*i, blocks);
+    }
+}
+
+#ifdef MARKDOWN_STATS
+typedef std::chrono::steady_clock StatsClock;
+
+// What this thread takes from the heap from here until finish(). The peak is
+// measured from what's in use now, and put back afterwards, so that these can
+// be nested.
+class HeapMark: private boost::noncopyable {
+public:
+    HeapMark(): mCounters(markdown::heapCounters()), mStart(mCounters.bytes),
+        mPeak(mCounters.peak), mTotal(mCounters.total)
+    {
+        mCounters.peak=mCounters.bytes;
+    }
+
+    void finish(size_t& allocated, size_t& peak) {
+        allocated=mCounters.total-mTotal;
+        peak=static_cast<size_t>(std::max<ptrdiff_t>(mCounters.peak-mStart, 0));
+        mCounters.peak=std::max(mPeak, mCounters.peak);
+    }
+
+private:
+    markdown::HeapCounters& mCounters;
+    const ptrdiff_t mStart, mPeak;
+    const size_t mTotal;
+};
+
+// Adds the time, memory and regular expressions one phase of a document takes
+// to its DocumentStats, if it has any, when it goes out of scope.
+class PhaseStats: private boost::noncopyable {
+public:
+    PhaseStats(markdown::DocumentStats *stats, markdown::DocumentStats::Phase phase,
+        const markdown::Arena& arena): mStats(stats), mPhase(phase), mArena(arena),
+        mStart(StatsClock::now()), mBytes(arena.bytesUsed()),
+        mCalls(markdown::regexCalls()), mOtherHeapPeak(0) { }
+    ~PhaseStats() {
+        size_t heapBytes, heapPeak;
+        mHeap.finish(heapBytes, heapPeak);
+        if (mStats==0) return;
+        mStats->seconds[mPhase]+=std::chrono::duration<double>(StatsClock::now()-mStart).count();
+        mStats->regexCalls[mPhase]+=markdown::regexCalls()-mCalls;
+        mStats->arenaBytes[mPhase]+=mArena.bytesUsed()-mBytes;
+        mStats->heapBytes[mPhase]+=heapBytes;
+        mStats->heapPeak[mPhase]=std::max(mStats->heapPeak[mPhase], heapPeak+mOtherHeapPeak);
+    }
+
+    // For the work done on other threads.
+    void add(size_t regexCalls, size_t arenaBytes, size_t heapBytes, size_t heapPeak) {
+        if (mStats==0) return;
+        mStats->regexCalls[mPhase]+=regexCalls;
+        mStats->arenaBytes[mPhase]+=arenaBytes;
+        mStats->heapBytes[mPhase]+=heapBytes;
+        mOtherHeapPeak+=heapPeak;
+    }
+
+private:
+    markdown::DocumentStats *mStats;
+    const markdown::DocumentStats::Phase mPhase;
+    const markdown::Arena& mArena;
+    const StatsClock::time_point mStart;
+    const size_t mBytes, mCalls;
+    HeapMark mHeap;
+    size_t mOtherHeapPeak;
+};
+
+// Passes the output on, counting it.
+class CountingSink: public OutputSink {
+public:
+    CountingSink(OutputSink& out, size_t& count): mOut(out), mCount(count) {
+        mCurrent=mBuffer;
+        mEnd=mBuffer+cBufferSize;
+    }
+
+    void flush() override {
+        _overflow(0, 0);
+        mOut.flush();
+    }
+
+private:
+    void _overflow(const char *data, size_t size) override {
+        mCount+=(mCurrent-mBuffer)+size;
+        mOut.write(mBuffer, mCurrent-mBuffer);
+        mOut.write(data, size);
+        mCurrent=mBuffer;
+    }
+
+    static const size_t cBufferSize=8192;
+
+    OutputSink& mOut;
+    size_t& mCount;
+    char mBuffer[cBufferSize];
+};
+
+void countTokens(const markdown::Token *t, std::vector<size_t>& counts) {
+    ++counts[t->kind()];
+    if (t->isContainer()) {
+        const markdown::TokenGroup& sub=static_cast<const markdown::token::Container*>(t)->subTokens();
+        for (CTokenGroupIter i=sub.begin(), ie=sub.end(); i!=ie; ++i) countTokens(*i, counts);
+    }
+}
+#else
+class PhaseStats {
+public:
+    PhaseStats(markdown::DocumentStats*, markdown::DocumentStats::Phase, const markdown::Arena&) { }
+    void add(size_t, size_t, size_t, size_t) { }
+};
+#endif
+
+// Roughly what each kind of token writes besides its text: the tags around
+// it, and for the markers, the tag they turn into.
+const size_t cHtmlOverhead[markdown::Token::cKindCount]={
+    0,  // cTextHolder
+    1,  // cRawText, for what needs escaping
+    2,  // cHtmlTag
+    0,  // cHtmlAnchorTag
+    0,  // cInlineHtmlContents
+    0,  // cInlineHtmlComment
+    25, // cCodeBlock: <pre><code>...</code></pre>
+    48, // cFencedCodeBlock, with its language's class
+    13, // cCodeSpan
+    0,  // cBlankLine
+    1,  // cEscapedCharacter
+    0,  // cContainer
+    0,  // cInlineHtmlBlock
+    10, // cHeader
+    10, // cListItem
+    12, // cUnorderedList
+    11, // cOrderedList
+    27, // cBlockQuote
+    10, // cParagraph
+    5,  // cBoldOrItalicMarker
+    64, // cImage: its alt text, URL and title aren't counted
+};
+
+// What the tokens will come to as HTML, give or take a few percent; the
+// output is a little longer than their text where it needs escaping.
+size_t estimateHtmlSize(const markdown::Token *t) {
+    size_t size=cHtmlOverhead[t->kind()];
+    if (t->kind()==markdown::Token::cFencedCodeBlock &&
+        static_cast<const markdown::token::FencedCodeBlock*>(t)->highlighted()!=0)
+    {
+        size+=static_cast<const markdown::token::FencedCodeBlock*>(t)->highlighted()->size();
+    } else if (t->text()) {
+        size+=t->text()->size();
+    }
+    if (t->isContainer()) {
+        const markdown::TokenGroup& sub=static_cast<const markdown::token::Container*>(t)->subTokens();
+        for (CTokenGroupIter i=sub.begin(), ie=sub.end(); i!=ie; ++i) size+=estimateHtmlSize(*i);
+    }
+    return size;
+}
+
+void walkTokens(const markdown::Token& t, markdown::TokenVisitor& visitor) {
+    if (!t.isContainer()) {
+        visitor.visit(t);
+        return;
+    }
+
+    visitor.enter(t);
+    const markdown::TokenGroup& sub=static_cast<const markdown::token::Container&>(t).subTokens();
+    for (CTokenGroupIter i=sub.begin(), ie=sub.end(); i!=ie; ++i) {
+        if (i!=sub.begin()) visitor.separate(t);
+        walkTokens(**i, visitor);
+    }
+    visitor.leave(t);
+}
+
 } // namespace
 
 
 
 namespace markdown {
 
-optional<LinkIds::Target> LinkIds::find(const string& id) const {
-    Table::const_iterator i=mTable.find(_scrubKey(id));
-    if (i!=mTable.end()) return i->second;
+optional<LinkIds::Target> LinkIds::find(string_view id) const {
+    const Entry *e=_find(id, _hash(id));
+    if (e!=0) return e->target;
     else return none;
 }
 
-void LinkIds::add(const string& id, const string& url, const
-                  string& title)
+void LinkIds::add(string_view id, string_view url, string_view title) {
+    const size_t hash=_hash(id);
+    if (_find(id, hash)!=0) return;
+    _insert(_intern(id, true), hash, Target(_intern(url, false), _intern(title, false)));
+}
+
+void LinkIds::merge(const LinkIds& other) {
+    for (auto i=other.mSlots.cbegin(), ie=other.mSlots.cend(); i!=ie; ++i) {
+        if (!i->used || _find(i->key, i->hash)!=0) continue;
+        _insert(_intern(i->key, false), i->hash, Target(_intern(i->target.url,
+            false), _intern(i->target.title, false)));
+    }
+}
+
+void LinkIds::clear() {
+    std::fill(mSlots.begin(), mSlots.end(), Entry());
+    mCount=0;
+    mStrings.clear();
+}
+
+void LinkIds::setMemoryResource(MemoryResource *resource) {
+    clear();
+    mStrings.setResource(resource);
+}
+
+bool LinkIds::operator==(const LinkIds& other) const {
+    if (mCount!=other.mCount) return false;
+    for (auto i=mSlots.cbegin(), ie=mSlots.cend(); i!=ie; ++i) {
+        if (!i->used) continue;
+        const Entry *e=other._find(i->key, i->hash);
+        if (e==0 || !(e->target==i->target)) return false;
+    }
+    return true;
+}
+
+size_t LinkIds::_hash(string_view id) {
+    // FNV-1a, of the folded characters.
+    size_t hash=2166136261u;
+    char folded[2];
+    for (size_t i=0; i<id.size(); ) {
+        const size_t n=foldCharacter(id, i, folded);
+        for (size_t x=0; x<n; ++x) hash=(hash^static_cast<unsigned char>(folded[x]))*16777619u;
+    }
+    return hash;
+}
+
+bool LinkIds::_equal(string_view key, string_view id) {
+    // Folding never changes how long a character is.
+    if (key.size()!=id.size()) return false;
+    char folded[2];
+    for (size_t i=0, k=0; i<id.size(); ) {
+        const size_t n=foldCharacter(id, i, folded);
+        for (size_t x=0; x<n; ++x, ++k) if (key[k]!=folded[x]) return false;
+    }
+    return true;
+}
+
+const LinkIds::Entry* LinkIds::_find(string_view id, size_t hash) const {
+    if (mSlots.empty()) return 0;
+    const size_t mask=mSlots.size()-1;
+    for (size_t i=hash&mask; mSlots[i].used; i=(i+1)&mask)
+        if (mSlots[i].hash==hash && _equal(mSlots[i].key, id)) return &mSlots[i];
+    return 0;
+}
+
+void LinkIds::_insert(string_view key, size_t hash, const Target& target) {
+    // Kept no more than three-quarters full, so there's always an empty slot
+    // to stop a search.
+    if ((mCount+1)*4>mSlots.size()*3) {
+        std::vector<Entry> old;
+        old.swap(mSlots);
+        mSlots.resize(old.empty() ? 16 : old.size()*2);
+        mCount=0;
+        for (auto i=old.cbegin(), ie=old.cend(); i!=ie; ++i)
+            if (i->used) _insert(i->key, i->hash, i->target);
+    }
+
+    const size_t mask=mSlots.size()-1;
+    size_t i=hash&mask;
+    while (mSlots[i].used) i=(i+1)&mask;
+    mSlots[i].used=true;
+    mSlots[i].hash=hash;
+    mSlots[i].key=key;
+    mSlots[i].target=target;
+    ++mCount;
+}
+
+string_view LinkIds::_intern(string_view str, bool fold) {
+    char *p=static_cast<char*>(mStrings.allocate(str.size(), 1));
+    if (fold) {
+        for (size_t i=0, k=0; i<str.size(); ) k+=foldCharacter(str, i, p+k);
+    } else std::memcpy(p, str.data(), str.size());
+    return string_view(p, str.size());
+}
+
+
+
+void TokenVisitorGroup::enter(const Token& container) {
+    for (size_t i=0; i<mVisitors.size(); ++i) mVisitors[i]->enter(container);
+}
+
+void TokenVisitorGroup::separate(const Token& container) {
+    for (size_t i=0; i<mVisitors.size(); ++i) mVisitors[i]->separate(container);
+}
+
+void TokenVisitorGroup::leave(const Token& container) {
+    for (size_t i=0; i<mVisitors.size(); ++i) mVisitors[i]->leave(container);
+}
+
+void TokenVisitorGroup::visit(const Token& token) {
+    for (size_t i=0; i<mVisitors.size(); ++i) mVisitors[i]->visit(token);
+}
+
+
+
+SpanBudget::SpanBudget(const Limits& limits): mLimits(limits),
+    mDeadline(std::chrono::steady_clock::now()+limits.timeBudget), mSteps(0),
+    mSpent(false)
 {
-    mTable.insert(std::make_pair(_scrubKey(id), Target(url, title)));
 }
 
-string LinkIds::_scrubKey(string str) {
-    boost::algorithm::to_lower(str);
-    return str;
+bool SpanBudget::spend(size_t steps) {
+    if (mSpent) return false;
+    if (mLimits.maxSteps!=0 && mSteps.fetch_add(steps)+steps>mLimits.maxSteps)
+        mSpent=true;
+    else if (mLimits.timeBudget.count()!=0 && std::chrono::steady_clock::now()>mDeadline)
+        mSpent=true;
+    return !mSpent;
+}
+
+#ifdef MARKDOWN_STATS
+size_t& regexCalls() {
+    static thread_local size_t calls=0;
+    return calls;
+}
+#endif
+
+HeapCounters& heapCounters() {
+    static thread_local HeapCounters counters={ 0, 0, 0, 0 };
+    return counters;
+}
+
+void DocumentStats::clear() {
+    for (size_t p=0; p!=cPhaseCount; ++p) {
+        seconds[p]=0;
+        regexCalls[p]=arenaBytes[p]=heapBytes[p]=heapPeak[p]=0;
+    }
+    tokens.assign(Token::cKindCount, 0);
+    bytesIn=bytesOut=0;
+}
+
+bool DocumentStats::enabled() {
+#ifdef MARKDOWN_STATS
+    return true;
+#else
+    return false;
+#endif
+}
+
+const char* DocumentStats::phaseName(size_t phase) {
+    static const char *cNames[cPhaseCount]={ "read", "merge html tags",
+        "inline html and references", "blocks", "paragraphs", "spans",
+        "highlight", "write" };
+    return (phase<cPhaseCount ? cNames[phase] : "");
+}
+
+const char* DocumentStats::tokenKindName(size_t kind) {
+    static const char *cNames[Token::cKindCount]={ "TextHolder", "RawText",
+        "HtmlTag", "HtmlAnchorTag", "InlineHtmlContents", "InlineHtmlComment",
+        "CodeBlock", "FencedCodeBlock", "CodeSpan", "BlankLine",
+        "EscapedCharacter", "Container", "InlineHtmlBlock", "Header", "ListItem",
+        "UnorderedList", "OrderedList", "BlockQuote", "Paragraph",
+        "BoldOrItalicMarker", "Image" };
+    return (kind<Token::cKindCount ? cNames[kind] : "");
+}
+
+FragmentCache::FragmentCache(size_t maxBytes): mMaxBytes(maxBytes), mBytes(0),
+    mHits(0), mMisses(0)
+{
+}
+
+bool FragmentCache::find(Key key, string& html) {
+    std::lock_guard<std::mutex> guard(mLock);
+    auto found=mIndex.find(key);
+    if (found==mIndex.end()) {
+        ++mMisses;
+        return false;
+    }
+    ++mHits;
+    mEntries.splice(mEntries.begin(), mEntries, found->second);
+    html=found->second->second;
+    return true;
+}
+
+void FragmentCache::add(Key key, const string& html) {
+    if (html.size()>mMaxBytes) return;
+    std::lock_guard<std::mutex> guard(mLock);
+    if (mIndex.find(key)!=mIndex.end()) return;
+    while (mBytes+html.size()>mMaxBytes) {
+        mBytes-=mEntries.back().second.size();
+        mIndex.erase(mEntries.back().first);
+        mEntries.pop_back();
+    }
+    mEntries.push_front(std::make_pair(key, html));
+    mIndex[key]=mEntries.begin();
+    mBytes+=html.size();
+}
+
+size_t FragmentCache::hits() const {
+    std::lock_guard<std::mutex> guard(mLock);
+    return mHits;
+}
+
+size_t FragmentCache::misses() const {
+    std::lock_guard<std::mutex> guard(mLock);
+    return mMisses;
+}
+
+size_t FragmentCache::bytes() const {
+    std::lock_guard<std::mutex> guard(mLock);
+    return mBytes;
+}
+
+void FragmentCache::clear() {
+    std::lock_guard<std::mutex> guard(mLock);
+    mEntries.clear();
+    mIndex.clear();
+    mBytes=0;
 }
 
 
 
 const size_t Document::cSpacesPerInitialTab=4; // Required by Markdown format
 const size_t Document::cDefaultSpacesPerTab=cSpacesPerInitialTab;
+const size_t Document::cReadBlockSize=64*1024;
+const size_t Document::cSpanBlocksPerTask=64;
 
 Document::Document(SyntaxHighlighter *highlighter, size_t spacesPerTab)
-    : cSpacesPerTab(spacesPerTab),
-      mTokenContainer(new token::Container), mIdTable(new LinkIds),
-      mProcessed(false), mHighlighter(highlighter)
+    : cSpacesPerTab(spacesPerTab), mArena(mOwnArena),
+      mTokenContainer(mArena.make<token::Container>()), mOwnIdTable(new LinkIds),
+      mIdTable(mOwnIdTable),
+      mProcessed(false), mWritten(false), mHighlighter(highlighter),
+      mSpanParser(cRegexSpanParser), mSpanThreads(1), mStats(0), mFragmentCache(0)
 {
     // This space deliberately blank ;-)
 }
 
 Document::Document(std::istream& in, SyntaxHighlighter *highlighter, size_t spacesPerTab)
-    : cSpacesPerTab(spacesPerTab), mTokenContainer(new token::Container),
-      mIdTable(new LinkIds), mProcessed(false), mHighlighter(highlighter)
+    : cSpacesPerTab(spacesPerTab), mArena(mOwnArena), mTokenContainer(mArena.make<token::Container>()),
+      mOwnIdTable(new LinkIds),
+      mIdTable(mOwnIdTable), mProcessed(false), mWritten(false), mHighlighter(highlighter),
+      mSpanParser(cRegexSpanParser), mSpanThreads(1), mStats(0), mFragmentCache(0)
 {
     read(in);
 }
 
+Document::Document(Arena& arena, SyntaxHighlighter *highlighter, size_t spacesPerTab)
+    : cSpacesPerTab(spacesPerTab), mArena(arena), mTokenContainer(mArena.make<token::Container>()),
+      mOwnIdTable(new LinkIds(arena.resource())),
+      mIdTable(mOwnIdTable), mProcessed(false), mWritten(false), mHighlighter(highlighter),
+      mSpanParser(cRegexSpanParser), mSpanThreads(1), mStats(0), mFragmentCache(0)
+{
+}
+
 Document::~Document() {
-    delete mIdTable;
+    // Only matters for a borrowed arena; our own would do it anyway.
+    mArena.clear();
+    delete mOwnIdTable;
+}
+
+void Document::reset() {
+    mArena.clear();
+    mTokenContainer=mArena.make<token::Container>();
+    mOwnIdTable->clear();
+    mIdTable=mOwnIdTable;
+    mProcessed=mWritten=false;
+}
+
+void Document::setMemoryResource(MemoryResource *resource) {
+    mArena.setResource(resource);
+    mOwnIdTable->setMemoryResource(resource);
+    reset();
+}
+
+std::unique_ptr<Document> Document::copy() const {
+    return copy(mHighlighter);
+}
+
+std::unique_ptr<Document> Document::copy(SyntaxHighlighter *highlighter) const {
+    if (mProcessed) throw std::logic_error("Document::copy: the document has already been written");
+
+    std::unique_ptr<Document> r(new Document(highlighter, cSpacesPerTab));
+    r->setMemoryResource(mArena.resource());
+    r->mSpanParser=mSpanParser;
+    r->mSpanThreads=mSpanThreads;
+    r->mLimits=mLimits;
+    r->mFragmentCache=mFragmentCache;
+    TokenGroup lines(static_cast<const token::Container*>(mTokenContainer)->subTokens());
+    static_cast<token::Container*>(r->mTokenContainer)->appendSubtokens(lines);
+    return r;
 }
 
 bool Document::read(const string& src) {
-    std::istringstream in(src);
-    return read(in);
+    return read(src.data(), src.size());
 }
 
-bool Document::_getline(std::istream& in, string& line) {
-    // Handles \n, \r, and \r\n (and even \n\r) on any system. Also does tab-
-    // expansion, since this is the most efficient place for it.
-    line.clear();
+bool Document::read(const char *src, size_t length) {
+    if (mProcessed || mWritten) return false;
 
-    bool initialWhitespace=true;
-    char c;
-    while (in.get(c)) {
-        if (c=='\r') {
-            if ((in.get(c)) && c!='\n') in.unget();
-            return true;
-        } else if (c=='\n') {
-            if ((in.get(c)) && c!='\r') in.unget();
-            return true;
-        } else {
-            line.push_back(c);
-            if (c!=' ') initialWhitespace=false;
+    PhaseStats stats(mStats, DocumentStats::cRead, mArena);
+#ifdef MARKDOWN_STATS
+    if (mStats!=0) mStats->bytesIn+=length;
+#endif
+    char *copy=static_cast<char*>(mArena.allocate(length, 1));
+    std::copy(src, src+length, copy);
+    _readLines(string_view(copy, length));
+    return true;
+}
+
+bool Document::read(std::istream& in) {
+    if (mProcessed || mWritten) return false;
+
+    PhaseStats stats(mStats, DocumentStats::cRead, mArena);
+    // The input goes into blocks from the arena, like the rest of the
+    // document, rather than one string on the heap. The lines finished in a
+    // block are read as soon as it's full; the one it ends in the middle of
+    // starts the next block, which has room for at least as much again.
+    const char *carry=0;
+    size_t carried=0;
+    while (true) {
+        const size_t size=std::max(cReadBlockSize, 2*carried);
+        char *block=static_cast<char*>(mArena.allocate(size, 1));
+        std::copy(carry, carry+carried, block);
+        in.read(block+carried, size-carried);
+        const size_t length=carried+in.gcount();
+#ifdef MARKDOWN_STATS
+        if (mStats!=0) mStats->bytesIn+=in.gcount();
+#endif
+        if (!in) {
+            _readLines(string_view(block, length));
+            break;
         }
+
+        LineSplitter lines(block, block+length);
+        string_view line;
+        while (lines.next(line, true)) { }
+        _readLines(string_view(block, lines.position()-block));
+        carry=lines.position();
+        carried=block+length-carry;
     }
-    return !line.empty();
+    return true;
 }
 
-bool Document::read(std::istream& in) {
-    if (mProcessed) return false;
+bool Document::readFile(const string& path) {
+    if (mProcessed || mWritten) return false;
+
+#ifndef _WIN32
+    const int fd=open(path.c_str(), O_RDONLY);
+    if (fd<0) return false;
+
+    // Empty files can't be mapped, and pipes and devices have no size to map;
+    // those go through the buffered read below, as does a failed mmap.
+    struct stat info;
+    void *data=MAP_FAILED;
+    if (fstat(fd, &info)==0 && S_ISREG(info.st_mode) && info.st_size>0) {
+        data=mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if (data!=MAP_FAILED) {
+        madvise(data, info.st_size, MADV_SEQUENTIAL);
+        PhaseStats stats(mStats, DocumentStats::cRead, mArena);
+        const MappedFile& file=*mArena.make<MappedFile>(data, info.st_size);
+#ifdef MARKDOWN_STATS
+        if (mStats!=0) mStats->bytesIn+=info.st_size;
+#endif
+        _readLines(file.view());
+        return true;
+    }
+#endif
+
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in) return false;
+    return read(in);
+}
 
-    token::Container *tokens=dynamic_cast<token::Container*>(mTokenContainer.get());
-    assert(tokens!=0);
+void Document::_readLines(string_view buffer) {
+    // Handles \n, \r, and \r\n (and even \n\r) on any system. The tokens
+    // refer into the buffer, so it has to last as long as the arena's contents.
+    assert(mTokenContainer->isContainer());
+    token::Container *tokens=static_cast<token::Container*>(mTokenContainer);
 
-    string line;
     TokenGroup tgt;
-    while (_getline(in, line)) {
+    LineSplitter lines(buffer.begin(), buffer.end());
+    string_view line;
+    while (lines.next(line)) {
         if (isBlankLine(line)) {
-            tgt.push_back(TokenPtr(new token::BlankLine(line)));
+            tgt.push_back(mArena.make<token::BlankLine>(line));
         } else {
-            tgt.push_back(TokenPtr(new token::RawText(line)));
+            tgt.push_back(mArena.make<token::RawText>(line));
         }
     }
     tokens->appendSubtokens(tgt);
-
-    return true;
 }
 
 void Document::write(std::ostream& out) {
+    StreamSink sink(out);
+    write(sink);
+}
+
+void Document::write(OutputSink& out) {
+    if (mFragmentCache==0 || mIdTable!=mOwnIdTable) _process();
+    mWritten=true;
+    PhaseStats stats(mStats, DocumentStats::cWrite, mArena);
+#ifdef MARKDOWN_STATS
+    if (mStats!=0) {
+        CountingSink counter(out, mStats->bytesOut);
+        _write(counter);
+        counter.flush();
+        return;
+    }
+#endif
+    _write(out);
+    out.flush();
+}
+
+void Document::_write(OutputSink& out) {
+    if (mProcessed) mTokenContainer->writeAsHtml(out);
+    else _writeFragments(out);
+}
+
+void Document::_writeFragments(OutputSink& out) {
+    // The lines are still the ones that were read, without their endings.
+    assert(mTokenContainer->isContainer());
+    const TokenGroup& lines=static_cast<token::Container*>(mTokenContainer)->subTokens();
+    std::vector<string> pieces(1);
+    BlockSplitter splitter;
+    for (CTokenGroupIter i=lines.begin(), ie=lines.end(); i!=ie; ++i) {
+        const string_view line=*(*i)->text();
+        if (splitter.startsPiece(line) && !pieces.back().empty()) pieces.push_back(string());
+        pieces.back().append(line.data(), line.size()).push_back('\n');
+    }
+
+    // Any block might define references for any other, so the ones that
+    // might are all part of the key of those that could use one.
+    const FragmentCache::Key settings=fragmentSettingsHash(mSpanParser, cSpacesPerTab,
+        mLimits.maxNesting, mLimits.maxDelimiters);
+    FragmentCache::Key references=settings;
+    std::vector<bool> defines(pieces.size());
+    for (size_t i=0; i<pieces.size(); ++i) {
+        defines[i]=mightDefineReference(pieces[i]);
+        if (defines[i]) references=fragmentHash(pieces[i], references);
+    }
+
+    // The definitions are only needed once a block has to be rendered, and
+    // then only the passes that find them.
+    Arena arena(mArena.resource());
+    LinkIds ids(mArena.resource());
+    bool haveIds=false;
+    string html;
+    for (size_t i=0; i<pieces.size(); ++i) {
+        const FragmentCache::Key key=fragmentHash(pieces[i], (pieces[i].find('[')!=string::npos ?
+            references : settings));
+        if (!mFragmentCache->find(key, html)) {
+            for (size_t j=0; j<pieces.size() && !haveIds; ++j) {
+                if (!defines[j]) continue;
+                Document doc(arena, mHighlighter, cSpacesPerTab);
+                doc.setLinkIds(ids);
+                doc.read(pieces[j].data(), pieces[j].size());
+                doc._mergeMultilineHtmlTags();
+                doc._processInlineHtmlAndReferences();
+            }
+            haveIds=true;
+
+            Document doc(arena, mHighlighter, cSpacesPerTab);
+            doc.setSpanParser(mSpanParser);
+            doc.setLimits(mLimits);
+            doc.setLinkIds(ids);
+            doc.read(pieces[i].data(), pieces[i].size());
+            html.clear();
+            {
+                StringSink sink(html);
+                doc.write(sink);
+            }
+            mFragmentCache->add(key, html);
+        }
+        out << html;
+    }
+}
+
+string Document::renderToString() {
+    string r;
+    renderTo(r);
+    return r;
+}
+
+void Document::renderTo(string& target) {
+    target.clear();
+    target.reserve(estimatedSize());
+    StringSink sink(target);
+    write(sink);
+}
+
+size_t Document::estimatedSize() {
+    // A few percent over, for the escaping, so that the string doesn't have
+    // to grow for the last few bytes. Documents that get their blocks from a
+    // fragment cache are never tokenized, so only the input's size is known.
+    size_t size;
+    if (mFragmentCache==0 || mIdTable!=mOwnIdTable) {
+        _process();
+        size=estimateHtmlSize(mTokenContainer);
+    } else size=_inputSize()+_inputSize()/8;
+    return size+size/16;
+}
+
+size_t Document::_inputSize() const {
+    assert(mTokenContainer->isContainer());
+    const TokenGroup& lines=static_cast<token::Container*>(mTokenContainer)->subTokens();
+    size_t size=0;
+    for (CTokenGroupIter i=lines.begin(), ie=lines.end(); i!=ie; ++i) {
+        if ((*i)->text()) size+=(*i)->text()->size();
+        ++size;
+    }
+    return size;
+}
+
+void Document::accept(TokenVisitor& visitor) {
     _process();
-    mTokenContainer->writeAsHtml(out);
+    // The document's own container writes nothing, so only what's in it is
+    // visited.
+    assert(mTokenContainer->isContainer());
+    const TokenGroup& blocks=static_cast<token::Container*>(mTokenContainer)->subTokens();
+    for (CTokenGroupIter i=blocks.begin(), ie=blocks.end(); i!=ie; ++i) walkTokens(**i, visitor);
+}
+
+void Document::writeBinary(OutputSink& out) {
+    _process();
+    writeBinaryTokens(*mTokenContainer, out);
+    out.flush();
+}
+
+bool Document::readBinary(string_view data) {
+    assert(mTokenContainer->isContainer());
+    if (mProcessed || mWritten || !static_cast<token::Container*>(mTokenContainer)->subTokens().empty())
+        return false;
+
+    {
+        PhaseStats stats(mStats, DocumentStats::cRead, mArena);
+        TokenPtr tokens=readBinaryTokens(data, mArena, mHighlighter);
+        if (tokens==0) return false;
+#ifdef MARKDOWN_STATS
+        if (mStats!=0) mStats->bytesIn+=data.size();
+#endif
+        mTokenContainer=tokens;
+    }
+    mProcessed=true;
+    if (mHighlighter!=0) {
+        PhaseStats stats(mStats, DocumentStats::cHighlight, mArena);
+        _highlightCodeBlocks();
+    }
+    return true;
 }
 
 void Document::writeTokens(std::ostream& out) {
@@ -663,12 +1551,31 @@ void Document::writeTokens(std::ostream& out) {
 
 void Document::_process() {
     if (!mProcessed) {
-        _mergeMultilineHtmlTags();
-        _processInlineHtmlAndReferences();
-        _processBlocksItems(mTokenContainer);
-        _processParagraphLines(mTokenContainer);
-        mTokenContainer->processSpanElements(*mIdTable);
+        {
+            PhaseStats stats(mStats, DocumentStats::cMergeHtmlTags, mArena);
+            _mergeMultilineHtmlTags();
+        }
+        {
+            PhaseStats stats(mStats, DocumentStats::cInlineHtmlAndReferences, mArena);
+            _processInlineHtmlAndReferences();
+        }
+        {
+            PhaseStats stats(mStats, DocumentStats::cBlocks, mArena);
+            _processBlocksItems(mTokenContainer, 0);
+        }
+        {
+            PhaseStats stats(mStats, DocumentStats::cParagraphs, mArena);
+            _processParagraphLines(mTokenContainer);
+        }
+        _processSpanElements();
         mProcessed=true;
+        if (mHighlighter!=0) {
+            PhaseStats stats(mStats, DocumentStats::cHighlight, mArena);
+            _highlightCodeBlocks();
+        }
+#ifdef MARKDOWN_STATS
+        if (mStats!=0) countTokens(mTokenContainer, mStats->tokens);
+#endif
     }
 }
 
@@ -681,35 +1588,44 @@ optional<TokenPtr> Document::parseFencedCodeBlock(CTokenGroupIter& i, CTokenGrou
         if (!isCodeFenceBeginLine(*((*i)->text()), indent, length, fence, info))
             return none;
         ++i;
-        while (i!=end && !isCodeFenceEndLine(*((*i)->text()), indent, length, fence, out))
+        while (i!=end && (*i)->text() && !isCodeFenceEndLine(*((*i)->text()), indent, length, fence, out))
             ++i;
-        // Unclosed code blocks are closed by the end of the document
-        if (i == end)
+        // Unclosed code blocks are closed by the end of the document, or by
+        // something that's already been made into a block of its own
+        if (i == end || !(*i)->text())
             --i;
-        return TokenPtr(new markdown::token::FencedCodeBlock(out.str(), info, mHighlighter));
+        return mArena.make<markdown::token::FencedCodeBlock>(out.str(), info, mHighlighter);
     }
     return none;
 }
 
 void Document::_mergeMultilineHtmlTags() {
-    static const regex cHtmlTokenStart("<((/?)([a-zA-Z0-9]+)(?:( +[a-zA-Z0-9]+?(?: ?= ?(\"|').*?\\5))*? */? *))$");
-    static const regex cHtmlTokenEnd("^ *((?:( +[a-zA-Z0-9]+?(?: ?= ?(\"|').*?\\3))*? */? *))>");
+    if (!Features::cRawHtml) return;
+
+    // A line that's all the start of a tag, and a next one that's the rest.
+    auto startsTag=[](string_view line) {
+        HtmlTagLexer::Tag tag;
+        return (!line.empty() && line[0]=='<' &&
+            HtmlTagLexer(line, HtmlTagLexer::cTextEnd, false).matchAt(0, tag));
+    };
+    auto endsTag=[](string_view line) {
+        return (!line.empty() && line[line.size()-1]=='>' &&
+            HtmlTagLexer(line, HtmlTagLexer::cTextEnd).matchRest(0)!=HtmlTagLexer::npos);
+    };
 
     TokenGroup processed;
 
-    token::Container *tokens=dynamic_cast<token::Container*>(mTokenContainer.get());
-    assert(tokens!=0);
+    assert(mTokenContainer->isContainer());
+    token::Container *tokens=static_cast<token::Container*>(mTokenContainer);
 
     for (auto i=tokens->subTokens().cbegin(),
             ie=tokens->subTokens().cend(); i!=ie; ++i)
     {
-        if ((*i)->text() && regex_match(*(*i)->text(), cHtmlTokenStart)) {
+        if ((*i)->text() && startsTag(*(*i)->text())) {
             auto i2=i;
             ++i2;
-            if (i2!=tokens->subTokens().end() && (*i2)->text() &&
-                    regex_match(*(*i2)->text(), cHtmlTokenEnd))
-            {
-                processed.push_back(TokenPtr(new markdown::token::RawText(*(*i)->text()+' '+*(*i2)->text())));
+            if (i2!=tokens->subTokens().end() && (*i2)->text() && endsTag(*(*i2)->text())) {
+                processed.push_back(mArena.make<markdown::token::RawText>((*i)->text()->to_string()+' '+(*i2)->text()->to_string()));
                 ++i;
                 continue;
             }
@@ -722,15 +1638,15 @@ void Document::_mergeMultilineHtmlTags() {
 void Document::_processInlineHtmlAndReferences() {
     TokenGroup processed;
 
-    token::Container *tokens=dynamic_cast<token::Container*>(mTokenContainer.get());
-    assert(tokens!=0);
+    assert(mTokenContainer->isContainer());
+    token::Container *tokens=static_cast<token::Container*>(mTokenContainer);
 
     for (auto ii=tokens->subTokens().begin(),
             iie=tokens->subTokens().end(); ii!=iie; ++ii)
     {
         if ((*ii)->text()) {
-            if (processed.empty() || processed.back()->isBlankLine()) {
-                optional<TokenPtr> inlineHtml = parseInlineHtml(ii, iie);
+            if (Features::cRawHtml && (processed.empty() || processed.back()->isBlankLine())) {
+                optional<TokenPtr> inlineHtml = parseInlineHtml(ii, iie, mArena);
                 if (inlineHtml) {
                     processed.push_back(*inlineHtml);
                     if (ii==iie) break;
@@ -738,7 +1654,7 @@ void Document::_processInlineHtmlAndReferences() {
                 }
             }
 
-            if (parseReference(ii, iie, *mIdTable)) {
+            if (Features::cReferences && parseReference(ii, iie, *mIdTable)) {
                 if (ii==iie) break;
                 continue;
             }
@@ -753,13 +1669,16 @@ void Document::_processInlineHtmlAndReferences() {
     tokens->swapSubtokens(processed);
 }
 
-void Document::_processBlocksItems(TokenPtr inTokenContainer) {
-    if (!inTokenContainer->isContainer()) return;
+void Document::_processBlocksItems(TokenPtr inTokenContainer, size_t depth) {
+    // Blocks at the nesting limit keep their lines as they are, to be made
+    // into paragraphs of literal text.
+    if (!inTokenContainer->isContainer() || (depth!=0 && depth>=mLimits.maxNesting)) return;
 
-    token::Container *tokens=dynamic_cast<token::Container*>(inTokenContainer.get());
-    assert(tokens!=0);
+    assert(inTokenContainer->isContainer());
+    token::Container *tokens=static_cast<token::Container*>(inTokenContainer);
 
     TokenGroup processed;
+    processed.reserve(tokens->subTokens().size());
     TokenGroup accu;
     bool isPrevParagraph = false;
     bool isBlockQuote = false;
@@ -772,20 +1691,27 @@ void Document::_processBlocksItems(TokenPtr inTokenContainer) {
         int status(0);
         optional<TokenPtr> subitem, blockQuoteToken;
         if ((*ii)->text()) {
-            subitem = parseFencedCodeBlock(ii, iie);
-            if (subitem) {
-                processed.push_back(*subitem);
-                continue;
+            unsigned int starts=blockStarts(*ii);
+            if (starts & cFenceStart) {
+                subitem = parseFencedCodeBlock(ii, iie);
+                if (subitem) {
+                    processed.push_back(*subitem);
+                    continue;
+                }
             }
             
-            isBlockQuote = parseBlockQuote(accu, ii, iie);
+            isBlockQuote = ((starts & cQuoteStart) && parseBlockQuote(accu, ii, iie, mArena));
             
             if (ii != iie) {
-                subitem=parseHorizontalRule(ii, iie);
-                if (!subitem) subitem=parseListBlock(ii, iie);
-                if (!subitem) subitem=parseHeader(ii, iie);
+                // A block quote leaves it at the line after it.
+                if (isBlockQuote) starts=blockStarts(*ii);
+                if (ii+1!=iie && (blockStarts(*(ii+1)) & cUnderlineStart))
+                    starts|=cHeaderStart;
+                if (starts & cRuleStart) subitem=parseHorizontalRule(ii, iie, mArena);
+                if (!subitem && (starts & cListStart)) subitem=parseListBlock(ii, iie, mArena);
+                if (!subitem && (starts & cHeaderStart)) subitem=parseHeader(ii, iie, mArena);
                 if (!subitem && !isPrevParagraph)
-                    subitem=parseCodeBlock(ii, iie);
+                    subitem=parseCodeBlock(ii, iie, mArena);
             }
 
             if (isBlockQuote) {
@@ -801,12 +1727,12 @@ void Document::_processBlocksItems(TokenPtr inTokenContainer) {
         
         switch (status) {
             case 1:
-                blockQuoteToken = TokenPtr(new markdown::token::BlockQuote(accu));
-                _processBlocksItems(*blockQuoteToken);
+                blockQuoteToken = mArena.make<markdown::token::BlockQuote>(accu);
+                _processBlocksItems(*blockQuoteToken, depth+1);
                 processed.push_back(*blockQuoteToken);
                 accu.clear();
                 
-                _processBlocksItems(*subitem);
+                _processBlocksItems(*subitem, depth+1);
                 processed.push_back(*subitem);
                 isPrevBlockQuote = false;
                 isPrevParagraph = false;
@@ -818,8 +1744,8 @@ void Document::_processBlocksItems(TokenPtr inTokenContainer) {
                     accu.push_back(*ii);
                 ++ii;
                 if (isPrevBlankLine || ii == iie) {
-                    blockQuoteToken = TokenPtr(new markdown::token::BlockQuote(accu));
-                    _processBlocksItems(*blockQuoteToken);
+                    blockQuoteToken = mArena.make<markdown::token::BlockQuote>(accu);
+                    _processBlocksItems(*blockQuoteToken, depth+1);
                     processed.push_back(*blockQuoteToken);
                     accu.clear();
                 }
@@ -829,20 +1755,20 @@ void Document::_processBlocksItems(TokenPtr inTokenContainer) {
                 break;
                 
             case 3:
-                blockQuoteToken = TokenPtr(new markdown::token::BlockQuote(accu));
-                _processBlocksItems(*blockQuoteToken);
+                blockQuoteToken = mArena.make<markdown::token::BlockQuote>(accu);
+                _processBlocksItems(*blockQuoteToken, depth+1);
                 processed.push_back(*blockQuoteToken);
                 assert(ii==iie);
                 break;
                 
             case 4:
                 if (isPrevBlockQuote) {
-                    blockQuoteToken = TokenPtr(new markdown::token::BlockQuote(accu));
-                    _processBlocksItems(*blockQuoteToken);
+                    blockQuoteToken = mArena.make<markdown::token::BlockQuote>(accu);
+                    _processBlocksItems(*blockQuoteToken, depth+1);
                     processed.push_back(*blockQuoteToken);
                     accu.clear();
                 }
-                _processBlocksItems(*subitem);
+                _processBlocksItems(*subitem, depth+1);
                 processed.push_back(*subitem);
                 isPrevBlockQuote = false;
                 isPrevParagraph = false;
@@ -855,8 +1781,8 @@ void Document::_processBlocksItems(TokenPtr inTokenContainer) {
                         accu.push_back(*ii);
                     ++ii;
                     if (isPrevBlankLine || ii == iie) {
-                        blockQuoteToken = TokenPtr(new markdown::token::BlockQuote(accu));
-                        _processBlocksItems(*blockQuoteToken);
+                        blockQuoteToken = mArena.make<markdown::token::BlockQuote>(accu);
+                        _processBlocksItems(*blockQuoteToken, depth+1);
                         processed.push_back(*blockQuoteToken);
                         accu.clear();
                     }
@@ -872,12 +1798,13 @@ void Document::_processBlocksItems(TokenPtr inTokenContainer) {
                 
             case 6:
                 if (isPrevBlockQuote) {
-                    blockQuoteToken = TokenPtr(new markdown::token::BlockQuote(accu));
-                    _processBlocksItems(*blockQuoteToken);
+                    blockQuoteToken = mArena.make<markdown::token::BlockQuote>(accu);
+                    _processBlocksItems(*blockQuoteToken, depth+1);
                     processed.push_back(*blockQuoteToken);
                     accu.clear();
                 }
-                _processBlocksItems(*ii);
+                // A list's items are at the same depth as the list.
+                _processBlocksItems(*ii, ((*ii)->kind()==Token::cListItem ? depth : depth+1));
                 processed.push_back(*ii);
                 isPrevParagraph = false;
                 isPrevBlockQuote = false;
@@ -892,8 +1819,8 @@ void Document::_processBlocksItems(TokenPtr inTokenContainer) {
 }
 
 void Document::_processParagraphLines(TokenPtr inTokenContainer) {
-    token::Container *tokens=dynamic_cast<token::Container*>(inTokenContainer.get());
-    assert(tokens!=0);
+    assert(inTokenContainer->isContainer());
+    token::Container *tokens=static_cast<token::Container*>(inTokenContainer);
 
     bool noPara=tokens->inhibitParagraphs();
     for (auto ii=tokens->subTokens().cbegin(),
@@ -908,22 +1835,387 @@ void Document::_processParagraphLines(TokenPtr inTokenContainer) {
     {
         if ((*ii)->text() && (*ii)->canContainMarkup() && !(*ii)->inhibitParagraphs()) {
             static const regex cExpression("^ *(.*?)(  +)?$");
-            smatch m;
-            regex_match(*(*ii)->text(), m, cExpression);
-            paragraphTokens.push_back(TokenPtr(new markdown::token::RawText(m.str(1))));
+            string_view line=*(*ii)->text();
+            cmatch m;
+            regex_match(line.begin(), line.end(), m, cExpression);
+            paragraphTokens.push_back(mArena.make<markdown::token::RawText>(matchedView(m[1])));
             auto after = ii;
             if (m[2].matched && ++after != iie)
-                paragraphTokens.push_back(TokenPtr(new markdown::token::HtmlTag("br /")));
+                paragraphTokens.push_back(mArena.make<markdown::token::HtmlTag>("br /"));
         } else {
-            flushParagraph(paragraphTokens, processed, noPara);
+            flushParagraph(paragraphTokens, processed, noPara, mArena);
             processed.push_back(*ii);
         }
     }
 
     // Make sure the last paragraph is properly flushed too.
-    flushParagraph(paragraphTokens, processed, noPara);
+    flushParagraph(paragraphTokens, processed, noPara, mArena);
 
     tokens->swapSubtokens(processed);
 }
 
+void Document::_processSpanElements() {
+    token::Container& top=*static_cast<token::Container*>(mTokenContainer);
+    const size_t count=top.subTokens().size();
+
+    size_t threads=(mSpanThreads!=0 ? mSpanThreads : std::thread::hardware_concurrency());
+    if (threads>count/cSpanBlocksPerTask) threads=count/cSpanBlocksPerTask;
+    SpanBudget budget(mLimits);
+    PhaseStats stats(mStats, DocumentStats::cSpans, mArena);
+    if (threads<=1) {
+        top.processSpanElements(SpanContext(*mIdTable, mSpanParser, mArena, budget));
+        return;
+    }
+
+    // The blocks are handed out a run at a time, to whichever thread is free.
+    // Each one puts the tokens it makes into an arena of its own, which lives
+    // in the document's; the results go back into their places afterwards.
+    TokenGroup processed(count);
+    std::atomic<size_t> nextBlock(0);
+    std::exception_ptr error;
+    std::mutex errorLock;
+#ifdef MARKDOWN_STATS
+    std::atomic<size_t> poolCalls(0), poolBytes(0), poolHeapBytes(0), poolHeapPeak(0);
+#endif
+
+    auto worker=[&](Arena& arena) {
+#ifdef MARKDOWN_STATS
+        const size_t calls=regexCalls();
+        HeapMark heap;
+#endif
+        try {
+            SpanContext ctx(*mIdTable, mSpanParser, arena, budget);
+            for (;;) {
+                const size_t begin=nextBlock.fetch_add(cSpanBlocksPerTask);
+                if (begin>=count) break;
+                const size_t end=std::min(begin+cSpanBlocksPerTask, count);
+                for (size_t i=begin; i!=end; ++i) processed[i]=top.processSubtoken(i, ctx);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> guard(errorLock);
+            if (!error) error=std::current_exception();
+            nextBlock=count;
+        }
+#ifdef MARKDOWN_STATS
+        size_t heapBytes, heapPeak;
+        heap.finish(heapBytes, heapPeak);
+        if (&arena!=&mArena) {
+            poolCalls+=regexCalls()-calls;
+            poolBytes+=arena.bytesUsed();
+            poolHeapBytes+=heapBytes;
+            poolHeapPeak+=heapPeak;
+        }
+#endif
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t t=1; t<threads; ++t)
+        pool.emplace_back(worker, std::ref(*mArena.make<Arena>(mArena.resource())));
+    worker(mArena);
+    for (size_t t=0; t<pool.size(); ++t) pool[t].join();
+#ifdef MARKDOWN_STATS
+    stats.add(poolCalls, poolBytes, poolHeapBytes, poolHeapPeak);
+#endif
+    if (error) std::rethrow_exception(error);
+
+    processed.erase(std::remove(processed.begin(), processed.end(), TokenPtr(0)), processed.end());
+    top.swapSubtokens(processed);
+}
+
+void Document::_highlightCodeBlocks() {
+    std::vector<token::FencedCodeBlock*> blocks;
+    findHighlightedBlocks(mTokenContainer, blocks);
+    if (blocks.empty()) return;
+
+    // The snippets stay in the arena, for the blocks to write later.
+    typedef SyntaxHighlighter::Snippet Snippet;
+    std::vector<Snippet>& snippets=*mArena.make<std::vector<Snippet> >();
+    std::vector<size_t> snippetOf(blocks.size());
+    std::unordered_map<string, size_t> known;
+    for (size_t i=0; i<blocks.size(); ++i) {
+        Snippet snippet(blocks[i]->text()->to_string(), blocks[i]->language());
+        auto added=known.insert(std::make_pair(snippet.lang+'\n'+snippet.code, snippets.size()));
+        if (added.second) snippets.push_back(snippet);
+        snippetOf[i]=added.first->second;
+    }
+
+    mHighlighter->highlightAll(snippets);
+    for (size_t i=0; i<blocks.size(); ++i) blocks[i]->setHighlighted(&snippets[snippetOf[i]].html);
+}
+
+void BlockSplitter::reset() {
+    mAfterBlank=mInFence=mPieceHasText=mHtmlPiece=mCommentPiece=mHtmlEnds=false;
+    mFenceLength=0;
+    mFence=0;
+}
+
+bool BlockSplitter::startsPiece(string_view line) {
+    if (mInFence) {
+        if (closesCodeFence(line, mFenceLength, mFence)) mInFence=false;
+        return false;
+    }
+
+    // Only spaces; a tab makes it a line of text, as far as Document is
+    // concerned.
+    if (line.find_first_not_of(' ')==string_view::npos) {
+        mAfterBlank=true;
+        return false;
+    }
+
+    bool starts=false;
+    if (mAfterBlank && mPieceHasText && canOnlyStartBlock(line) &&
+        (!mHtmlPiece || mHtmlEnds))
+    {
+        starts=true;
+        mPieceHasText=false;
+    }
+
+    // What might be an HTML block only ends where parseInlineHtml would end
+    // it: after its first line, after a line that's just a tag (or the end of
+    // a comment, for a comment), and then only if a blank line follows.
+    if (!mPieceHasText) {
+        mHtmlPiece=(Features::cRawHtml && line[0]=='<');
+        mCommentPiece=(mHtmlPiece && isHtmlCommentStart(line.begin(), line.end()));
+        mHtmlEnds=true;
+        mPieceHasText=true;
+    } else if (mHtmlPiece) {
+        mHtmlEnds=(mCommentPiece ? isHtmlCommentEnd(line.begin(), line.end()) :
+            bool(parseHtmlTag(line.begin(), line.end(), cAlone)));
+    }
+
+    int indent;
+    string info;
+    if (isCodeFenceBeginLine(line, indent, mFenceLength, mFence, info)) mInFence=true;
+    mAfterBlank=false;
+    return starts;
+}
+
+const size_t DocumentStream::cReadBlockSize=64*1024;
+
+DocumentStream::DocumentStream(OutputSink& out, SyntaxHighlighter *highlighter)
+    : mOut(out), mHighlighter(highlighter), mSpanParser(cRegexSpanParser),
+      mStats(0), mIdTable(new LinkIds), mPieceBegin(0), mScanned(0)
+{
+}
+
+DocumentStream::~DocumentStream() {
+    try {
+        finish();
+    } catch (...) {
+    }
+    delete mIdTable;
+}
+
+void DocumentStream::read(const char *src, size_t length) {
+    mPending.append(src, length);
+    _scanLines();
+}
+
+void DocumentStream::read(std::istream& in) {
+    while (in) {
+        const size_t size=mPending.size();
+        mPending.resize(size+cReadBlockSize);
+        in.read(&mPending[size], cReadBlockSize);
+        mPending.resize(size+in.gcount());
+        _scanLines();
+    }
+}
+
+void DocumentStream::finish() {
+    if (mPieceBegin!=mPending.size()) _renderPending(mPending.size());
+    mPending.clear();
+    mPieceBegin=mScanned=0;
+    mSplitter.reset();
+    mOut.flush();
+}
+
+void DocumentStream::_scanLines() {
+    LineSplitter lines(mPending.data()+mScanned, mPending.data()+mPending.size());
+    string_view line;
+    while (lines.next(line, true)) {
+        if (mSplitter.startsPiece(line)) _renderPending(mScanned);
+        mScanned=lines.position()-mPending.data();
+    }
+
+    // The pieces rendered so far aren't needed any more.
+    if (mPieceBegin!=0) {
+        mPending.erase(0, mPieceBegin);
+        mScanned-=mPieceBegin;
+        mPieceBegin=0;
+    }
+}
+
+void DocumentStream::_renderPending(size_t end) {
+    Document doc(mArena, mHighlighter);
+    doc.setSpanParser(mSpanParser);
+    doc.setLimits(mLimits);
+    doc.setStats(mStats);
+    doc.setLinkIds(*mIdTable);
+    doc.read(mPending.data()+mPieceBegin, end-mPieceBegin);
+    doc.write(mOut);
+    mPieceBegin=end;
+}
+
+EditableDocument::EditableDocument(SyntaxHighlighter *highlighter)
+    : mHighlighter(highlighter), mSpanParser(cRegexSpanParser), mStats(0),
+      mIdTable(new LinkIds)
+{
+    // There's always at least one block, even if it's empty.
+    setText(string());
+}
+
+EditableDocument::~EditableDocument() {
+    delete mIdTable;
+}
+
+EditableDocument::Change EditableDocument::setText(const string& text) {
+    const size_t oldCount=mBlocks.size();
+    mText=text;
+    mBlocks.clear();
+
+    std::vector<size_t> starts;
+    _findBlocks(0, 0, 0, starts);
+    _makeBlocks(0, starts);
+    return _renderAll(oldCount);
+}
+
+EditableDocument::Change EditableDocument::applyEdit(size_t offset, size_t removedLength,
+    const string& insertedText)
+{
+    if (offset>mText.size()) throw std::out_of_range("EditableDocument::applyEdit");
+    removedLength=std::min(removedLength, mText.size()-offset);
+    const size_t editEnd=offset+removedLength;
+    const ptrdiff_t shift=ptrdiff_t(insertedText.size())-ptrdiff_t(removedLength);
+    mText.replace(offset, removedLength, insertedText);
+
+    // Start with the block before the one the edit is in, since the edit can
+    // join the two. The blocks that start after it might be unchanged.
+    auto next=std::upper_bound(mBlocks.begin(), mBlocks.end(), offset,
+        [](size_t pos, const Block& b) { return pos<b.begin; });
+    size_t first=(next-mBlocks.begin())-1;
+    if (first>0) --first;
+    size_t kept=first+1;
+    while (kept<mBlocks.size() && mBlocks[kept].begin<editEnd) ++kept;
+
+    std::vector<size_t> starts;
+    kept=_findBlocks(mBlocks[first].begin, kept, shift, starts);
+    for (size_t i=kept; i<mBlocks.size(); ++i) mBlocks[i].begin+=shift;
+
+    std::vector<Block> old(std::make_move_iterator(mBlocks.begin()+first),
+        std::make_move_iterator(mBlocks.begin()+kept));
+    mBlocks.erase(mBlocks.begin()+first, mBlocks.begin()+kept);
+    _makeBlocks(first, starts);
+
+    // Unless the definitions in these blocks changed, the other blocks'
+    // links stay the same.
+    const size_t added=starts.size();
+    std::vector<const LinkIds*> before, after;
+    for (size_t i=0; i<old.size(); ++i)
+        if (old[i].references) before.push_back(old[i].references.get());
+    for (size_t i=0; i<added; ++i)
+        if (mBlocks[first+i].references) after.push_back(mBlocks[first+i].references.get());
+    bool redefined=(before.size()!=after.size());
+    for (size_t i=0; i<before.size() && !redefined; ++i)
+        redefined=!(*before[i]==*after[i]);
+    if (redefined) return _renderAll(mBlocks.size()-added+old.size());
+
+    for (size_t i=0; i<added; ++i) {
+        StringSink sink(mBlocks[first+i].html);
+        _render(first+i, *mIdTable, sink);
+    }
+
+    // Only report the blocks whose HTML is really different.
+    size_t head=0, tail=0;
+    while (head<old.size() && head<added && old[head].html==mBlocks[first+head].html)
+        ++head;
+    while (head+tail<old.size() && head+tail<added &&
+        old[old.size()-1-tail].html==mBlocks[first+added-1-tail].html) ++tail;
+
+    Change r;
+    r.first=first+head;
+    r.removed=old.size()-head-tail;
+    for (size_t i=head; i<added-tail; ++i) r.html.push_back(mBlocks[first+i].html);
+    return r;
+}
+
+void EditableDocument::write(OutputSink& out) const {
+    for (size_t i=0; i<mBlocks.size(); ++i) out << mBlocks[i].html;
+    out.flush();
+}
+
+// Finds the starts of the blocks from `begin`, which has to be the start of
+// one, on. It stops at the first that's also where one of the old blocks
+// from `oldBlock` on started, moved by `shift`: everything after that is the
+// same as before. Returns the index of that old block, or mBlocks.size().
+size_t EditableDocument::_findBlocks(size_t begin, size_t oldBlock, ptrdiff_t shift,
+    std::vector<size_t>& starts) const
+{
+    BlockSplitter splitter;
+    const char *text=mText.data();
+    LineSplitter lines(text+begin, text+mText.size());
+    starts.push_back(begin);
+    for (;;) {
+        const size_t p=lines.position()-text;
+        string_view line;
+        if (!lines.next(line)) break;
+        if (splitter.startsPiece(line)) {
+            while (oldBlock<mBlocks.size() && mBlocks[oldBlock].begin+shift<p) ++oldBlock;
+            if (oldBlock<mBlocks.size() && mBlocks[oldBlock].begin+shift==p) return oldBlock;
+            starts.push_back(p);
+        }
+    }
+    return mBlocks.size();
+}
+
+void EditableDocument::_makeBlocks(size_t at, const std::vector<size_t>& starts) {
+    mBlocks.insert(mBlocks.begin()+at, starts.size(), Block());
+    for (size_t i=0; i<starts.size(); ++i) mBlocks[at+i].begin=starts[i];
+
+    // Which references a block defines doesn't depend on any other block, so
+    // they're collected on their own; rendering is just the easiest way.
+    DiscardSink discard;
+    for (size_t i=at; i<at+starts.size(); ++i) {
+        const size_t begin=mBlocks[i].begin;
+        if (mightDefineReference(string_view(mText.data()+begin, _blockEnd(i)-begin))) {
+            mBlocks[i].references=std::make_shared<LinkIds>();
+            _render(i, *mBlocks[i].references, discard);
+        }
+    }
+}
+
+EditableDocument::Change EditableDocument::_renderAll(size_t oldCount) {
+    delete mIdTable;
+    mIdTable=new LinkIds;
+    for (size_t i=0; i<mBlocks.size(); ++i)
+        if (mBlocks[i].references) mIdTable->merge(*mBlocks[i].references);
+
+    Change r;
+    r.first=0;
+    r.removed=oldCount;
+    for (size_t i=0; i<mBlocks.size(); ++i) {
+        mBlocks[i].html.clear();
+        {
+            StringSink sink(mBlocks[i].html);
+            _render(i, *mIdTable, sink);
+        }
+        r.html.push_back(mBlocks[i].html);
+    }
+    return r;
+}
+
+void EditableDocument::_render(size_t index, LinkIds& ids, OutputSink& out) {
+    const size_t begin=mBlocks[index].begin;
+    Document doc(mArena, mHighlighter);
+    doc.setSpanParser(mSpanParser);
+    doc.setLimits(mLimits);
+    doc.setStats(mStats);
+    doc.setLinkIds(ids);
+    doc.read(mText.data()+begin, _blockEnd(index)-begin);
+    doc.write(out);
+}
+
+size_t EditableDocument::_blockEnd(size_t index) const {
+    return (index+1<mBlocks.size() ? mBlocks[index+1].begin : mText.size());
+}
+
 } // namespace markdown
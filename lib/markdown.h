@@ -8,16 +8,22 @@
 #ifndef MARKDOWN_H_INCLUDED
 #define MARKDOWN_H_INCLUDED
 
+#include <chrono>
+#include <cstdint>
 #include <iostream>
-#include <string>
 #include <list>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include <unordered_map>
 
 #include <boost/noncopyable.hpp>
 #include <boost/optional.hpp>
+#include <boost/utility/string_view.hpp>
 
 #include "libmdcpp.h"
+#include "markdown_arena.h"
 
 using std::string;
 
@@ -25,52 +31,501 @@ namespace markdown {
 
 using boost::optional;
 using boost::none;
+using boost::string_view;
+
+inline OutputSink& operator<<(OutputSink& out, string_view s) {
+    out.write(s.data(), s.size());
+    return out;
+}
 
 // Forward references.
 class Token;
 class LinkIds;
 
-typedef std::shared_ptr<Token> TokenPtr;
-typedef std::list<TokenPtr> TokenGroup;
+// Tokens belong to the Arena of the document that made them.
+typedef Token* TokenPtr;
+typedef std::vector<TokenPtr> TokenGroup;
 typedef TokenGroup::const_iterator CTokenGroupIter;
 
+// Selects the code that finds span-level markup (code spans, links, emphasis
+// and the like) within each line. The regex-based parser is the original one;
+// the scanner makes a single left-to-right pass with a delimiter stack, the way
+// CommonMark describes it.
+enum SpanParser { cRegexSpanParser, cScannerSpanParser };
+
+// The parts of the syntax that can be left out when the library is built, for
+// programs that never want them; the parsers then don't look for them at all.
+// Each has an option in CMake (LIBMDCPP_RAW_HTML, LIBMDCPP_REFERENCES and
+// LIBMDCPP_AUTOLINKS) that defines the MARKDOWN_NO_ macro below. Without raw
+// HTML, tags and HTML blocks in the input come out as text; without
+// references, definitions are left in as text and so are the links that would
+// use them; without autolinks, <http://...> and <me@example.com> are text too.
+struct Features {
+#ifdef MARKDOWN_NO_RAW_HTML
+    static const bool cRawHtml=false;
+#else
+    static const bool cRawHtml=true;
+#endif
+#ifdef MARKDOWN_NO_REFERENCES
+    static const bool cReferences=false;
+#else
+    static const bool cReferences=true;
+#endif
+#ifdef MARKDOWN_NO_AUTOLINKS
+    static const bool cAutolinks=false;
+#else
+    static const bool cAutolinks=true;
+#endif
+};
+
+// Bounds on how much work a document can make the parsers do, for input that
+// can't be trusted. Whatever is past one of them comes out as literal text:
+// blocks nested too deeply aren't broken down any further, delimiters past the
+// limit in one span don't match anything, and spans that come after the budget
+// has run out aren't looked at for markup. Both span parsers take time linear
+// in the length of a span without a limit on delimiters, so that one is off
+// unless it's set, like the budget; the budget is checked between spans.
+struct Limits {
+    Limits(): maxNesting(32), maxDelimiters(0), maxSteps(0), timeBudget(0) { }
+
+    size_t maxNesting; // Block quotes and lists inside each other
+    size_t maxDelimiters; // Emphasis runs, brackets and tags in one span; 0 for none
+    size_t maxSteps; // Characters the span parsers look at; 0 for no limit
+    std::chrono::milliseconds timeBudget; // For the span parsers; 0 for none
+};
+
+// What this thread has had from the heap. The library can't see operator new
+// by itself, so these only count anything if the program replaces it and
+// tells them about each call, the way libmdcpp_bench does; DocumentStats
+// takes what each phase allocated from them. They cover everything, the
+// arenas' chunks included, as long as those come from the heap. Memory
+// that's freed on another thread than the one that got it makes `bytes`
+// fall below what it started at on that one, so it's signed.
+struct HeapCounters {
+    ptrdiff_t bytes; // In use now
+    ptrdiff_t peak; // The most that's been in use at once
+    size_t total; // All that's been allocated
+    size_t allocations;
+};
+
+HeapCounters& heapCounters();
+
+inline void noteAllocation(size_t bytes) {
+    HeapCounters& c=heapCounters();
+    c.bytes+=bytes;
+    if (c.bytes>c.peak) c.peak=c.bytes;
+    c.total+=bytes;
+    ++c.allocations;
+}
+
+inline void noteDeallocation(size_t bytes) {
+    heapCounters().bytes-=bytes;
+}
+
+// Where a document's time goes, for profiling. It's only filled in when the
+// library is built with MARKDOWN_STATS (the LIBMDCPP_STATS option in CMake);
+// otherwise the code that would do it isn't there, and everything stays 0.
+// Numbers are added to what's already there, so one can cover many documents;
+// the peaks are the highest any of them reached.
+struct DocumentStats {
+    enum Phase { cRead, cMergeHtmlTags, cInlineHtmlAndReferences, cBlocks,
+        cParagraphs, cSpans, cHighlight, cWrite, cPhaseCount };
+
+    DocumentStats() { clear(); }
+    void clear();
+
+    static bool enabled();
+    static const char* phaseName(size_t phase);
+    static const char* tokenKindName(size_t kind);
+
+    double seconds[cPhaseCount];
+    size_t regexCalls[cPhaseCount];
+    size_t arenaBytes[cPhaseCount]; // Including the span threads' own arenas
+    // From the HeapCounters of the threads the phase ran on: all that was
+    // allocated, and the most that was in use at once above where it started
+    // (the span threads' added together).
+    size_t heapBytes[cPhaseCount], heapPeak[cPhaseCount];
+    std::vector<size_t> tokens; // How many of each Token::Kind, once processed
+    size_t bytesIn, bytesOut;
+};
+
+// Remembers the HTML of top-level blocks (as BlockSplitter finds them) by a
+// hash of their text and of whatever else they depend on, so that a document
+// that's mostly the same as one written before only has to render the blocks
+// that changed; see Document::setFragmentCache(). This one keeps the most
+// recently used ones in memory, up to `maxBytes` of HTML, and can be shared by
+// documents on different threads. Subclasses can keep them somewhere else.
+class FragmentCache: private boost::noncopyable {
+public:
+    typedef uint64_t Key;
+
+    explicit FragmentCache(size_t maxBytes=cDefaultMaxBytes);
+    virtual ~FragmentCache() { }
+
+    virtual bool find(Key key, string& html);
+    virtual void add(Key key, const string& html);
+
+    // Only kept by the functions above.
+    size_t hits() const;
+    size_t misses() const;
+    size_t bytes() const;
+    void clear();
+
+    static const size_t cDefaultMaxBytes=64*1024*1024;
+
+private:
+    typedef std::list<std::pair<Key, string> > Entries; // Most recently used first
+
+    const size_t mMaxBytes;
+    mutable std::mutex mLock;
+    Entries mEntries;
+    std::unordered_map<Key, Entries::iterator> mIndex;
+    size_t mBytes, mHits, mMisses;
+};
+
+// Walks a processed document's tokens in the order they're written, for
+// output other than the usual HTML. Containers get enter() before what's in
+// them, separate() between each two of their subtokens, and leave() after;
+// everything else gets visit(). The walk itself doesn't allocate anything.
+class TokenVisitor {
+public:
+    virtual ~TokenVisitor() { }
+
+    virtual void enter(const Token& /*container*/) { }
+    virtual void separate(const Token& /*container*/) { }
+    virtual void leave(const Token& /*container*/) { }
+    virtual void visit(const Token& /*token*/) { }
+};
+
+// Passes everything on to each of several visitors in turn, so that they all
+// get the document from one walk. The visitors have to outlive it.
+class TokenVisitorGroup: public TokenVisitor {
+public:
+    void add(TokenVisitor& visitor) { mVisitors.push_back(&visitor); }
+
+    void enter(const Token& container) override;
+    void separate(const Token& container) override;
+    void leave(const Token& container) override;
+    void visit(const Token& token) override;
+
+private:
+    std::vector<TokenVisitor*> mVisitors;
+};
+
+// Writes the same HTML as Document::write().
+class HtmlVisitor: public TokenVisitor {
+public:
+    explicit HtmlVisitor(OutputSink& out): mOut(out) { }
+
+    void enter(const Token& container) override;
+    void separate(const Token& container) override;
+    void leave(const Token& container) override;
+    void visit(const Token& token) override;
+
+private:
+    OutputSink& mOut;
+};
+
+// Writes just the text, as a search index would want it: no tags, markup or
+// HTML from the input, with each line of a paragraph, header and list item on
+// a line of its own, and code and image alt text kept. Character references
+// are left as they were written.
+class TextVisitor: public TokenVisitor {
+public:
+    explicit TextVisitor(OutputSink& out): mOut(out), mAtLineStart(true) { }
+
+    void enter(const Token& container) override;
+    void separate(const Token& container) override;
+    void leave(const Token& container) override;
+    void visit(const Token& token) override;
+
+private:
+    void _endLine();
+
+    OutputSink& mOut;
+    bool mAtLineStart;
+};
 
 class Document: public Dokumento, private boost::noncopyable {
 public:
     Document(SyntaxHighlighter *highlighter, size_t spacesPerTab=cDefaultSpacesPerTab);
     Document(std::istream& in, SyntaxHighlighter *highlighter, size_t spacesPerTab=cDefaultSpacesPerTab);
+
+    // Makes the tokens in the caller's arena instead of one of its own. The
+    // arena is cleared when the document goes away, so that its memory can be
+    // reused for the next one; only one document may use it at a time.
+    Document(Arena& arena, SyntaxHighlighter *highlighter, size_t spacesPerTab=cDefaultSpacesPerTab);
     ~Document();
 
+    // Empties the document so that it can read the next one, without giving
+    // back the memory it has: the arena's first chunk and the link table's
+    // slots. The settings below stay as they are, except that it goes back to
+    // its own link table. Rendering many small documents one after another
+    // with the same one (per thread) saves setting a new one up each time.
+    void reset() override;
+
     // You can call read() functions multiple times before writing if
     // desirable. Once the document has been processed for writing, it can't
-    // accept any more input.
+    // accept any more input. Each read() keeps its input in the arena (a
+    // stream's in blocks of whole lines), and the line tokens refer into that
+    // instead of copying it.
     bool read(const string&) override;
     bool read(std::istream&) override;
+    bool read(const char *src, size_t length);
+
+    // Reads a whole file. Where it can (not on Windows, and only for regular,
+    // non-empty files) it maps the file read-only instead of copying it, and
+    // the line tokens refer into the mapping, which lasts as long as the
+    // arena's contents; the file mustn't be truncated until then. Returns
+    // false if the file can't be opened.
+    bool readFile(const string& path);
     void write(std::ostream&) override;
+    void write(OutputSink&) override;
     void writeTokens(std::ostream&); // For debugging
 
-    // The class is marked noncopyable because it uses reference-counted
-    // links to things that get changed during processing. If you want to
-    // copy it, use the `copy` function to explicitly say that.
-    Document copy() const; // TODO: Copy function not yet written.
+    // Processes the document, if it hasn't been yet, and walks its tokens;
+    // a TokenVisitorGroup can take it to several outputs at once. The
+    // fragment cache isn't used for this.
+    void accept(TokenVisitor& visitor);
+
+    // Writes the processed tokens in a compact binary form (described in
+    // markdown_binary.h), which readBinary() turns back into a document
+    // that's ready to write without parsing anything again. Code blocks are
+    // highlighted by the document that reads them, with its own highlighter.
+    void writeBinary(OutputSink& out);
+
+    // Instead of read(), for a document that hasn't read anything. The
+    // tokens are made with their text still in `data`, which has to last as
+    // long as the arena's contents, like readFile()'s mapping does. Returns
+    // false, and leaves the document empty, if `data` isn't what this
+    // version of writeBinary() writes.
+    bool readBinary(string_view data);
+
+    // Writes the whole document into one string, reserved beforehand from
+    // the sizes of the tokens (or, with a fragment cache, of the input) so
+    // that it's usually allocated once and never copied. renderTo() replaces
+    // what's in the caller's string but keeps its capacity.
+    string renderToString();
+    void renderTo(string& target) override;
+    size_t estimatedSize();
+
+    // Must be set before the document is written; cRegexSpanParser is the
+    // default.
+    void setSpanParser(SpanParser parser) { mSpanParser=parser; }
+
+    // Lets span-level markup in the top-level blocks be found on up to
+    // `threads` threads at once (0 means one per core). The default is 1,
+    // which keeps it all on the calling thread. Each thread gets at least
+    // cSpanBlocksPerTask blocks to do, so small documents stay on one anyway.
+    // Must also be set before the document is written.
+    void setSpanThreads(size_t threads) { mSpanThreads=threads; }
+
+    // Must be set before the document is written too.
+    void setLimits(const Limits& limits) { mLimits=limits; }
+
+    // Looks reference definitions up in, and adds them to, `ids` instead of
+    // the document's own table; DocumentStream uses this to carry them from
+    // one piece to the next. Must be set before the document is written.
+    void setLinkIds(LinkIds& ids) { mIdTable=&ids; }
+
+    // Adds what reading and writing this document cost to `stats`, which has
+    // to outlive it. Only works if the library was built with MARKDOWN_STATS.
+    void setStats(DocumentStats *stats) { mStats=stats; }
+
+    // Takes the memory for the tokens, the input and the link table from
+    // `resource` instead of the heap, or from the heap again for null; a
+    // CountingMemoryResource can then cap it, or measure it. It empties the
+    // document, as reset() does; a borrowed arena is changed for good. The
+    // strings and vectors inside the tokens still come from the heap. Once
+    // the resource has thrown std::bad_alloc, from here or while reading or
+    // writing, the document can only be given another resource or destroyed.
+    void setMemoryResource(MemoryResource *resource);
+
+    // Makes write() take the HTML of each top-level block that's been written
+    // before from `cache`, and render the others one at a time, as if each
+    // were a document of its own with the same reference definitions. That
+    // comes out the same as EditableDocument does, and the limits apply to
+    // each block too. Blocks that could have links are only taken from the
+    // cache if all of the definitions are the same as when they went in.
+    // Documents that share a cache should also share their highlighter and
+    // spacesPerTab. Has no effect with setLinkIds(), and has to be set before
+    // the document is written.
+    void setFragmentCache(FragmentCache *cache) { mFragmentCache=cache; }
+
+    // The class is marked noncopyable because its tokens live in its arena
+    // and get changed during processing. If you want to copy it, use the
+    // `copy` function to explicitly say that.
+    //
+    // The copy gets its own arena and link table, and this document's
+    // highlighter (unless given another), spacesPerTab, span parser, span
+    // threads, limits, fragment cache and memory resource. The lines read so
+    // far are only ever replaced during processing, never changed, so it
+    // shares them instead of reading them again; that means this document has
+    // to outlive the copy. Copies can be written on different threads at
+    // once, so they don't get the stats, which can't be added to from two at
+    // a time, or the table from setLinkIds(); set those on each copy that
+    // should have them. It can't be done once the document has been written,
+    // and throws std::logic_error.
+    std::unique_ptr<Document> copy() const;
+    std::unique_ptr<Document> copy(SyntaxHighlighter *highlighter) const;
 
 private:
-    bool _getline(std::istream& in, string& line);
+    void _readLines(string_view buffer);
     void _process();
     void _processFencedBlocks();
     optional<TokenPtr> parseFencedCodeBlock(CTokenGroupIter& i, CTokenGroupIter end);
     void _mergeMultilineHtmlTags();
     void _processInlineHtmlAndReferences();
-    void _processBlocksItems(TokenPtr inTokenContainer);
+    void _processBlocksItems(TokenPtr inTokenContainer, size_t depth);
     void _processParagraphLines(TokenPtr inTokenContainer);
+    void _processSpanElements();
+    void _highlightCodeBlocks();
+    void _write(OutputSink& out);
+    void _writeFragments(OutputSink& out);
+    size_t _inputSize() const;
 
-    static const size_t cSpacesPerInitialTab, cDefaultSpacesPerTab;
+    static const size_t cSpacesPerInitialTab, cDefaultSpacesPerTab, cReadBlockSize,
+        cSpanBlocksPerTask;
 
     const size_t cSpacesPerTab;
+    Arena mOwnArena;
+    Arena& mArena;
     TokenPtr mTokenContainer;
+    LinkIds *mOwnIdTable, *mIdTable;
+    bool mProcessed, mWritten;
+    SyntaxHighlighter *mHighlighter;
+    SpanParser mSpanParser;
+    size_t mSpanThreads;
+    Limits mLimits;
+    DocumentStats *mStats;
+    FragmentCache *mFragmentCache;
+};
+
+// Finds where a document can be cut into pieces that come out the same when
+// they're rendered on their own as when they're rendered together: at a line
+// that can only start a new top-level block, after a blank one, outside of a
+// fenced code block.
+class BlockSplitter {
+public:
+    BlockSplitter() { reset(); }
+
+    // Forgets everything, for the start of a new piece.
+    void reset();
+
+    // Takes the next line, without its line ending, and says whether it
+    // starts a new piece.
+    bool startsPiece(string_view line);
+
+private:
+    bool mAfterBlank, mInFence, mPieceHasText, mHtmlPiece, mCommentPiece, mHtmlEnds;
+    int mFenceLength;
+    char mFence;
+};
+
+// Renders input a piece at a time, for documents too big to hold in memory.
+// Lines are collected until a BlockSplitter says a new piece starts; the one
+// before it is then rendered as a Document of its own and dropped, so memory
+// use depends on the size of the blocks rather than of the input. Reference
+// definitions are kept from one piece to the next, which means a link only
+// works if its definition comes first.
+class DocumentStream: private boost::noncopyable {
+public:
+    DocumentStream(OutputSink& out, SyntaxHighlighter *highlighter);
+    ~DocumentStream();
+
+    void read(const char *src, size_t length);
+    void read(std::istream&);
+
+    // Renders whatever is left. Called by the destructor too, but an
+    // exception from there would be lost.
+    void finish();
+
+    void setSpanParser(SpanParser parser) { mSpanParser=parser; }
+
+    // Apply to each piece on its own; the stats add them all up.
+    void setLimits(const Limits& limits) { mLimits=limits; }
+    void setStats(DocumentStats *stats) { mStats=stats; }
+
+    // For the pieces' tokens, as Document::setMemoryResource() has it. Has
+    // to be set before anything is read.
+    void setMemoryResource(MemoryResource *resource) { mArena.setResource(resource); }
+
+private:
+    void _scanLines();
+    void _renderPending(size_t end);
+
+    static const size_t cReadBlockSize;
+
+    OutputSink& mOut;
+    SyntaxHighlighter *mHighlighter;
+    SpanParser mSpanParser;
+    Limits mLimits;
+    DocumentStats *mStats;
+    Arena mArena;
     LinkIds *mIdTable;
-    bool mProcessed;
+    BlockSplitter mSplitter;
+
+    string mPending; // Input that hasn't been rendered yet
+    size_t mPieceBegin; // Where the piece that's being collected starts
+    size_t mScanned; // Where the first line that hasn't been looked at starts
+};
+
+// Keeps a document rendered one top-level block (as BlockSplitter sees them)
+// at a time, for editors with a live preview. After an edit only the blocks
+// around it are rendered again, unless it changed the reference definitions;
+// those can change links anywhere, so then it all is.
+class EditableDocument: private boost::noncopyable {
+public:
+    // Blocks [first, first+removed) were replaced by the ones in `html`.
+    struct Change {
+        size_t first, removed;
+        std::vector<string> html;
+    };
+
+    explicit EditableDocument(SyntaxHighlighter *highlighter);
+    ~EditableDocument();
+
+    Change setText(const string& text);
+
+    // Replaces `removedLength` bytes of the text at `offset` with
+    // `insertedText`. Throws std::out_of_range if offset is past the end.
+    Change applyEdit(size_t offset, size_t removedLength, const string& insertedText);
+
+    const string& text() const { return mText; }
+    size_t blockCount() const { return mBlocks.size(); }
+    const string& blockHtml(size_t index) const { return mBlocks[index].html; }
+    void write(OutputSink&) const;
+
+    // These take effect with the next setText(). The limits apply to each
+    // block on its own, and the stats cover every block that's rendered.
+    void setSpanParser(SpanParser parser) { mSpanParser=parser; }
+    void setLimits(const Limits& limits) { mLimits=limits; }
+    void setStats(DocumentStats *stats) { mStats=stats; }
+    void setMemoryResource(MemoryResource *resource) { mArena.setResource(resource); }
+
+private:
+    struct Block {
+        size_t begin; // In mText; it ends where the next one begins
+        std::shared_ptr<LinkIds> references; // The ones it defines, if any might be
+        string html;
+    };
+
+    size_t _findBlocks(size_t begin, size_t oldBlock, ptrdiff_t shift,
+        std::vector<size_t>& starts) const;
+    void _makeBlocks(size_t at, const std::vector<size_t>& starts);
+    Change _renderAll(size_t oldCount);
+    void _render(size_t index, LinkIds& ids, OutputSink& out);
+    size_t _blockEnd(size_t index) const;
+
     SyntaxHighlighter *mHighlighter;
+    SpanParser mSpanParser;
+    Limits mLimits;
+    DocumentStats *mStats;
+    Arena mArena;
+    LinkIds *mIdTable;
+
+    string mText;
+    std::vector<Block> mBlocks;
 };
 
 } // namespace markdown
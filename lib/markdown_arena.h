@@ -0,0 +1,245 @@
+/*
+	Copyright (c) 2015 by Darcy Shen
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+#ifndef MARKDOWN_ARENA_H_INCLUDED
+#define MARKDOWN_ARENA_H_INCLUDED
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <boost/noncopyable.hpp>
+
+namespace markdown {
+
+// Where arenas get their memory from. It has the same interface as C++17's
+// std::pmr::memory_resource, so that either can be wrapped in the other with
+// a few lines. Arenas only ask it for chunks of at least a few kilobytes, and
+// the span threads' arenas ask from those threads, so a resource that's shared
+// by documents or used with setSpanThreads() has to be thread-safe.
+class MemoryResource {
+public:
+    virtual ~MemoryResource() { }
+
+    void* allocate(size_t bytes, size_t align=alignof(std::max_align_t)) {
+        return doAllocate(bytes, align);
+    }
+    void deallocate(void *p, size_t bytes, size_t align=alignof(std::max_align_t)) {
+        doDeallocate(p, bytes, align);
+    }
+    bool isEqual(const MemoryResource& other) const { return doIsEqual(other); }
+
+    // The one arenas use when they aren't given another: the global operator
+    // new and delete.
+    static MemoryResource* heap();
+
+protected:
+    // Throws std::bad_alloc if it can't.
+    virtual void* doAllocate(size_t bytes, size_t align)=0;
+    virtual void doDeallocate(void *p, size_t bytes, size_t align)=0;
+    virtual bool doIsEqual(const MemoryResource& other) const { return this==&other; }
+};
+
+inline MemoryResource* MemoryResource::heap() {
+    class Heap: public MemoryResource {
+    protected:
+        void* doAllocate(size_t bytes, size_t align) override {
+            assert(align<=alignof(std::max_align_t));
+            return ::operator new(bytes);
+        }
+        void doDeallocate(void *p, size_t, size_t) override { ::operator delete(p); }
+    };
+    static Heap resource;
+    return &resource;
+}
+
+// Passes allocations on to another resource, keeping count of them, and
+// refuses (with std::bad_alloc) any that would take more than `limit` bytes
+// in use at once; 0 is for no limit. Give one to each request's documents to
+// cap what they can take, or to see what they took. It can be shared between
+// threads.
+class CountingMemoryResource: public MemoryResource {
+public:
+    explicit CountingMemoryResource(size_t limit=0, MemoryResource *upstream=heap()):
+        mUpstream(upstream), mLimit(limit), mBytes(0), mPeak(0), mTotal(0), mAllocations(0) { }
+
+    size_t bytes() const { return mBytes; } // In use now
+    size_t peak() const { return mPeak; } // The most that's been in use at once
+    size_t total() const { return mTotal; } // All that's been allocated
+    size_t allocations() const { return mAllocations; }
+    size_t limit() const { return mLimit; }
+
+    // Starts the peak again from what's in use now.
+    void resetPeak() { mPeak=mBytes.load(); }
+
+protected:
+    void* doAllocate(size_t bytes, size_t align) override {
+        const size_t inUse=(mBytes+=bytes);
+        if (mLimit!=0 && inUse>mLimit) {
+            mBytes-=bytes;
+            throw std::bad_alloc();
+        }
+        void *p;
+        try {
+            p=mUpstream->allocate(bytes, align);
+        } catch (...) {
+            mBytes-=bytes;
+            throw;
+        }
+        size_t peak=mPeak;
+        while (inUse>peak && !mPeak.compare_exchange_weak(peak, inUse)) { }
+        mTotal+=bytes;
+        ++mAllocations;
+        return p;
+    }
+
+    void doDeallocate(void *p, size_t bytes, size_t align) override {
+        mUpstream->deallocate(p, bytes, align);
+        mBytes-=bytes;
+    }
+
+private:
+    MemoryResource *mUpstream;
+    const size_t mLimit;
+    std::atomic<size_t> mBytes, mPeak, mTotal, mAllocations;
+};
+
+// A bump allocator that owns the tokens of one document. Objects are carved
+// out of large chunks, in the order they're made, and are all destroyed at
+// once when the arena is cleared or goes away; nothing made by an arena may be
+// deleted on its own. Its chunks come from `resource`, or from the heap.
+class Arena: private boost::noncopyable {
+public:
+    explicit Arena(size_t chunkSize=cDefaultChunkSize, MemoryResource *resource=0):
+        mChunkSize(chunkSize), mResource(resource!=0 ? resource : MemoryResource::heap()),
+        mChunks(0), mCurrent(0), mEnd(0), mDestructors(0), mBytesUsed(0) { }
+    explicit Arena(MemoryResource *resource): Arena(cDefaultChunkSize, resource) { }
+    ~Arena() {
+        clear();
+        _releaseChunks(mChunks);
+    }
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        if (std::is_trivially_destructible<T>::value) {
+            return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        } else {
+            Destructor *d=static_cast<Destructor*>(allocate(sizeof(Destructor), alignof(Destructor)));
+            T *t=new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+            d->destroy=&_destroy<T>;
+            d->object=t;
+            d->next=mDestructors;
+            mDestructors=d;
+            return t;
+        }
+    }
+
+    void* allocate(size_t size, size_t align) {
+        char *p=_align(mCurrent, align);
+        if (p==0 || p+size>mEnd) {
+            _addChunk(size+align);
+            p=_align(mCurrent, align);
+        }
+        mCurrent=p+size;
+        mBytesUsed+=size;
+        return p;
+    }
+
+    // Destroys everything made so far. The first chunk is kept, so an arena
+    // that's reused for a similar document doesn't have to go back to the
+    // heap.
+    void clear() {
+        for (Destructor *d=mDestructors; d!=0; d=d->next) d->destroy(d->object);
+        mDestructors=0;
+        if (mChunks!=0) {
+            _releaseChunks(mChunks->next);
+            mChunks->next=0;
+            mCurrent=mChunks->data();
+            mEnd=mCurrent+mChunks->size;
+        }
+        mBytesUsed=0;
+    }
+
+    // Destroys everything, gives all of the chunks back, and takes any more
+    // it needs from `resource` (or the heap) instead.
+    void setResource(MemoryResource *resource) {
+        clear();
+        _releaseChunks(mChunks);
+        mChunks=0;
+        mCurrent=mEnd=0;
+        mResource=(resource!=0 ? resource : MemoryResource::heap());
+    }
+
+    MemoryResource* resource() const { return mResource; }
+
+    size_t bytesUsed() const { return mBytesUsed; }
+
+    static const size_t cDefaultChunkSize=64*1024;
+
+private:
+    struct Chunk {
+        Chunk *next;
+        size_t size;
+
+        char* data() { return reinterpret_cast<char*>(this+1); }
+    };
+
+    struct Destructor {
+        void (*destroy)(void*);
+        void *object;
+        Destructor *next;
+    };
+
+    template <typename T>
+    static void _destroy(void *object) {
+        static_cast<T*>(object)->~T();
+    }
+
+    static char* _align(char *p, size_t align) {
+        if (p==0) return 0;
+        size_t offset=reinterpret_cast<size_t>(p) & (align-1);
+        return (offset==0 ? p : p+(align-offset));
+    }
+
+    void _addChunk(size_t minimum) {
+        // The first chunk stays at the head of the list, so that clear() can
+        // keep it; later ones go right behind it.
+        size_t size=(minimum>mChunkSize ? minimum : mChunkSize);
+        Chunk *c=static_cast<Chunk*>(mResource->allocate(sizeof(Chunk)+size));
+        c->size=size;
+        if (mChunks==0) {
+            c->next=0;
+            mChunks=c;
+        } else {
+            c->next=mChunks->next;
+            mChunks->next=c;
+        }
+        mCurrent=c->data();
+        mEnd=mCurrent+size;
+    }
+
+    void _releaseChunks(Chunk *c) {
+        while (c!=0) {
+            Chunk *next=c->next;
+            mResource->deallocate(c, sizeof(Chunk)+c->size);
+            c=next;
+        }
+    }
+
+    const size_t mChunkSize;
+    MemoryResource *mResource;
+    Chunk *mChunks; // The first chunk, then the others, newest first
+    char *mCurrent, *mEnd;
+    Destructor *mDestructors; // Newest first, so things go in reverse order
+    size_t mBytesUsed;
+};
+
+} // namespace markdown
+
+#endif // MARKDOWN_ARENA_H_INCLUDED
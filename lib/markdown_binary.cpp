@@ -0,0 +1,263 @@
+/*
+	Copyright (c) 2015 by Darcy Shen
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+#include "markdown_binary.h"
+#include "markdown_tokens.h"
+
+#include <cassert>
+
+namespace markdown {
+
+namespace {
+
+const char cMagic[4]={ 'M', 'D', 'T', 'K' };
+
+// Deeper trees than any the parsers make are taken as damage, rather than
+// being allowed to run the stack out.
+const size_t cMaxDepth=1000;
+
+enum MarkerBits { cOpenMarker=0x01, cMatchedMarker=0x02, cDisabledMarker=0x04 };
+
+void putByte(OutputSink& out, unsigned char c) {
+    out << static_cast<char>(c);
+}
+
+void put32(OutputSink& out, uint32_t n) {
+    for (size_t i=0; i<4; ++i, n>>=8) putByte(out, n & 0xFF);
+}
+
+void putText(OutputSink& out, string_view text) {
+    put32(out, static_cast<uint32_t>(text.size()));
+    out << text;
+}
+
+void putToken(const Token& t, OutputSink& out) {
+    putByte(out, t.kind());
+    switch (t.kind()) {
+        case Token::cTextHolder:
+            putByte(out, static_cast<const token::TextHolder&>(t).encodingFlags());
+            putText(out, *t.text());
+            break;
+
+        case Token::cRawText:
+        case Token::cHtmlTag:
+        case Token::cHtmlAnchorTag:
+        case Token::cInlineHtmlContents:
+        case Token::cInlineHtmlComment:
+        case Token::cCodeBlock:
+        case Token::cCodeSpan:
+        case Token::cBlankLine:
+            putText(out, *t.text());
+            break;
+
+        case Token::cFencedCodeBlock:
+            putText(out, *t.text());
+            putText(out, static_cast<const token::FencedCodeBlock&>(t).infoString());
+            break;
+
+        case Token::cEscapedCharacter:
+            putByte(out, static_cast<const token::EscapedCharacter&>(t).character());
+            break;
+
+        case Token::cBoldOrItalicMarker: {
+            const token::BoldOrItalicMarker& m=static_cast<const token::BoldOrItalicMarker&>(t);
+            putByte(out, (m.isOpenMarker() ? cOpenMarker : 0) | (m.matched() ? cMatchedMarker : 0) |
+                (m.disabled() ? cDisabledMarker : 0));
+            putByte(out, m.tokenCharacter());
+            putByte(out, m.size());
+            break;
+        }
+
+        case Token::cImage: {
+            const token::Image& image=static_cast<const token::Image&>(t);
+            putText(out, image.altText());
+            putText(out, image.url());
+            putText(out, image.title());
+            break;
+        }
+
+        default: {
+            assert(t.isContainer());
+            if (t.kind()==Token::cHeader) putByte(out, static_cast<const token::Header&>(t).level());
+            const TokenGroup& sub=static_cast<const token::Container&>(t).subTokens();
+            put32(out, static_cast<uint32_t>(sub.size()));
+            for (CTokenGroupIter i=sub.begin(), ie=sub.end(); i!=ie; ++i) putToken(**i, out);
+        }
+    }
+}
+
+class BinaryReader {
+public:
+    BinaryReader(string_view data, Arena& arena, SyntaxHighlighter *highlighter):
+        mData(data), mPos(0), mFailed(false), mArena(arena), mHighlighter(highlighter) { }
+
+    Token* read() {
+        if (mData.size()<8 || mData.substr(0, 4)!=string_view(cMagic, 4)) return 0;
+        mPos=4;
+        if (_get32()!=cBinaryVersion) return 0;
+        Token *root=_token(0);
+        if (mFailed || root==0 || root->kind()!=Token::cContainer || mPos!=mData.size()) return 0;
+        return root;
+    }
+
+private:
+    unsigned char _byte() {
+        if (mPos>=mData.size()) {
+            mFailed=true;
+            return 0;
+        }
+        return static_cast<unsigned char>(mData[mPos++]);
+    }
+
+    uint32_t _get32() {
+        uint32_t n=0;
+        for (size_t i=0; i<4; ++i) n|=static_cast<uint32_t>(_byte())<<(8*i);
+        return n;
+    }
+
+    string_view _text() {
+        const uint32_t length=_get32();
+        if (mFailed || length>mData.size()-mPos) {
+            mFailed=true;
+            return string_view();
+        }
+        mPos+=length;
+        return mData.substr(mPos-length, length);
+    }
+
+    Token* _token(size_t depth) {
+        const unsigned char kind=_byte();
+        if (mFailed || depth>cMaxDepth) return _fail();
+
+        switch (kind) {
+            case Token::cTextHolder: {
+                const unsigned char flags=_byte();
+                const string_view text=_text();
+                if (mFailed) return 0;
+                return mArena.make<token::TextHolder>(text, false, flags);
+            }
+            case Token::cRawText: return _textToken<token::RawText>();
+            case Token::cHtmlTag: return _borrowedToken<token::HtmlTag>();
+            case Token::cHtmlAnchorTag: return _borrowedToken<token::HtmlAnchorTag>();
+            case Token::cInlineHtmlContents: return _borrowedToken<token::InlineHtmlContents>();
+            case Token::cInlineHtmlComment: return _borrowedToken<token::InlineHtmlComment>();
+            case Token::cCodeBlock: return _borrowedToken<token::CodeBlock>();
+            case Token::cCodeSpan: return _borrowedToken<token::CodeSpan>();
+            case Token::cBlankLine: return _textToken<token::BlankLine>();
+
+            case Token::cFencedCodeBlock: {
+                const string_view text=_text(), info=_text();
+                if (mFailed) return 0;
+                return mArena.make<token::FencedCodeBlock>(token::Borrowed(), text,
+                    info.to_string(), mHighlighter);
+            }
+
+            case Token::cEscapedCharacter: {
+                const char c=_byte();
+                if (mFailed) return 0;
+                return mArena.make<token::EscapedCharacter>(c);
+            }
+
+            case Token::cBoldOrItalicMarker: {
+                const unsigned char bits=_byte(), c=_byte(), size=_byte();
+                if (mFailed || (c!='*' && c!='_') || size<1 || size>3) return _fail();
+                token::BoldOrItalicMarker *m=mArena.make<token::BoldOrItalicMarker>(
+                    (bits & cOpenMarker)!=0, c, size);
+                // Only whether there's a match counts once it's processed, so
+                // a matched marker stands in as its own match.
+                if (bits & cMatchedMarker) m->matched(m);
+                if (bits & cDisabledMarker) m->disable();
+                return m;
+            }
+
+            case Token::cImage: {
+                const string_view alt=_text(), url=_text(), title=_text();
+                if (mFailed) return 0;
+                return mArena.make<token::Image>(alt.to_string(), url.to_string(), title.to_string());
+            }
+
+            case Token::cHeader: {
+                const unsigned char level=_byte();
+                TokenGroup sub;
+                if (level<1 || level>6 || !_subtokens(depth, sub)) return _fail();
+                return mArena.make<token::Header>(level, sub);
+            }
+
+            case Token::cContainer: return _container<token::Container>(depth);
+            case Token::cInlineHtmlBlock: return _container<token::InlineHtmlBlock>(depth);
+            case Token::cListItem: return _container<token::ListItem>(depth);
+            case Token::cUnorderedList: return _container<token::UnorderedList>(depth);
+            case Token::cOrderedList: return _container<token::OrderedList>(depth);
+            case Token::cBlockQuote: return _container<token::BlockQuote>(depth);
+            case Token::cParagraph: return _container<token::Paragraph>(depth);
+
+            default: return _fail();
+        }
+    }
+
+    template <typename T>
+    Token* _textToken() {
+        const string_view text=_text();
+        if (mFailed) return 0;
+        return mArena.make<T>(text);
+    }
+
+    template <typename T>
+    Token* _borrowedToken() {
+        const string_view text=_text();
+        if (mFailed) return 0;
+        return mArena.make<T>(token::Borrowed(), text);
+    }
+
+    template <typename T>
+    Token* _container(size_t depth) {
+        TokenGroup sub;
+        if (!_subtokens(depth, sub)) return 0;
+        return mArena.make<T>(sub);
+    }
+
+    bool _subtokens(size_t depth, TokenGroup& sub) {
+        const uint32_t count=_get32();
+        // Every token takes at least a byte, which keeps a damaged count from
+        // reserving more than the data could hold.
+        if (mFailed || count>mData.size()-mPos) {
+            mFailed=true;
+            return false;
+        }
+        sub.reserve(count);
+        for (uint32_t i=0; i<count; ++i) {
+            Token *t=_token(depth+1);
+            if (t==0) return false;
+            sub.push_back(t);
+        }
+        return true;
+    }
+
+    Token* _fail() {
+        mFailed=true;
+        return 0;
+    }
+
+    const string_view mData;
+    size_t mPos;
+    bool mFailed;
+    Arena& mArena;
+    SyntaxHighlighter *mHighlighter;
+};
+
+} // namespace
+
+void writeBinaryTokens(const Token& root, OutputSink& out) {
+    out << string_view(cMagic, 4);
+    put32(out, cBinaryVersion);
+    putToken(root, out);
+}
+
+Token* readBinaryTokens(string_view data, Arena& arena, SyntaxHighlighter *highlighter) {
+    return BinaryReader(data, arena, highlighter).read();
+}
+
+} // namespace markdown
@@ -0,0 +1,33 @@
+/*
+	Copyright (c) 2015 by Darcy Shen
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+#ifndef MARKDOWN_BINARY_H_INCLUDED
+#define MARKDOWN_BINARY_H_INCLUDED
+
+#include "markdown.h"
+
+namespace markdown {
+
+// The binary form of a processed token tree, as Document::writeBinary()
+// writes it. It starts with the four bytes "MDTK" and a 32-bit version, then
+// has the tokens in the order they're written, each container before what's
+// in it. Every token is its Kind in one byte and then what that kind needs:
+// a count of subtokens for containers, text as a 32-bit length and the bytes
+// themselves, and a few single bytes for the rest. Numbers are little-endian
+// whatever the machine, and nothing is aligned, so the text can be used right
+// where it is, in a buffer or a mapped file.
+const uint32_t cBinaryVersion=1;
+
+void writeBinaryTokens(const Token& root, OutputSink& out);
+
+// Makes the tokens in `arena`, with their text borrowed from `data`. Returns
+// null if `data` isn't in the form above, of this version, with a container
+// at the root.
+Token* readBinaryTokens(string_view data, Arena& arena, SyntaxHighlighter *highlighter);
+
+} // namespace markdown
+
+#endif // MARKDOWN_BINARY_H_INCLUDED
@@ -0,0 +1,167 @@
+/*
+	Copyright (c) 2015 by Darcy Shen
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+#include "markdown_html.h"
+
+namespace markdown {
+
+namespace {
+
+bool isTagNameCharacter(char c) {
+    return ((c>='a' && c<='z') || (c>='A' && c<='Z') || (c>='0' && c<='9'));
+}
+
+bool isQuote(char c) {
+    return (c=='"' || c=='\'');
+}
+
+// The characters that Boost's `^` and `$` take as ending a line.
+bool isLineBreak(char c) {
+    return (c=='\n' || c=='\r' || c=='\f');
+}
+
+} // namespace
+
+const size_t HtmlTagLexer::npos;
+
+HtmlTagLexer::HtmlTagLexer(string_view text, Ending ending, bool closed): mText(text),
+    mEnding(ending), mClosed(closed),
+    mHasQuotes(text.find_first_of("\"'")!=string_view::npos), mBuilt(false), mFirst(0)
+{
+}
+
+bool HtmlTagLexer::search(size_t from, Tag& tag, bool lineStart, bool needsAttribute) {
+    for (size_t at=mText.find('<', from); at!=string_view::npos; at=mText.find('<', at+1)) {
+        if (lineStart && at!=0 && !isLineBreak(mText[at-1])) continue;
+        if (matchAt(at, tag, needsAttribute)) return true;
+    }
+    return false;
+}
+
+bool HtmlTagLexer::matchAt(size_t at, Tag& tag, bool needsAttribute) {
+    const size_t length=mText.size();
+    if (at>=length || mText[at]!='<') return false;
+
+    // The name takes all the letters and digits there are: whatever comes
+    // next has to be a space, a slash or the closing angle bracket.
+    size_t i=at+1;
+    const bool closing=(i<length && mText[i]=='/');
+    if (closing) ++i;
+    const size_t nameBegin=i;
+    while (i<length && isTagNameCharacter(mText[i])) ++i;
+    if (i==nameBegin) return false;
+
+    size_t attrBegin, attrEnd;
+    const size_t end=(needsAttribute ? _attributes(i, attrBegin, attrEnd) :
+        _rest(i, attrBegin, attrEnd));
+    if (end==npos) return false;
+
+    tag.begin=at;
+    tag.end=end;
+    tag.name=mText.substr(nameBegin, i-nameBegin);
+    tag.closing=closing;
+    tag.lastAttribute=(attrBegin!=npos ? mText.substr(attrBegin, attrEnd-attrBegin) : string_view());
+    return true;
+}
+
+size_t HtmlTagLexer::matchRest(size_t at) {
+    size_t attrBegin, attrEnd;
+    return _rest(at, attrBegin, attrEnd);
+}
+
+bool HtmlTagLexer::_isEnd(size_t p) const {
+    switch (mEnding) {
+        case cLineEnd: return (p==mText.size() || isLineBreak(mText[p]));
+        case cTextEnd: return (p==mText.size());
+        default: return true;
+    }
+}
+
+size_t HtmlTagLexer::_tail(size_t p) const {
+    // The spaces, slash and closing angle bracket after the attributes.
+    const size_t length=mText.size();
+    while (p<length && mText[p]==' ') ++p;
+    if (p<length && mText[p]=='/') ++p;
+    while (p<length && mText[p]==' ') ++p;
+    if (mClosed) {
+        if (p<length && mText[p]=='>') ++p;
+        else return npos;
+    }
+    return (_isEnd(p) ? p : npos);
+}
+
+bool HtmlTagLexer::_attributeHead(size_t p, size_t& quoteAt) const {
+    // Spaces, a name, an equals sign with up to one space on either side,
+    // then the quote that starts the value.
+    const size_t length=mText.size();
+    if (p>=length || mText[p]!=' ') return false;
+    while (p<length && mText[p]==' ') ++p;
+    const size_t nameBegin=p;
+    while (p<length && isTagNameCharacter(mText[p])) ++p;
+    if (p==nameBegin) return false;
+    if (p<length && mText[p]==' ') ++p;
+    if (p>=length || mText[p]!='=') return false;
+    ++p;
+    if (p<length && mText[p]==' ') ++p;
+    if (p>=length || !isQuote(mText[p])) return false;
+    quoteAt=p;
+    return true;
+}
+
+size_t HtmlTagLexer::_attributes(size_t p, size_t& attrBegin, size_t& attrEnd) {
+    attrBegin=attrEnd=npos;
+    size_t quoteAt;
+    if (!mHasQuotes || !_attributeHead(p, quoteAt)) return npos;
+
+    _build(p);
+    const size_t close=(mText[quoteAt]=='"' ? mNextDouble : mNextSingle)[quoteAt+1-mFirst];
+    if (close==npos) return npos;
+    const size_t after=close+1-mFirst;
+    if (mAttrBegin[after]!=npos) {
+        attrBegin=mAttrBegin[after];
+        attrEnd=mAttrEnd[after];
+    } else {
+        attrBegin=p;
+        attrEnd=close+1;
+    }
+    return mRestEnd[after];
+}
+
+size_t HtmlTagLexer::_rest(size_t p, size_t& attrBegin, size_t& attrEnd) {
+    // The regex tries as few attributes as it can, so the end comes first.
+    const size_t end=_tail(p);
+    if (end!=npos) {
+        attrBegin=attrEnd=npos;
+        return end;
+    }
+    return _attributes(p, attrBegin, attrEnd);
+}
+
+void HtmlTagLexer::_build(size_t from) {
+    // Worked out from the end back, since the rest of a tag from one place
+    // only depends on what comes after it.
+    if (mBuilt && from>=mFirst) return;
+    mBuilt=true;
+    mFirst=from;
+
+    const size_t length=mText.size(), count=length+1-from;
+    mRestEnd.assign(count, npos);
+    mAttrBegin.assign(count, npos);
+    mAttrEnd.assign(count, npos);
+    mNextDouble.assign(count+1, npos);
+    mNextSingle.assign(count+1, npos);
+    for (size_t i=length+1; i-->from; ) {
+        const size_t x=i-from;
+        if (i<length) {
+            const bool closes=(mRestEnd[x+1]!=npos);
+            mNextDouble[x]=(closes && mText[i]=='"' ? i : mNextDouble[x+1]);
+            mNextSingle[x]=(closes && mText[i]=='\'' ? i : mNextSingle[x+1]);
+        }
+        mRestEnd[x]=_rest(i, mAttrBegin[x], mAttrEnd[x]);
+    }
+}
+
+} // namespace markdown
@@ -0,0 +1,80 @@
+/*
+	Copyright (c) 2015 by Darcy Shen
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+#ifndef MARKDOWN_HTML_H_INCLUDED
+#define MARKDOWN_HTML_H_INCLUDED
+
+#include <cstddef>
+#include <vector>
+
+#include <boost/utility/string_view.hpp>
+
+namespace markdown {
+
+using boost::string_view;
+
+// Finds HTML tags in a piece of text, in time proportional to its length. It
+// gives the same answers as the regular expression the parsers used to use,
+//
+//   <((/?)([a-zA-Z0-9]+)(?:( +[a-zA-Z0-9]+?(?: ?= ?("|').*?\5))*? */? *))>
+//
+// which went exponential on lines with many angle brackets and quotes that
+// don't pair up; a quoted value ends at the first quote after which the rest
+// of the tag makes sense, which is what all the backtracking came down to.
+class HtmlTagLexer {
+public:
+    // Where a tag has to end: anywhere, at the end of a line (as `$` has it,
+    // before a \n, \r or \f too), or at the end of the text.
+    enum Ending { cAnywhere, cLineEnd, cTextEnd };
+
+    struct Tag {
+        size_t begin, end; // Of the whole tag, angle brackets and all
+        string_view name;
+        bool closing;
+        string_view lastAttribute; // With the spaces before it; empty if none
+    };
+
+    // Without `closed`, the tag's closing angle bracket is left off, for the
+    // first line of one that goes on to the next.
+    HtmlTagLexer(string_view text, Ending ending=cAnywhere, bool closed=true);
+
+    // The first tag that starts at or after `from`. With `lineStart` it has
+    // to start a line as `^` has it, and with `needsAttribute` it has to
+    // have at least one attribute.
+    bool search(size_t from, Tag& tag, bool lineStart=false, bool needsAttribute=false);
+
+    // A tag that starts right at `at`.
+    bool matchAt(size_t at, Tag& tag, bool needsAttribute=false);
+
+    // The rest of a tag, starting with any spaces before its attributes, from
+    // `at`; returns where it ends, or npos.
+    size_t matchRest(size_t at);
+
+    static const size_t npos=static_cast<size_t>(-1);
+
+private:
+    bool _isEnd(size_t p) const;
+    size_t _tail(size_t p) const;
+    bool _attributeHead(size_t p, size_t& quoteAt) const;
+    size_t _attributes(size_t p, size_t& attrBegin, size_t& attrEnd);
+    size_t _rest(size_t p, size_t& attrBegin, size_t& attrEnd);
+    void _build(size_t from);
+
+    const string_view mText;
+    const Ending mEnding;
+    const bool mClosed, mHasQuotes;
+    bool mBuilt;
+
+    // For each position from mFirst on: where the rest of a tag from there
+    // ends, and its last attribute; and for each kind of quote, the first one
+    // from there that can close a value.
+    size_t mFirst;
+    std::vector<size_t> mRestEnd, mAttrBegin, mAttrEnd, mNextDouble, mNextSingle;
+};
+
+} // namespace markdown
+
+#endif // MARKDOWN_HTML_H_INCLUDED
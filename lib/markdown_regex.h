@@ -0,0 +1,75 @@
+/*
+	Copyright (c) 2015 by Darcy Shen
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+#ifndef MARKDOWN_REGEX_H_INCLUDED
+#define MARKDOWN_REGEX_H_INCLUDED
+
+#include <cstddef>
+#include <utility>
+
+#include <boost/regex.hpp>
+
+namespace markdown {
+
+#ifdef MARKDOWN_STATS
+// How many regular expressions this thread has matched, for DocumentStats.
+size_t& regexCalls();
+#endif
+
+// The regex_search and regex_match that the parsers use, which count their
+// calls when the library is built with MARKDOWN_STATS, and otherwise just
+// pass them on. They're objects rather than functions so that an unqualified
+// call can't find Boost's through its arguments' namespace instead.
+struct RegexSearch {
+    template <typename... Args>
+    bool operator()(Args&&... args) const {
+#ifdef MARKDOWN_STATS
+        ++regexCalls();
+#endif
+        return boost::regex_search(std::forward<Args>(args)...);
+    }
+
+    // Boost makes a match_results for calls that don't pass one, which
+    // allocates every time; this keeps one per thread instead.
+    template <typename Iter>
+    bool operator()(Iter begin, Iter end, const boost::regex& e,
+        boost::regex_constants::match_flag_type flags=boost::regex_constants::match_default) const
+    {
+#ifdef MARKDOWN_STATS
+        ++regexCalls();
+#endif
+        static thread_local boost::match_results<Iter> scratch;
+        return boost::regex_search(begin, end, scratch, e, flags|boost::regex_constants::match_any);
+    }
+};
+
+struct RegexMatch {
+    template <typename... Args>
+    bool operator()(Args&&... args) const {
+#ifdef MARKDOWN_STATS
+        ++regexCalls();
+#endif
+        return boost::regex_match(std::forward<Args>(args)...);
+    }
+
+    template <typename Iter>
+    bool operator()(Iter begin, Iter end, const boost::regex& e,
+        boost::regex_constants::match_flag_type flags=boost::regex_constants::match_default) const
+    {
+#ifdef MARKDOWN_STATS
+        ++regexCalls();
+#endif
+        static thread_local boost::match_results<Iter> scratch;
+        return boost::regex_match(begin, end, scratch, e, flags|boost::regex_constants::match_any);
+    }
+};
+
+const RegexSearch regex_search=RegexSearch();
+const RegexMatch regex_match=RegexMatch();
+
+} // namespace markdown
+
+#endif // MARKDOWN_REGEX_H_INCLUDED
@@ -6,11 +6,28 @@
 */
 
 #include "markdown_tokens.h"
+#include "markdown_html.h"
+#include "markdown_regex.h"
 
 #include <stack>
+#include <list>
+#include <map>
 #include <algorithm>
+#include <streambuf>
 #include <unordered_set>
+#include <limits>
 #include <cctype>
+#include <cstring>
+#include <stdexcept>
+
+#if !defined(MARKDOWN_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP>=2))
+#define MARKDOWN_USE_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
 
 #include <boost/lexical_cast.hpp>
 #include <boost/regex.hpp>
@@ -19,8 +36,8 @@ using std::cerr;
 using std::endl;
 using boost::regex;
 using boost::smatch;
-using boost::regex_search;
-using boost::regex_match;
+using markdown::regex_search;
+using markdown::regex_match;
 using boost::lexical_cast;
 using std::unordered_set;
 using std::isalnum;
@@ -44,28 +61,114 @@ char escapedCharacter(size_t index) {
     return cEscapedCharacters[index];
 }
 
-string encodeString(const string& src, int encodingFlags) {
+// Lets a SyntaxHighlighter, which writes to a std::ostream, write to a sink.
+class SinkStreambuf: public std::streambuf {
+public:
+    explicit SinkStreambuf(OutputSink& sink): mSink(sink) { }
+
+protected:
+    std::streamsize xsputn(const char *s, std::streamsize n) override {
+        mSink.write(s, n);
+        return n;
+    }
+    int_type overflow(int_type c) override {
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+            mSink.put(traits_type::to_char_type(c));
+        return traits_type::not_eof(c);
+    }
+
+private:
+    OutputSink& mSink;
+};
+
+// True if the '&' at p starts one of the entities that are passed through
+// as they are: "&amp;", or a short decimal or hexadecimal character
+// reference.
+bool isPassedEntity(const char *p, const char *end) {
+    const size_t length=end-p;
+    if (length>=5 && std::memcmp(p, "&amp;", 5)==0) return true;
+    if (length<4 || p[1]!='#') return false;
+
+    const char *i=p+2;
+    const bool hex=(*i=='x' || *i=='X');
+    if (hex) ++i;
+    const char *digits=i;
+    const size_t maxDigits=(hex ? 2 : 3);
+    while (i!=end && static_cast<size_t>(i-digits)<maxDigits &&
+            (hex ? std::isxdigit(static_cast<unsigned char>(*i)) :
+                   std::isdigit(static_cast<unsigned char>(*i))))
+        ++i;
+    return (i!=digits && i!=end && *i==';');
+}
+
+bool mightNeedEncoding(char c) {
+    return (c=='&' || c=='<' || c=='>' || c=='\"');
+}
+
+#ifdef MARKDOWN_USE_SSE2
+inline unsigned int lowestSetBit(unsigned int mask) {
+#ifdef _MSC_VER
+    unsigned long r;
+    _BitScanForward(&r, mask);
+    return r;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+// Finds the next character that encodeString might have to replace, sixteen
+// at a time where it can. Which of them really need it depends on the flags,
+// so that's left to the caller.
+const char* findEncodingCandidate(const char *p, const char *end) {
+#ifdef MARKDOWN_USE_SSE2
+    const __m128i amp=_mm_set1_epi8('&'), lt=_mm_set1_epi8('<'),
+        gt=_mm_set1_epi8('>'), quot=_mm_set1_epi8('"');
+    while (end-p>=16) {
+        const __m128i block=_mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        const __m128i hits=_mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(block, amp), _mm_cmpeq_epi8(block, lt)),
+            _mm_or_si128(_mm_cmpeq_epi8(block, gt), _mm_cmpeq_epi8(block, quot)));
+        const unsigned int mask=_mm_movemask_epi8(hits);
+        if (mask!=0) return p+lowestSetBit(mask);
+        p+=16;
+    }
+#endif
+    while (p!=end && !mightNeedEncoding(*p)) ++p;
+    return p;
+}
+
+void encodeString(string_view src, int encodingFlags, OutputSink& out) {
     bool amps=(encodingFlags & cAmps)!=0,
          doubleAmps=(encodingFlags & cDoubleAmps)!=0,
          angleBrackets=(encodingFlags & cAngles)!=0,
          quotes=(encodingFlags & cQuotes)!=0;
 
-    string tgt;
-    for (auto i=src.cbegin(), ie=src.cend(); i!=ie; ++i) {
+    const char *p=src.begin(), *end=src.end();
+    while (p!=end) {
+        const char *i=findEncodingCandidate(p, end);
+        out.write(p, i-p);
+        if (i==end) break;
+        p=i+1;
+
         if (*i=='&' && amps) {
-            static const regex cIgnore("^(&amp;)|(&#[0-9]{1,3};)|(&#[xX][0-9a-fA-F]{1,2};)");
-            if (regex_search(i, ie, cIgnore)) {
-                tgt.push_back(*i);
-            } else {
-                tgt+="&amp;";
-            }
+            if (isPassedEntity(i, end)) out.put('&');
+            else out << "&amp;";
         }
-        else if (*i=='&' && doubleAmps) tgt+="&amp;";
-        else if (*i=='<' && angleBrackets) tgt+="&lt;";
-        else if (*i=='>' && angleBrackets) tgt+="&gt;";
-        else if (*i=='\"' && quotes) tgt+="&quot;";
-        else tgt.push_back(*i);
+        else if (*i=='&' && doubleAmps) out << "&amp;";
+        else if (*i=='<' && angleBrackets) out << "&lt;";
+        else if (*i=='>' && angleBrackets) out << "&gt;";
+        else if (*i=='\"' && quotes) out << "&quot;";
+        else out.put(*i);
     }
+}
+
+string encodeString(string_view src, int encodingFlags) {
+    string tgt;
+    tgt.reserve(src.size()+src.size()/8);
+    StringSink out(tgt);
+    encodeString(src, encodingFlags, out);
+    out.flush();
     return tgt;
 }
 
@@ -164,16 +267,17 @@ const char *cBlockTagInit[]= { "address/", "article/", "aside/", "base", "basefo
                                "legend", "li/", "link", "main/", "menu/", "menuitem", "meta", "nav",
                                "noframes/", "ol/", "optgroup", "option", "p/", "param", "ruby", "rt", "section",
                                "source", "summary", "table/", "tbody/", "tr/", "th/", "td/", "thead/",
-                               "tfoot/", "title", "track", "ul/"
+                               "tfoot/", "title", "track", "ul/",
+
+                               0
                              };
 
 // Other official ones (not presently in use in this code)
 //"!doctype", "bdo", "body", "button", "fieldset", "head", "html",
 //"legend", "noscript", "optgroup", "xmp",
 
-unordered_set<string> otherTags, blockTags;
-
-void initTag(unordered_set<string> &set, const char *init[]) {
+unordered_set<string> makeTagSet(const char *init[]) {
+    unordered_set<string> set;
     for (size_t x=0; init[x]!=0; ++x) {
         string str=init[x];
         if (*str.rbegin()=='/') {
@@ -182,6 +286,48 @@ void initTag(unordered_set<string> &set, const char *init[]) {
         }
         set.insert(str);
     }
+    return set;
+}
+
+// Like the function-level static regexes elsewhere, these are built on first
+// use (which C++11 makes thread-safe) and never changed afterwards, so any
+// number of documents can look them up at once.
+const unordered_set<string>& otherTags() {
+    static const unordered_set<string> cTags(makeTagSet(cOtherTagInit));
+    return cTags;
+}
+
+const unordered_set<string>& blockTags() {
+    static const unordered_set<string> cTags(makeTagSet(cBlockTagInit));
+    return cTags;
+}
+
+regex makeRightFlankingExpression(char c, size_t length) {
+    string n=lexical_cast<string>(length);
+    if (c=='*')
+        return regex("((?:(?<! )\\*{" + n + "}(?=$| |[[:punct:]]))|"
+                     "(?:(?<! |[[:punct:]])\\*{" + n + "}))");
+    else
+        return regex("((?:(?<! |[[:punct:]])_{" + n + "})|"
+                     "(?:(?<! )_{" + n + "}(?=$| |[[:punct:]])))");
+}
+
+const regex& rightFlankingExpression(char c, size_t length) {
+    // There are only six possible close-markers (asterisks or underscores,
+    // one to three of them), so they're compiled once rather than once for
+    // every open-marker seen.
+    static const regex cAsterisks[]= {
+        makeRightFlankingExpression('*', 1),
+        makeRightFlankingExpression('*', 2),
+        makeRightFlankingExpression('*', 3)
+    };
+    static const regex cUnderscores[]= {
+        makeRightFlankingExpression('_', 1),
+        makeRightFlankingExpression('_', 2),
+        makeRightFlankingExpression('_', 3)
+    };
+    assert(length>=1 && length<=3);
+    return (c=='*' ? cAsterisks : cUnderscores)[length-1];
 }
 
 string cleanTextLinkRef(const string& ref) {
@@ -201,63 +347,702 @@ string cleanTextLinkRef(const string& ref) {
 
 
 size_t isValidTag(const string& tag, bool nonBlockFirst) {
-    if (blockTags.empty()) {
-        initTag(otherTags, cOtherTagInit);
-        initTag(blockTags, cBlockTagInit);
-    }
+    const unordered_set<string>& other=otherTags(), & block=blockTags();
 
     string TAG(tag);
     transform(TAG.begin(), TAG.end(), TAG.begin(), tolower);
     if (nonBlockFirst) {
-        if (otherTags.find(TAG)!=otherTags.end()) return 1;
-        if (blockTags.find(TAG)!=blockTags.end()) return 2;
+        if (other.find(TAG)!=other.end()) return 1;
+        if (block.find(TAG)!=block.end()) return 2;
     } else {
-        if (blockTags.find(TAG)!=blockTags.end()) return 2;
-        if (otherTags.find(TAG)!=otherTags.end()) return 1;
+        if (block.find(TAG)!=block.end()) return 2;
+        if (other.find(TAG)!=other.end()) return 1;
     }
     return 0;
 }
 
 
 
-void TextHolder::writeAsHtml(std::ostream& out) const {
+void TextHolder::writeAsHtml(OutputSink& out) const {
     preWrite(out);
     if (mEncodingFlags!=0) {
-        out << encodeString(mText, mEncodingFlags);
+        encodeString(*text(), mEncodingFlags, out);
     } else {
-        out << mText;
+        out << *text();
     }
     postWrite(out);
 }
 
-optional<TokenGroup> RawText::processSpanElements(const LinkIds& idTable) {
+namespace {
+
+bool isSpaceCharacter(char c) {
+    return (c==' ' || c=='\t' || c=='\n' || c=='\r' || c=='\f' || c=='\v');
+}
+
+bool isPunctuationCharacter(char c) {
+    return ((c & 0x80)==0 && std::ispunct(static_cast<unsigned char>(c)));
+}
+
+// Finds span-level markup in one line in a single left-to-right pass, as an
+// alternative to the regex-based functions in RawText. Code spans, escapes,
+// autolinks and HTML tags become tokens as soon as they're seen; emphasis
+// delimiters and link brackets are kept on stacks until it's known what (if
+// anything) they match, following the "phase 2: inline structure" appendix
+// of the CommonMark spec.
+class SpanScanner {
+public:
+    SpanScanner(const string& src, const SpanContext& ctx): mSrc(src),
+        mIdTable(ctx.idTable), mArena(ctx.arena),
+        mMaxDelimiters(ctx.budget.limits().maxDelimiters!=0 ?
+            ctx.budget.limits().maxDelimiters : std::numeric_limits<size_t>::max()),
+        mPos(0), mTextBegin(0),
+        mDelimiterTop(-1), mNextMatchId(0), mLinkEnd(0), mBacktickRunsFrom(string::npos)
+    {
+        for (size_t i=0; i<3; ++i) mUnclosedTitlesFrom[i]=string::npos;
+    }
+
+    TokenGroup scan();
+
+private:
+    // The line is collected as pieces first, because the emphasis markers
+    // can't be placed until all of the delimiter runs have been seen.
+    struct Piece {
+        enum Kind { cText, cToken, cDelimiterRun };
+
+        Piece(Kind k, size_t b, size_t e, TokenPtr t=TokenPtr()): kind(k),
+            begin(b), end(e), token(t), count(0) { }
+
+        Kind kind;
+        size_t begin, end; // Source range of text and delimiter runs
+        TokenPtr token;
+        size_t count; // Characters of a delimiter run that are still unused
+        TokenGroup closers, openers; // Markers the run has been matched to
+    };
+
+    struct Delimiter {
+        size_t piece;
+        char c;
+        size_t length; // Of the whole run, as originally seen
+        bool canOpen, canClose;
+        int prev, next;
+    };
+
+    struct Bracket {
+        size_t piece; // The "[" or "![" text
+        size_t textBegin;
+        bool image;
+        int delimiterBottom;
+    };
+
+    void _flushText();
+    void _scanEscape();
+    void _scanCodeSpan();
+    void _scanDelimiterRun();
+    void _scanAngleBracket();
+    void _openBracket(bool image);
+    void _closeBracket();
+
+    size_t _findCodeSpanEnd(size_t begin, size_t length);
+    size_t _findHtmlTagEnd(size_t begin, string& tagName) const;
+    bool _parseInlineLink(size_t begin, string& url, string& title, size_t&
+        end);
+    bool _parseReferenceLink(const Bracket& bracket, size_t textEnd, string&
+        url, string& title, size_t& end) const;
+    string _unescape(size_t begin, size_t end) const;
+
+    void _processEmphasis(int stackBottom);
+    void _removeDelimiter(int index);
+
+    TokenGroup _makeTokens();
+
+    // The spec's limits, which keep links from rescanning the rest of the
+    // line: how deeply parentheses can nest in a destination, and how long
+    // a link label can be.
+    static const size_t cMaxLinkParentheses=32, cMaxLabelLength=999;
+
+    const string& mSrc;
+    const LinkIds& mIdTable;
+    Arena& mArena;
+    const size_t mMaxDelimiters; // Past that many, runs and brackets are text
+    size_t mPos, mTextBegin;
+
+    std::vector<Piece> mPieces;
+    std::vector<Delimiter> mDelimiters;
+    std::vector<Bracket> mBrackets;
+    int mDelimiterTop;
+    int mNextMatchId;
+
+    // Brackets other than images' that were opened before the end of the
+    // last link can't start one, since it would have to contain that link.
+    size_t mLinkEnd;
+
+    // Where a title begun with ", ' or ( is known to have nothing to close
+    // it. A title starting later would find none either, so each unclosed
+    // one only costs a look through the rest of the line once.
+    size_t mUnclosedTitlesFrom[3];
+
+    // Backtick runs following the first code span opener, by length, with
+    // the index of the next one that could still close a span. Keeps
+    // unmatched runs from rescanning the rest of the line each time.
+    struct BacktickRuns {
+        BacktickRuns(): next(0) { }
+        std::vector<size_t> positions;
+        size_t next;
+    };
+    std::unordered_map<size_t, BacktickRuns> mBacktickRuns;
+    size_t mBacktickRunsFrom;
+};
+
+TokenGroup SpanScanner::scan() {
+    const size_t length=mSrc.length();
+    while (mPos<length) {
+        switch (mSrc[mPos]) {
+            case '\\': _scanEscape(); break;
+            case '`': _scanCodeSpan(); break;
+            case '*': case '_': _scanDelimiterRun(); break;
+            case '<': _scanAngleBracket(); break;
+            case '[': _openBracket(false); break;
+            case ']': _closeBracket(); break;
+            case '!':
+                if (mPos+1<length && mSrc[mPos+1]=='[') _openBracket(true);
+                else ++mPos;
+                break;
+            default: ++mPos;
+        }
+    }
+    _flushText();
+    _processEmphasis(-1);
+    return _makeTokens();
+}
+
+void SpanScanner::_flushText() {
+    if (mTextBegin<mPos) mPieces.push_back(Piece(Piece::cText, mTextBegin, mPos));
+    mTextBegin=mPos;
+}
+
+void SpanScanner::_scanEscape() {
+    if (mPos+1<mSrc.length() && isEscapedCharacter(mSrc[mPos+1])) {
+        _flushText();
+        mPieces.push_back(Piece(Piece::cToken, mPos, mPos+2,
+            mArena.make<EscapedCharacter>(mSrc[mPos+1])));
+        mPos+=2;
+        mTextBegin=mPos;
+    } else ++mPos;
+}
+
+size_t SpanScanner::_findCodeSpanEnd(size_t begin, size_t length) {
+    if (mBacktickRunsFrom==string::npos) {
+        // First code span on the line: record every backtick run after it.
+        mBacktickRuns.clear();
+        mBacktickRunsFrom=begin;
+        for (size_t i=begin, ie=mSrc.length(); i<ie; ) {
+            if (mSrc[i]!='`') { ++i; continue; }
+            size_t runBegin=i;
+            while (i<ie && mSrc[i]=='`') ++i;
+            mBacktickRuns[i-runBegin].positions.push_back(runBegin);
+        }
+    }
+
+    std::unordered_map<size_t, BacktickRuns>::iterator r=mBacktickRuns.find(length);
+    if (r==mBacktickRuns.end()) return string::npos;
+    BacktickRuns& runs=r->second;
+    while (runs.next<runs.positions.size() && runs.positions[runs.next]<begin)
+        ++runs.next;
+    if (runs.next==runs.positions.size()) return string::npos;
+    return runs.positions[runs.next++];
+}
+
+void SpanScanner::_scanCodeSpan() {
+    size_t begin=mPos, contentBegin=mPos;
+    while (contentBegin<mSrc.length() && mSrc[contentBegin]=='`') ++contentBegin;
+    size_t length=contentBegin-begin;
+
+    size_t contentEnd=_findCodeSpanEnd(contentBegin, length);
+    if (contentEnd==string::npos) {
+        // No closing run of the same length, so the backticks are literal.
+        mPos=contentBegin;
+        return;
+    }
+
+    size_t b=contentBegin, e=contentEnd;
+    while (b<e && mSrc[b]==' ') ++b;
+    while (e>b && mSrc[e-1]==' ') --e;
+    if (b==e) {
+        // Nothing but spaces; keep them.
+        b=contentBegin;
+        e=contentEnd;
+    }
+
+    _flushText();
+    mPieces.push_back(Piece(Piece::cToken, begin, contentEnd+length,
+        mArena.make<CodeSpan>(mSrc.substr(b, e-b))));
+    mPos=contentEnd+length;
+    mTextBegin=mPos;
+}
+
+void SpanScanner::_scanDelimiterRun() {
+    const char c=mSrc[mPos];
+    size_t begin=mPos, end=mPos;
+    while (end<mSrc.length() && mSrc[end]==c) ++end;
+
+    // The start and end of the line count as whitespace.
+    char before=(begin>0 ? mSrc[begin-1] : ' ');
+    char after=(end<mSrc.length() ? mSrc[end] : ' ');
+    bool leftFlanking=!isSpaceCharacter(after) && (!isPunctuationCharacter(after)
+        || isSpaceCharacter(before) || isPunctuationCharacter(before));
+    bool rightFlanking=!isSpaceCharacter(before) && (!isPunctuationCharacter(before)
+        || isSpaceCharacter(after) || isPunctuationCharacter(after));
+
+    Delimiter d;
+    d.c=c;
+    d.length=end-begin;
+    if (c=='*') {
+        d.canOpen=leftFlanking;
+        d.canClose=rightFlanking;
+    } else {
+        // Underscores can't be used for intraword emphasis.
+        d.canOpen=leftFlanking && (!rightFlanking || isPunctuationCharacter(before));
+        d.canClose=rightFlanking && (!leftFlanking || isPunctuationCharacter(after));
+    }
+
+    if ((!d.canOpen && !d.canClose) || mDelimiters.size()>=mMaxDelimiters) {
+        // Can't be emphasis, so it's just part of the text.
+        mPos=end;
+        return;
+    }
+
+    _flushText();
+    Piece run(Piece::cDelimiterRun, begin, end);
+    run.count=d.length;
+    d.piece=mPieces.size();
+    mPieces.push_back(run);
+
+    d.prev=mDelimiterTop;
+    d.next=-1;
+    mDelimiters.push_back(d);
+    if (mDelimiterTop>=0) mDelimiters[mDelimiterTop].next=mDelimiters.size()-1;
+    mDelimiterTop=mDelimiters.size()-1;
+
+    mPos=end;
+    mTextBegin=mPos;
+}
+
+size_t SpanScanner::_findHtmlTagEnd(size_t begin, string& tagName) const {
+    // Returns the position after the closing angle bracket, or npos. Quoted
+    // attribute values may contain angle brackets.
+    const size_t length=mSrc.length();
+    size_t i=begin+1;
+    if (i<length && mSrc[i]=='/') ++i;
+    size_t nameBegin=i;
+    while (i<length && isalnum(static_cast<unsigned char>(mSrc[i]))) ++i;
+    if (i==nameBegin) return string::npos;
+    tagName=mSrc.substr(nameBegin, i-nameBegin);
+
+    while (i<length) {
+        char c=mSrc[i];
+        if (c=='>') return i+1;
+        else if (c=='<') return string::npos;
+        else if (c=='"' || c=='\'') {
+            i=mSrc.find(c, i+1);
+            if (i==string::npos) return string::npos;
+        }
+        ++i;
+    }
+    return string::npos;
+}
+
+void SpanScanner::_scanAngleBracket() {
+    const size_t begin=mPos, length=mSrc.length();
+
+    // Auto-links can't contain spaces or other angle brackets.
+    size_t i=begin+1;
+    while (i<length && mSrc[i]!='>' && mSrc[i]!='<' && !isSpaceCharacter(mSrc[i])) ++i;
+    if (Features::cAutolinks && i<length && mSrc[i]=='>' && i>begin+1) {
+        string contents=mSrc.substr(begin+1, i-begin-1);
+        TokenGroup subgroup;
+        if (looksLikeUrl(contents)) {
+            subgroup.push_back(mArena.make<HtmlAnchorTag>(contents));
+            subgroup.push_back(mArena.make<RawText>(contents, 0, false));
+        } else if (looksLikeEmailAddress(contents)) {
+            subgroup.push_back(mArena.make<HtmlAnchorTag>(emailEncode("mailto:"+contents)));
+            subgroup.push_back(mArena.make<RawText>(emailEncode(contents), 0, false));
+        }
+        if (!subgroup.empty()) {
+            subgroup.push_back(mArena.make<HtmlTag>("/a"));
+            _flushText();
+            mPieces.push_back(Piece(Piece::cToken, begin, i+1,
+                mArena.make<Container>(subgroup)));
+            mPos=i+1;
+            mTextBegin=mPos;
+            return;
+        }
+    }
+
+    if (!Features::cRawHtml) {
+        ++mPos;
+        return;
+    }
+
+    string tagName;
+    size_t end=_findHtmlTagEnd(begin, tagName);
+    if (end!=string::npos && isValidTag(tagName)) {
+        _flushText();
+        mPieces.push_back(Piece(Piece::cToken, begin, end,
+            mArena.make<HtmlTag>(mSrc.substr(begin+1, end-begin-2))));
+        mPos=end;
+        mTextBegin=mPos;
+    } else ++mPos;
+}
+
+void SpanScanner::_openBracket(bool image) {
+    if (mBrackets.size()>=mMaxDelimiters) {
+        mPos+=(image ? 2 : 1);
+        return;
+    }
+
+    _flushText();
+    mPos+=(image ? 2 : 1);
+
+    Bracket b;
+    b.piece=mPieces.size();
+    b.textBegin=mPos;
+    b.image=image;
+    b.delimiterBottom=mDelimiterTop;
+    mBrackets.push_back(b);
+
+    _flushText();
+}
+
+string SpanScanner::_unescape(size_t begin, size_t end) const {
+    string r;
+    r.reserve(end-begin);
+    for (size_t i=begin; i<end; ++i) {
+        if (mSrc[i]=='\\' && i+1<end && isPunctuationCharacter(mSrc[i+1])) ++i;
+        r.push_back(mSrc[i]);
+    }
+    return r;
+}
+
+bool SpanScanner::_parseInlineLink(size_t begin, string& url, string& title,
+    size_t& end)
+{
+    const size_t length=mSrc.length();
+    size_t i=begin;
+    if (i>=length || mSrc[i]!='(') return false;
+    ++i;
+    while (i<length && isSpaceCharacter(mSrc[i])) ++i;
+
+    if (i<length && mSrc[i]=='<') {
+        size_t urlBegin=++i;
+        while (i<length && mSrc[i]!='>' && mSrc[i]!='<') {
+            if (mSrc[i]=='\\' && i+1<length) ++i;
+            ++i;
+        }
+        if (i>=length || mSrc[i]!='>') return false;
+        url=_unescape(urlBegin, i);
+        ++i;
+    } else {
+        // Parentheses are allowed in the URL, as long as they're balanced.
+        size_t urlBegin=i, depth=0;
+        while (i<length && !isSpaceCharacter(mSrc[i])) {
+            if (mSrc[i]=='\\' && i+1<length && isPunctuationCharacter(mSrc[i+1])) {
+                i+=2;
+                continue;
+            }
+            if (mSrc[i]=='(') {
+                if (++depth>cMaxLinkParentheses) return false;
+            } else if (mSrc[i]==')') {
+                if (depth==0) break;
+                --depth;
+            }
+            ++i;
+        }
+        if (depth!=0) return false;
+        url=_unescape(urlBegin, i);
+    }
+
+    size_t titleSeparator=i;
+    while (i<length && isSpaceCharacter(mSrc[i])) ++i;
+    if (i<length && i>titleSeparator && (mSrc[i]=='"' || mSrc[i]=='\'' || mSrc[i]=='(')) {
+        char close=(mSrc[i]=='(' ? ')' : mSrc[i]);
+        size_t titleBegin=++i;
+        size_t& unclosed=mUnclosedTitlesFrom[close=='"' ? 0 : close=='\'' ? 1 : 2];
+        if (titleBegin>=unclosed) return false;
+        while (i<length && mSrc[i]!=close) {
+            if (mSrc[i]=='\\' && i+1<length) ++i;
+            ++i;
+        }
+        if (i>=length) {
+            unclosed=titleBegin;
+            return false;
+        }
+        title=_unescape(titleBegin, i);
+        ++i;
+        while (i<length && isSpaceCharacter(mSrc[i])) ++i;
+    }
+
+    if (i>=length || mSrc[i]!=')') return false;
+    end=i+1;
+    return true;
+}
+
+bool SpanScanner::_parseReferenceLink(const Bracket& bracket, size_t textEnd,
+    string& url, string& title, size_t& end) const
+{
+    if (!Features::cReferences) return false;
+
+    const size_t length=mSrc.length();
+    string label;
+    end=textEnd+1;
+    if (end<length && mSrc[end]=='[') {
+        size_t i=end+1;
+        const size_t limit=std::min(length, i+cMaxLabelLength+1);
+        while (i<limit && mSrc[i]!=']' && mSrc[i]!='[') {
+            if (mSrc[i]=='\\' && i+1<length) ++i;
+            ++i;
+        }
+        if (i<limit && mSrc[i]==']') {
+            // A full reference ("[text][id]") or a collapsed one ("[text][]").
+            label=mSrc.substr(end+1, i-end-1);
+            end=i+1;
+            if (!label.empty()) {
+                optional<LinkIds::Target> target=mIdTable.find(cleanTextLinkRef(label));
+                if (!target) return false;
+                url=target->url.to_string();
+                title=target->title.to_string();
+                return true;
+            }
+        }
+    }
+
+    // A shortcut ("[text]") or collapsed reference uses the text as the id.
+    if (textEnd-bracket.textBegin>cMaxLabelLength) return false;
+    label=mSrc.substr(bracket.textBegin, textEnd-bracket.textBegin);
+    if (label.empty()) return false;
+    optional<LinkIds::Target> target=mIdTable.find(cleanTextLinkRef(label));
+    if (!target) return false;
+    url=target->url.to_string();
+    title=target->title.to_string();
+    return true;
+}
+
+void SpanScanner::_closeBracket() {
+    if (mBrackets.empty()) {
+        ++mPos;
+        return;
+    }
+
+    Bracket b=mBrackets.back();
+    mBrackets.pop_back();
+
+    string url, title;
+    size_t end;
+    if ((!b.image && b.textBegin<mLinkEnd) ||
+        !(_parseInlineLink(mPos+1, url, title, end) ||
+                       _parseReferenceLink(b, mPos, url, title, end)))
+    {
+        ++mPos;
+        return;
+    }
+
+    _flushText();
+    if (b.image) {
+        // The alt text is used as-is, so nothing inside it is markup.
+        string altText=mSrc.substr(b.textBegin, mPos-b.textBegin);
+        while (mDelimiterTop!=b.delimiterBottom) _removeDelimiter(mDelimiterTop);
+        mPieces.resize(b.piece+1, Piece(Piece::cText, 0, 0));
+        mPieces[b.piece]=Piece(Piece::cToken, b.textBegin, end,
+            mArena.make<Image>(altText, url, title));
+    } else {
+        _processEmphasis(b.delimiterBottom);
+        mPieces[b.piece]=Piece(Piece::cToken, b.textBegin, b.textBegin,
+            mArena.make<HtmlAnchorTag>(url, title));
+        mPieces.push_back(Piece(Piece::cToken, mPos, end, mArena.make<HtmlTag>("/a")));
+
+        // Links can't contain other links.
+        mLinkEnd=end;
+    }
+
+    mPos=end;
+    mTextBegin=mPos;
+}
+
+void SpanScanner::_removeDelimiter(int index) {
+    Delimiter& d=mDelimiters[index];
+    if (d.prev>=0) mDelimiters[d.prev].next=d.next;
+    if (d.next>=0) mDelimiters[d.next].prev=d.prev;
+    if (mDelimiterTop==index) mDelimiterTop=d.prev;
+}
+
+void SpanScanner::_processEmphasis(int stackBottom) {
+    // Matches close-markers against open-markers above stackBottom. The
+    // openersBottom table remembers, for each kind of close-marker, how far
+    // down the stack it's already known that no open-marker will fit, which
+    // keeps this linear.
+    int openersBottom[2][2][3];
+    for (size_t c=0; c<2; ++c)
+        for (size_t o=0; o<2; ++o)
+            for (size_t l=0; l<3; ++l)
+                openersBottom[c][o][l]=stackBottom;
+
+    int closer=-1;
+    for (int d=mDelimiterTop; d>=0 && d!=stackBottom; d=mDelimiters[d].prev)
+        closer=d;
+
+    while (closer>=0) {
+        const Delimiter& close=mDelimiters[closer];
+        if (!close.canClose) {
+            closer=close.next;
+            continue;
+        }
+
+        int& bottom=openersBottom[close.c=='_'][close.canOpen][close.length%3];
+        int opener=-1;
+        for (int d=close.prev; d>=0 && d!=stackBottom && d!=bottom;
+                d=mDelimiters[d].prev)
+        {
+            const Delimiter& open=mDelimiters[d];
+            if (open.canOpen && open.c==close.c) {
+                // If either run could both open and close, their combined
+                // length can't be a multiple of three (unless both are).
+                bool oddMatch=(close.canOpen || open.canClose) &&
+                    (open.length+close.length)%3==0 &&
+                    !(open.length%3==0 && close.length%3==0);
+                if (!oddMatch) {
+                    opener=d;
+                    break;
+                }
+            }
+        }
+
+        if (opener<0) {
+            int next=close.next;
+            bottom=close.prev;
+            if (!close.canOpen) _removeDelimiter(closer);
+            closer=next;
+            continue;
+        }
+
+        Piece& openRun=mPieces[mDelimiters[opener].piece];
+        Piece& closeRun=mPieces[close.piece];
+        size_t size=(openRun.count>=2 && closeRun.count>=2 ? 2 : 1);
+
+        BoldOrItalicMarker *openMarker=mArena.make<BoldOrItalicMarker>(true, close.c, size),
+            *closeMarker=mArena.make<BoldOrItalicMarker>(false, close.c, size);
+        openMarker->matched(closeMarker, mNextMatchId);
+        closeMarker->matched(openMarker, mNextMatchId);
+        ++mNextMatchId;
+        openRun.openers.push_back(TokenPtr(openMarker));
+        closeRun.closers.push_back(TokenPtr(closeMarker));
+        openRun.count-=size;
+        closeRun.count-=size;
+
+        // Anything between the two can no longer match.
+        for (int d=close.prev; d!=opener; ) {
+            int prev=mDelimiters[d].prev;
+            _removeDelimiter(d);
+            d=prev;
+        }
+        if (openRun.count==0) _removeDelimiter(opener);
+        if (closeRun.count==0) {
+            int next=close.next;
+            _removeDelimiter(closer);
+            closer=next;
+        }
+    }
+
+    while (mDelimiterTop>=0 && mDelimiterTop!=stackBottom)
+        _removeDelimiter(mDelimiterTop);
+}
+
+TokenGroup SpanScanner::_makeTokens() {
+    TokenGroup r;
+    string text;
+    for (auto i=mPieces.cbegin(), ie=mPieces.cend(); i!=ie; ++i) {
+        if (i->kind==Piece::cText) {
+            text.append(mSrc, i->begin, i->end-i->begin);
+            continue;
+        }
+
+        bool markers=(i->kind==Piece::cDelimiterRun &&
+                      (!i->closers.empty() || !i->openers.empty()));
+        if (i->kind==Piece::cToken || markers) {
+            if (!text.empty()) r.push_back(mArena.make<RawText>(text));
+            text.clear();
+        }
+
+        if (i->kind==Piece::cToken) {
+            r.push_back(i->token);
+        } else {
+            // Close-markers were matched innermost-first, open-markers too, so
+            // the open-markers go out in the opposite order. Any unused
+            // characters stay between them as text.
+            r.insert(r.end(), i->closers.begin(), i->closers.end());
+            text.append(i->count, mSrc[i->begin]);
+            if (!i->openers.empty()) {
+                if (!text.empty()) r.push_back(mArena.make<RawText>(text));
+                text.clear();
+                r.insert(r.end(), i->openers.rbegin(), i->openers.rend());
+            }
+        }
+    }
+    if (!text.empty()) r.push_back(mArena.make<RawText>(text));
+    return r;
+}
+
+} // namespace
+
+
+
+optional<TokenGroup> RawText::processSpanElements(const SpanContext& ctx) {
     if (!canContainMarkup()) return none;
 
-    ReplacementTable replacements;
-    string str=_processHtmlTagAttributes(*text(), replacements);
-    str=_processCodeSpans(str, replacements);
-    str=_processEscapedCharacters(str);
-    str=_processLinksImagesAndTags(str, replacements, idTable);
-    return _processBoldAndItalicSpans(str, replacements);
+    // Lines without any span-level markup are left alone, so that they can
+    // go on referring to the input buffer.
+    static const char cMarkupCharacters[]="\\`*_[]<!\x01";
+    const string_view view=*text();
+    if (!view.empty() && view.find_first_of(cMarkupCharacters)==string_view::npos)
+        return none;
+    if (!ctx.budget.spend(view.size())) return none;
+
+    const string src(view.to_string());
+    if (ctx.parser==cScannerSpanParser)
+        return SpanScanner(src, ctx).scan();
+
+    try {
+        ReplacementTable replacements;
+        string str=_processHtmlTagAttributes(src, replacements, ctx.arena);
+        str=_processCodeSpans(str, replacements, ctx.arena);
+        str=_processEscapedCharacters(str);
+        const size_t maxDelimiters=ctx.budget.limits().maxDelimiters;
+        str=_processLinksImagesAndTags(str, replacements, ctx.idTable,
+            maxDelimiters, ctx.arena);
+        return _processBoldAndItalicSpans(str, replacements, maxDelimiters,
+            ctx.arena);
+    } catch (const std::runtime_error&) {
+        // What Boost throws when it gives up.
+        return none;
+    }
 }
 
 string RawText::_processHtmlTagAttributes(string src, ReplacementTable&
-        replacements)
+        replacements, Arena& arena)
 {
     // Because "Attribute Content Is Not A Code Span"
+    if (!Features::cRawHtml) return src;
     string tgt;
-    auto prev=src.cbegin(), end=src.cend();
+    HtmlTagLexer lexer(src);
+    size_t prev=0;
     while (true) {
-        static const regex cHtmlToken("<((/?)([a-zA-Z0-9]+)(?:( +[a-zA-Z0-9]+?(?: ?= ?(\"|').*?\\5))+? */? *))>");
-        smatch m;
-        if (regex_search(prev, end, m, cHtmlToken)) {
+        HtmlTagLexer::Tag tag;
+        if (lexer.search(prev, tag, false, true)) {
             // NOTE: Kludge alert! The `isValidTag` test is a cheat, only here
             // to handle some edge cases between the Markdown test suite and the
             // PHP-Markdown one, which seem to conflict.
-            if (isValidTag(m[3])) {
-                tgt+=string(prev, m[0].first);
+            if (isValidTag(tag.name.to_string())) {
+                tgt.append(src, prev, tag.begin-prev);
 
-                string fulltag=m[0], tgttag;
+                string fulltag=src.substr(tag.begin, tag.end-tag.begin), tgttag;
                 auto prevtag=fulltag.cbegin(), endtag=fulltag.cend();
                 while (1) {
                     static const regex cAttributeStrings("= ?(\"|').*?\\1");
@@ -267,20 +1052,20 @@ string RawText::_processHtmlTagAttributes(string src, ReplacementTable&
                         tgttag+="\x01@"+boost::lexical_cast<string>(replacements.size())+"@htmlTagAttr\x01";
                         prevtag=mtag[0].second;
 
-                        replacements.push_back(TokenPtr(new TextHolder(string(mtag[0]), false, cAmps|cAngles)));
+                        replacements.push_back(arena.make<TextHolder>(string(mtag[0]), false, cAmps|cAngles));
                     } else {
                         tgttag+=string(prevtag, endtag);
                         break;
                     }
                 }
                 tgt+=tgttag;
-                prev=m[0].second;
+                prev=tag.end;
             } else {
-                tgt+=string(prev, m[0].second);
-                prev=m[0].second;
+                tgt.append(src, prev, tag.end-prev);
+                prev=tag.end;
             }
         } else {
-            tgt+=string(prev, end);
+            tgt.append(src, prev, string::npos);
             break;
         }
     }
@@ -289,19 +1074,46 @@ string RawText::_processHtmlTagAttributes(string src, ReplacementTable&
 }
 
 string RawText::_processCodeSpans(string src, ReplacementTable&
-                                  replacements)
+                                  replacements, Arena& arena)
 {
     static const regex cCodeSpan = regex("(?<!`)(`+)(?!`) *(.*?[^ ]) *(?<!`)\\1(?!`)");
-    
+
+    // A code span can only start at a run of backticks that has another of
+    // the same length after it, so the search starts at the next of those
+    // instead of trying every place before it, and failing at every other
+    // run, each time looking all through the rest of the span.
+    std::vector<size_t> spanStarts;
+    {
+        std::vector<std::pair<size_t, size_t> > runs; // Where, and how long
+        for (size_t i=src.find('`'); i!=string::npos; ) {
+            size_t e=src.find_first_not_of('`', i);
+            if (e==string::npos) e=src.length();
+            runs.push_back(std::make_pair(i, e-i));
+            i=src.find('`', e);
+        }
+        std::unordered_set<size_t> later;
+        for (auto r=runs.rbegin(), re=runs.rend(); r!=re; ++r)
+            if (!later.insert(r->second).second) spanStarts.push_back(r->first);
+        std::reverse(spanStarts.begin(), spanStarts.end());
+    }
+    auto nextStart=spanStarts.cbegin();
+
     string tgt;
     auto prev=src.cbegin(), end=src.cend();
     while (true) {
         smatch m;
-        if (regex_search(prev, end, m, cCodeSpan)) {
+        while (nextStart!=spanStarts.cend() && src.cbegin()+*nextStart<prev) ++nextStart;
+        bool found=false;
+        for (; !found && nextStart!=spanStarts.cend(); ++nextStart) {
+            // From `prev`, so the lookbehind sees what it would have.
+            found=regex_search(src.cbegin()+*nextStart, end, m, cCodeSpan,
+                boost::match_continuous, prev);
+        }
+        if (found) {
             tgt += string(prev, m[0].first);
             tgt += "\x01@"+boost::lexical_cast<string>(replacements.size())+"@codeSpan\x01";
             prev = m[0].second;
-            replacements.push_back(TokenPtr(new CodeSpan(_restoreProcessedItems(m.str(2), replacements))));
+            replacements.push_back(arena.make<CodeSpan>(_restoreProcessedItems(m.str(2), replacements)));
         } else {
             tgt += string(prev, end);
             break;
@@ -339,7 +1151,7 @@ string RawText::_processEscapedCharacters(const string& src) {
 }
 
 string RawText::_processSpaceBracketedGroupings(const string &src,
-        ReplacementTable& replacements)
+        ReplacementTable& replacements, Arena& arena)
 {
     static const regex cRemove("(?:(?: \\*+ )|(?: _+ ))");
 
@@ -350,7 +1162,7 @@ string RawText::_processSpaceBracketedGroupings(const string &src,
         if (regex_search(prev, end, m, cRemove)) {
             tgt+=string(prev, m[0].first);
             tgt+="\x01@"+boost::lexical_cast<string>(replacements.size())+"@spaceBracketed\x01";
-            replacements.push_back(TokenPtr(new RawText(m[0])));
+            replacements.push_back(arena.make<RawText>(m[0]));
             prev=m[0].second;
         } else {
             tgt+=string(prev, end);
@@ -361,7 +1173,8 @@ string RawText::_processSpaceBracketedGroupings(const string &src,
 }
 
 string RawText::_processLinksImagesAndTags(const string &src,
-        ReplacementTable& replacements, const LinkIds& idTable)
+        ReplacementTable& replacements, const LinkIds& idTable, size_t
+        maxDelimiters, Arena& arena)
 {
     // NOTE: Kludge alert! The "inline link or image" regex should be...
     //
@@ -379,20 +1192,63 @@ string RawText::_processLinksImagesAndTags(const string &src,
     //
     //   "|(?:(!?)\\[(.+?)\\](?: *\\[(.*?)\\])?)"
     //
-    static const regex cExpression(
-        "(?:(!?)\\[(.*)\\]\\(([^\\(]*(?:\\(.*?\\).*?)*?)\\))" // Inline link or image
-        "|(?:(!?)\\[((?:[^]]*?\\[.*?\\].*?)|(?:.+?))\\](?: *\\[(.*?)\\])?)" // Reference link or image
-        "|(?:<(/?([a-zA-Z0-9]+).*?)>)" // potential HTML tag or auto-link
-    );
-    // Important captures: 1/4=image indicator, 2/5=contents/alttext,
-    // 3=URL/title, 6=optional link ID, 7=potential HTML tag or auto-link
-    // contents, 8=actual tag from 7.
+    static const regex cInline("(!?)\\[(.*)\\]\\(([^\\(]*(?:\\(.*?\\).*?)*?)\\)");
+    static const regex cReference[]={
+        regex("(!?)\\[([^]]*?\\[.*?\\].*?)\\](?: *\\[(.*?)\\])?"),
+        regex("(!?)\\[(.+?)\\](?: *\\[(.*?)\\])?")
+    };
+    static const regex cTag("<(/?([a-zA-Z0-9]+).*?)>"); // Potential HTML tag or auto-link
+    // Important captures: 1=image indicator, 2=contents/alttext, 3=URL/title
+    // or optional link ID; for a tag, 1=its contents, 2=the actual tag.
+
+    // Each alternative is an expression of its own, tried at the places a
+    // link or tag can start in the order one expression joining them would
+    // try them, so the first to match is the one that expression would find.
+    // That lets one be skipped when what would have to close it doesn't come
+    // later in the span; trying it anyway takes time quadratic in the length
+    // of a line of unclosed brackets, or worse.
+    const size_t cNone=string::npos;
+    const size_t lastParen=src.rfind(')'), lastAngle=src.rfind('>'),
+        lastBracket=src.rfind(']'), secondLastBracket=(lastBracket==cNone ||
+            lastBracket==0 ? cNone : src.rfind(']', lastBracket-1));
+    size_t linkClose=0; // The first "](" past the bracket being looked at
+    size_t tried=0; // Brackets and tags, for maxDelimiters
 
     string tgt;
     auto prev=src.cbegin(), end=src.cend();
     while (1) {
         smatch m;
-        if (regex_search(prev, end, m, cExpression)) {
+        enum { cNoMatch, cInlineMatch, cReferenceMatch, cTagMatch } kind=cNoMatch;
+        size_t i=src.find_first_of("[<", prev-src.cbegin());
+        for (; i!=cNone && kind==cNoMatch; i=src.find_first_of("[<", i+1)) {
+            if (maxDelimiters!=0 && tried++==maxDelimiters) break;
+            if (src[i]=='<') {
+                if (lastAngle!=cNone && lastAngle>=i+2 &&
+                        regex_search(src.cbegin()+i, end, m, cTag, boost::match_continuous))
+                    kind=cTagMatch;
+                continue;
+            }
+
+            if (linkClose!=cNone && linkClose<i+1) linkClose=src.find("](", i+1);
+            const bool mayBeInline=(linkClose!=cNone && lastParen!=cNone &&
+                lastParen>=linkClose+2);
+
+            // An image starts at the '!' before its bracket.
+            size_t start=(src.cbegin()+i>prev && src[i-1]=='!' ? i-1 : i);
+            for (; start<=i && kind==cNoMatch; ++start) {
+                auto from=src.cbegin()+start;
+                if (mayBeInline && regex_search(from, end, m, cInline, boost::match_continuous))
+                    kind=cInlineMatch;
+                else if (secondLastBracket!=cNone && secondLastBracket>=i+2 &&
+                        regex_search(from, end, m, cReference[0], boost::match_continuous))
+                    kind=cReferenceMatch;
+                else if (lastBracket!=cNone && lastBracket>=i+2 &&
+                        regex_search(from, end, m, cReference[1], boost::match_continuous))
+                    kind=cReferenceMatch;
+            }
+        }
+
+        if (kind!=cNoMatch) {
             assert(m[0].matched);
             assert(m[0].length()!=0);
 
@@ -400,24 +1256,24 @@ string RawText::_processLinksImagesAndTags(const string &src,
             tgt+="\x01@"+boost::lexical_cast<string>(replacements.size())+"@links&Images1\x01";
             prev=m[0].second;
 
-            bool isImage=false, isLink=false, isReference=false;
-            if (m[4].matched && m[4].length()) isImage=isReference=true;
-            else if (m[1].matched && m[1].length()) isImage=true;
-            else if (m[5].matched) isLink=isReference=true;
-            else if (m[2].matched) isLink=true;
+            const bool isReference=(kind==cReferenceMatch);
+            const bool isImage=(kind!=cTagMatch && m[1].length()!=0);
+            const bool isLink=(kind!=cTagMatch && !isImage);
 
             if (isImage || isLink) {
                 string contentsOrAlttext, url, title;
                 bool resolved=false;
-                if (isReference) {
-                    contentsOrAlttext=m[5];
-                    string linkId=(m[6].matched ? string(m[6]) : string());
+                if (isReference && !Features::cReferences) {
+                    // Left as text, the way an undefined id would be.
+                } else if (isReference) {
+                    contentsOrAlttext=m[2];
+                    string linkId=(m[3].matched ? string(m[3]) : string());
                     if (linkId.empty()) linkId=cleanTextLinkRef(contentsOrAlttext);
 
                     optional<markdown::LinkIds::Target> target=idTable.find(linkId);
                     if (target) {
-                        url=target->url;
-                        title=target->title;
+                        url=target->url.to_string();
+                        title=target->title.to_string();
                         resolved=true;
                     };
                 } else {
@@ -438,40 +1294,40 @@ string RawText::_processLinksImagesAndTags(const string &src,
                     // Just encode the first character as-is, and continue
                     // searching after it.
                     prev=m[0].first+1;
-                    replacements.push_back(TokenPtr(new RawText(string(m[0].first, prev))));
+                    replacements.push_back(arena.make<RawText>(string(m[0].first, prev)));
                 } else if (isImage) {
-                    replacements.push_back(TokenPtr(new Image(contentsOrAlttext,
-                                                    url, title)));
+                    replacements.push_back(arena.make<Image>(contentsOrAlttext,
+                                                    url, title));
                 } else {
-                    replacements.push_back(TokenPtr(new HtmlAnchorTag(url, title)));
+                    replacements.push_back(arena.make<HtmlAnchorTag>(url, title));
                     tgt+=contentsOrAlttext;
                     tgt+="\x01@"+boost::lexical_cast<string>(replacements.size())+"@links&Images2\x01";
-                    replacements.push_back(TokenPtr(new HtmlTag("/a")));
+                    replacements.push_back(arena.make<HtmlTag>("/a"));
                 }
             } else {
                 // Otherwise it's an HTML tag or auto-link.
-                string contents=m[7];
+                string contents=m[1];
 
 //				cerr << "Evaluating potential HTML or auto-link: " << contents << endl;
 //				cerr << "m[8]=" << m[8] << endl;
 
-                if (looksLikeUrl(contents)) {
+                if (Features::cAutolinks && looksLikeUrl(contents)) {
                     TokenGroup subgroup;
-                    subgroup.push_back(TokenPtr(new HtmlAnchorTag(contents)));
-                    subgroup.push_back(TokenPtr(new RawText(contents, false)));
-                    subgroup.push_back(TokenPtr(new HtmlTag("/a")));
-                    replacements.push_back(TokenPtr(new Container(subgroup)));
-                } else if (looksLikeEmailAddress(contents)) {
+                    subgroup.push_back(arena.make<HtmlAnchorTag>(contents));
+                    subgroup.push_back(arena.make<RawText>(contents, false));
+                    subgroup.push_back(arena.make<HtmlTag>("/a"));
+                    replacements.push_back(arena.make<Container>(subgroup));
+                } else if (Features::cAutolinks && looksLikeEmailAddress(contents)) {
                     TokenGroup subgroup;
-                    subgroup.push_back(TokenPtr(new HtmlAnchorTag(emailEncode("mailto:"+contents))));
-                    subgroup.push_back(TokenPtr(new RawText(emailEncode(contents), false)));
-                    subgroup.push_back(TokenPtr(new HtmlTag("/a")));
-                    replacements.push_back(TokenPtr(new Container(subgroup)));
-                } else if (isValidTag(m[8])) {
-                    replacements.push_back(TokenPtr(new HtmlTag(_restoreProcessedItems(contents, replacements))));
+                    subgroup.push_back(arena.make<HtmlAnchorTag>(emailEncode("mailto:"+contents)));
+                    subgroup.push_back(arena.make<RawText>(emailEncode(contents), false));
+                    subgroup.push_back(arena.make<HtmlTag>("/a"));
+                    replacements.push_back(arena.make<Container>(subgroup));
+                } else if (Features::cRawHtml && isValidTag(m[2])) {
+                    replacements.push_back(arena.make<HtmlTag>(_restoreProcessedItems(contents, replacements)));
                 } else {
                     // Just encode it as-is
-                    replacements.push_back(TokenPtr(new RawText(m[0])));
+                    replacements.push_back(arena.make<RawText>(m[0]));
                 }
             }
         } else {
@@ -483,7 +1339,7 @@ string RawText::_processLinksImagesAndTags(const string &src,
 }
 
 TokenGroup RawText::_processBoldAndItalicSpans(const string& src,
-        ReplacementTable& replacements)
+        ReplacementTable& replacements, size_t maxDelimiters, Arena& arena)
 {
     /*
      * not followed by Unicode whitespace, and (b) either not
@@ -503,135 +1359,211 @@ TokenGroup RawText::_processBoldAndItalicSpans(const string& src,
     bool lastLeft = false;
     string lastToken;
 
+    // Where a search for each kind of close-marker last found nothing. The
+    // expressions only look one character back, so a search that starts
+    // later can only find something right where it starts; without this,
+    // every unmatched open-marker would search the rest of the span again.
+    string::const_iterator noCloserFrom[2][3];
+    for (size_t c=0; c<2; ++c)
+        for (size_t l=0; l<3; ++l)
+            noCloserFrom[c][l]=end;
+
+    // Every marker starts with one of `markers`, so a search can start at the
+    // first of them rather than have Boost try each place before it, which
+    // these lookbehinds make slow. With `from` as its base, the lookbehinds
+    // and `^` see what a search from `from` would have.
+    auto search=[end](string::const_iterator from, smatch& m, const regex& e,
+        const char *markers) -> bool
+    {
+        auto first=std::find_first_of(from, end, markers, markers+std::strlen(markers));
+        if (first==end) return false;
+        return regex_search(first, end, m, e, boost::match_default, from);
+    };
+
+    size_t markers=0; // For maxDelimiters
     while (true) {
         smatch m;
         
+        if (maxDelimiters!=0 && markers==maxDelimiters) {
+            // Whatever is left can't match anything.
+            if (prev != end)
+                tgt.push_back(arena.make<RawText>(string(prev, end)));
+            break;
+        }
+
         if (lastLeft) {
-            string rightRegex;
-            if (lastToken[0] == '*')
-                rightRegex = "((?:(?<! )\\*{" + lexical_cast<string>(lastToken.length()) + "}(?=$| |[[:punct:]]))|"
-                + "(?:(?<! |[[:punct:]])\\*{" + lexical_cast<string>(lastToken.length()) + "}))";
-            else
-                rightRegex =  "((?:(?<! |[[:punct:]])_{" + lexical_cast<string>(lastToken.length()) + "})|"
-                + "(?:(?<! )_{" + lexical_cast<string>(lastToken.length()) + "}(?=$| |[[:punct:]])))";
-            const regex cRightFlankingExpression(rightRegex);
-                                
-            if (regex_search(prev, end, m, cRightFlankingExpression)) {
+            const regex& cRightFlankingExpression=rightFlankingExpression(lastToken[0], lastToken.length());
+            string::const_iterator& failed=noCloserFrom[lastToken[0]=='_'][lastToken.length()-1];
+            bool found;
+            if (failed!=end && prev>=failed) {
+                found=(prev!=end && *prev==lastToken[0] &&
+                    regex_search(prev, end, m, cRightFlankingExpression,
+                        boost::match_default|boost::match_continuous));
+            } else {
+                found=search(prev, m, cRightFlankingExpression,
+                    lastToken[0]=='_' ? "_" : "*");
+                if (!found) failed=prev;
+            }
+            if (found) {
                 lastLeft = false;
                 if (prev != m[0].first)
-                    tgt.push_back(TokenPtr(new RawText(string(prev, m[0].first))));
+                    tgt.push_back(arena.make<RawText>(string(prev, m[0].first)));
                 
                 string token;
                 if (m[1].matched) {
                     token = m[1];
                     if (token[0]=='_' && m[0].first != i && m[0].second != end
                         && isalnum(*(m[0].first-1)) && isalnum(*m[0].second)) {
-                        tgt.push_back(TokenPtr(new RawText(token)));
+                        tgt.push_back(arena.make<RawText>(token));
                         lastLeft = true;
                     } else
-                        tgt.push_back(TokenPtr(new BoldOrItalicMarker(false, token[0],
-                                                token.length())));
+                        tgt.push_back(arena.make<BoldOrItalicMarker>(false, token[0],
+                                                token.length()));
                 } 
                 prev = m[0].second;
+                ++markers;
                 continue;
             }
         }
         
-        if (regex_search(prev, end, m, cLeftFlankingExpression)) {
+        if (search(prev, m, cLeftFlankingExpression, "*_")) {
             lastLeft = true;
             if (prev != m[0].first)
-                tgt.push_back(TokenPtr(new RawText(string(prev, m[0].first))));
+                tgt.push_back(arena.make<RawText>(string(prev, m[0].first)));
             
             string token;
             if (m[1].matched) { // for *
                 token = m[1];
-                tgt.push_back(TokenPtr(new BoldOrItalicMarker(true, token[0],
-                                       token.length())));
+                tgt.push_back(arena.make<BoldOrItalicMarker>(true, token[0],
+                                       token.length()));
             } else if (m[2].matched) { // for -
                 token = m[2];
                 if (m[0].first != i && m[0].second != end &&
                     isalnum(*(m[0].first-1)) && isalnum(*m[0].second)) {
-                    tgt.push_back(TokenPtr(new RawText(token)));
+                    tgt.push_back(arena.make<RawText>(token));
                     lastLeft = false;
                 } else
-                    tgt.push_back(TokenPtr(new BoldOrItalicMarker(true, token[0],
-                                            token.length())));
+                    tgt.push_back(arena.make<BoldOrItalicMarker>(true, token[0],
+                                            token.length()));
             } 
             
             lastToken = token;
             prev = m[0].second;
+            ++markers;
             continue;
         }
             
         if (prev != end)
-            tgt.push_back(TokenPtr(new RawText(string(prev, end))));
+            tgt.push_back(arena.make<RawText>(string(prev, end)));
         break;
     }
 
-    int id=0;
-    for (auto ii=tgt.begin(), iie=tgt.end(); ii!=iie; ++ii) {
-        if ((*ii)->isUnmatchedOpenMarker()) {
-            BoldOrItalicMarker *openToken=dynamic_cast<BoldOrItalicMarker*>(ii->get());
+    // Each open-marker is matched to the first close-marker, starting two
+    // tokens after it, that either fits it or has to be split to; which ones
+    // do depends only on the two markers' characters and sizes. So the
+    // unmatched close-markers are kept in order by kind, and an open-marker
+    // goes straight to the nearest that concerns it rather than looking
+    // through everything in between. Keys leave room after each token for
+    // the two markers it can be split into.
+    typedef std::list<std::pair<size_t, TokenPtr> > Sequence;
+    typedef std::map<size_t, Sequence::iterator> Closers;
+    Sequence seq;
+    Closers closers[2][3]; // By character, then size
+    for (auto ii=tgt.cbegin(), iie=tgt.cend(); ii!=iie; ++ii) {
+        Sequence::iterator s=seq.insert(seq.end(), std::make_pair(seq.size()*4, *ii));
+        if ((*ii)->isUnmatchedCloseMarker()) {
+            const BoldOrItalicMarker *m=static_cast<const BoldOrItalicMarker*>(*ii);
+            closers[m->tokenCharacter()=='_'][m->size()-1][s->first]=s;
+        }
+    }
 
-            // Find a matching close-marker, if it's there
-            auto iii=ii;
-            ++iii;
-            if (iii == iie)
-                break;
-            for (++iii; iii!=iie; ++iii) {
-                if ((*iii)->isUnmatchedCloseMarker()) {
-                    BoldOrItalicMarker *closeToken=dynamic_cast<BoldOrItalicMarker*>(iii->get());
-                    if (closeToken->size()==3 && openToken->size()!=3) {
-                        // Split the close-token into a match for the open-token
-                        // and a second for the leftovers.
-                        closeToken->disable();
-                        TokenGroup g;
-                        g.push_back(TokenPtr(new BoldOrItalicMarker(false,
-                                             closeToken->tokenCharacter(), closeToken->size()-
-                                             openToken->size())));
-                        g.push_back(TokenPtr(new BoldOrItalicMarker(false,
-                                             closeToken->tokenCharacter(), openToken->size())));
-                        auto after=iii;
-                        ++after;
-                        tgt.splice(after, g);
-                        continue;
-                    }
+    auto split=[&arena, &seq](Sequence::iterator at, bool open, char c,
+        size_t size, size_t leftover) -> Sequence::iterator
+    {
+        // The two parts go after the marker, the leftovers first.
+        Sequence::iterator next=at;
+        ++next;
+        seq.insert(next, std::make_pair(at->first+1,
+            TokenPtr(arena.make<BoldOrItalicMarker>(open, c, leftover))));
+        seq.insert(next, std::make_pair(at->first+2,
+            TokenPtr(arena.make<BoldOrItalicMarker>(open, c, size))));
+        return ++at;
+    };
 
-                    if (closeToken->tokenCharacter()==openToken->tokenCharacter()
-                            && closeToken->size()==openToken->size())
-                    {
-                        openToken->matched(closeToken, id);
-                        closeToken->matched(openToken, id);
-                        ++id;
-                        break;
-                    } else if (openToken->size()==3) {
-                        // Split the open-token into a match for the close-token
-                        // and a second for the leftovers.
-                        openToken->disable();
-                        TokenGroup g;
-                        g.push_back(TokenPtr(new BoldOrItalicMarker(true,
-                                             openToken->tokenCharacter(), openToken->size()-
-                                             closeToken->size())));
-                        g.push_back(TokenPtr(new BoldOrItalicMarker(true,
-                                             openToken->tokenCharacter(), closeToken->size())));
-                        auto after=ii;
-                        ++after;
-                        tgt.splice(after, g);
-                        break;
-                    }
+    int id=0;
+    for (Sequence::iterator ii=seq.begin(); ii!=seq.end(); ++ii) {
+        if (!ii->second->isUnmatchedOpenMarker()) continue;
+        BoldOrItalicMarker *openToken=static_cast<BoldOrItalicMarker*>(ii->second);
+        const size_t c=(openToken->tokenCharacter()=='_'), size=openToken->size();
+
+        Sequence::iterator first=ii;
+        if (++first==seq.end() || ++first==seq.end()) continue;
+
+        while (true) {
+            // Against a three-character open-marker, the close-markers that
+            // matter are those of the same kind and any shorter ones; against
+            // a shorter one, those of the same kind and any of three.
+            Closers *nearest=0;
+            Closers::iterator found;
+            auto consider=[&](size_t closeC, size_t closeSize) {
+                Closers& q=closers[closeC][closeSize-1];
+                Closers::iterator f=q.lower_bound(first->first);
+                if (f!=q.end() && (nearest==0 || f->first<found->first)) {
+                    nearest=&q;
+                    found=f;
                 }
-            } // end of inner for
+            };
+            consider(c, size);
+            for (size_t closeC=0; closeC<2; ++closeC) {
+                if (size==3) {
+                    consider(closeC, 1);
+                    consider(closeC, 2);
+                } else consider(closeC, 3);
+            }
+            if (nearest==0) break;
+
+            Sequence::iterator iii=found->second;
+            BoldOrItalicMarker *closeToken=static_cast<BoldOrItalicMarker*>(iii->second);
+            if (closeToken->size()==3 && size!=3) {
+                // Split the close-token into a match for the open-token
+                // and a second for the leftovers, and go on to those.
+                closeToken->disable();
+                nearest->erase(found);
+                Sequence::iterator g=split(iii, false,
+                    closeToken->tokenCharacter(), size, 3-size);
+                const size_t closeC=(closeToken->tokenCharacter()=='_');
+                closers[closeC][3-size-1][g->first]=g;
+                ++g;
+                closers[closeC][size-1][g->first]=g;
+                continue;
+            }
+
+            if (closeToken->size()==size) {
+                openToken->matched(closeToken, id);
+                closeToken->matched(openToken, id);
+                ++id;
+                nearest->erase(found);
+            } else {
+                // Split the open-token into a match for the close-token
+                // and a second for the leftovers, which come up next.
+                openToken->disable();
+                split(ii, true, openToken->tokenCharacter(),
+                    closeToken->size(), 3-closeToken->size());
+            }
+            break;
         }
-    } // end of outer for
+    }
+    tgt.clear();
+    for (auto ii=seq.cbegin(), iie=seq.cend(); ii!=iie; ++ii) tgt.push_back(ii->second);
 
     // "Unmatch" invalidly-nested matches.
     std::stack<BoldOrItalicMarker*> openMatches;
     for (auto ii=tgt.begin(), iie=tgt.end(); ii!=iie; ++ii) {
         if ((*ii)->isMatchedOpenMarker()) {
-            BoldOrItalicMarker *open=dynamic_cast<BoldOrItalicMarker*>(ii->get());
+            BoldOrItalicMarker *open=static_cast<BoldOrItalicMarker*>(*ii);
             openMatches.push(open);
         } else if ((*ii)->isMatchedCloseMarker()) {
-            BoldOrItalicMarker *close=dynamic_cast<BoldOrItalicMarker*>(ii->get());
+            BoldOrItalicMarker *close=static_cast<BoldOrItalicMarker*>(*ii);
 
             if (close->id() != openMatches.top()->id()) {
                 close->matchedTo()->matched(0);
@@ -647,8 +1579,8 @@ TokenGroup RawText::_processBoldAndItalicSpans(const string& src,
     TokenGroup r;
     for (auto ii=tgt.begin(), iie=tgt.end(); ii!=iie; ++ii) {
         if ((*ii)->text() && (*ii)->canContainMarkup()) {
-            TokenGroup t=_encodeProcessedItems(*(*ii)->text(), replacements);
-            r.splice(r.end(), t);
+            TokenGroup t=_encodeProcessedItems((*ii)->text()->to_string(), replacements, arena);
+            r.insert(r.end(), t.begin(), t.end());
         } else r.push_back(*ii);
     }
 
@@ -656,7 +1588,7 @@ TokenGroup RawText::_processBoldAndItalicSpans(const string& src,
 }
 
 TokenGroup RawText::_encodeProcessedItems(const string &src,
-        ReplacementTable& replacements)
+        ReplacementTable& replacements, Arena& arena)
 {
     static const regex cReplaced("\x01@(#?[0-9]*)@.+?\x01");
 
@@ -666,13 +1598,13 @@ TokenGroup RawText::_encodeProcessedItems(const string &src,
         smatch m;
         if (regex_search(prev, src.cend(), m, cReplaced)) {
             string pre=string(prev, m[0].first);
-            if (!pre.empty()) r.push_back(TokenPtr(new RawText(pre)));
+            if (!pre.empty()) r.push_back(arena.make<RawText>(pre));
             prev=m[0].second;
 
             string ref=m[1];
             if (ref[0]=='#') {
                 size_t n=boost::lexical_cast<size_t>(ref.substr(1));
-                r.push_back(TokenPtr(new EscapedCharacter(escapedCharacter(n))));
+                r.push_back(arena.make<EscapedCharacter>(escapedCharacter(n)));
             } else if (!ref.empty()) {
                 size_t n=boost::lexical_cast<size_t>(ref);
 
@@ -682,7 +1614,7 @@ TokenGroup RawText::_encodeProcessedItems(const string &src,
         } else {
             string pre=string(prev, src.end());
             if (!pre.empty())
-                r.push_back(TokenPtr(new RawText(pre)));
+                r.push_back(arena.make<RawText>(pre));
             break;
         }
     }
@@ -694,79 +1626,92 @@ string RawText::_restoreProcessedItems(const string &src,
 {
     static const regex cReplaced("\x01@(#?[0-9]*)@.+?\x01");
 
-    std::ostringstream r;
+    string r;
+    StringSink out(r);
     auto prev=src.cbegin();
     while (1) {
         smatch m;
         if (regex_search(prev, src.cend(), m, cReplaced)) {
             string pre=string(prev, m[0].first);
-            if (!pre.empty()) r << pre;
+            if (!pre.empty()) out << pre;
             prev=m[0].second;
 
             string ref=m[1];
             if (ref[0]=='#') {
                 size_t n=boost::lexical_cast<size_t>(ref.substr(1));
-                r << '\\' << escapedCharacter(n);
+                out << '\\' << escapedCharacter(n);
             } else if (!ref.empty()) {
                 size_t n=boost::lexical_cast<size_t>(ref);
 
                 assert(n<replacements.size());
-                replacements[n]->writeAsOriginal(r);
+                replacements[n]->writeAsOriginal(out);
             } // Otherwise just eat it
         } else {
             string pre=string(prev, src.end());
-            if (!pre.empty()) r << pre;
+            if (!pre.empty()) out << pre;
             break;
         }
     }
-    return r.str();
+    out.flush();
+    return r;
 }
 
 HtmlAnchorTag::HtmlAnchorTag(const string& url, const string& title):
     TextHolder("<a href=\""+encodeString(url, cQuotes|cAmps)+"\""
                +(title.empty() ? string() : " title=\""+encodeString(title, cQuotes|cAmps)+"\"")
-               +">", false, 0)
+               +">", false, 0, 0, cHtmlAnchorTag)
 {
     // This space deliberately blank. ;-)
 }
 
-void CodeBlock::writeAsHtml(std::ostream& out) const {
+void CodeBlock::writeAsHtml(OutputSink& out) const {
     out << "<pre><code>";
     TextHolder::writeAsHtml(out);
     out << "</code></pre>\n";
 }
 
-void FencedCodeBlock::writeAsHtml(std::ostream& out) const
+string FencedCodeBlock::language() const {
+    auto si = mInfoString.begin(), sie = mInfoString.end();
+    while (si!=sie && *si==' ') si++;
+    auto sii=si;
+    while (sii!=sie && *sii!=' ') sii++;
+    return string(si, sii);
+}
+
+void FencedCodeBlock::writeAsHtml(OutputSink& out) const
 {
     if (mInfoString.empty()) {
         out << "<pre><code>";
         TextHolder::writeAsHtml(out);
     } else {
-        auto si = mInfoString.begin(), sie = mInfoString.end();
-        while (si!=sie && *si==' ') si++;
-        auto sii=si;
-        while (sii!=sie && *sii!=' ') sii++;
-        out << "<pre><code class=\"language-"+ string(si, sii) + "\">";
-        mHighlighter->highlight(*text(), string(si, sii), out);
+        const string language(this->language());
+        out << "<pre><code class=\"language-" << language << "\">";
+        if (mHighlighted!=0) {
+            out << *mHighlighted;
+        } else if (mHighlighter!=0) {
+            SinkStreambuf buffer(out);
+            std::ostream stream(&buffer);
+            mHighlighter->highlight(text()->to_string(), language, stream);
+        } else TextHolder::writeAsHtml(out);
     }
 
     out << "</code></pre>\n\n";
 }
 
 
-void CodeSpan::writeAsHtml(std::ostream& out) const {
+void CodeSpan::writeAsHtml(OutputSink& out) const {
     out << "<code>";
     TextHolder::writeAsHtml(out);
     out << "</code>";
 }
 
-void CodeSpan::writeAsOriginal(std::ostream& out) const {
+void CodeSpan::writeAsOriginal(OutputSink& out) const {
     out << '`' << *text() << '`';
 }
 
 
 
-void Container::writeAsHtml(std::ostream& out) const {
+void Container::writeAsHtml(OutputSink& out) const {
     preWrite(out);
     for (auto i=mSubTokens.cbegin(), ie=mSubTokens.cend(); i!=ie; ++i)
         (*i)->writeAsHtml(out);
@@ -780,43 +1725,45 @@ void Container::writeToken(size_t indent, std::ostream& out) const {
         (*ii)->writeToken(indent+1, out);
 }
 
-optional<TokenGroup> Container::processSpanElements(const LinkIds& idTable) {
+optional<TokenGroup> Container::processSpanElements(const SpanContext& ctx) {
     TokenGroup t;
-    for (auto ii=mSubTokens.cbegin(), iie=mSubTokens.cend(); ii!=iie;
-            ++ii)
-    {
-        if ((*ii)->text()) {
-            optional<TokenGroup> subt=(*ii)->processSpanElements(idTable);
-            if (subt) {
-                if (subt->size()>1) t.push_back(TokenPtr(new Container(*subt)));
-                else if (!subt->empty()) t.push_back(*subt->begin());
-            } else t.push_back(*ii);
-        } else {
-            optional<TokenGroup> subt=(*ii)->processSpanElements(idTable);
-            if (subt) {
-                const Container *c=dynamic_cast<const Container*>((*ii).get());
-                assert(c!=0);
-                t.push_back(c->clone(*subt));
-            } else t.push_back(*ii);
-        }
-    }
+    t.reserve(mSubTokens.size());
+    for (size_t i=0, n=mSubTokens.size(); i!=n; ++i)
+        if (TokenPtr p=processSubtoken(i, ctx)) t.push_back(p);
     swapSubtokens(t);
     return none;
 }
 
-UnorderedList::UnorderedList(const TokenGroup& contents, bool paragraphMode) {
+TokenPtr Container::processSubtoken(size_t index, const SpanContext& ctx) {
+    TokenPtr token=mSubTokens[index];
+    optional<TokenGroup> subt=token->processSpanElements(ctx);
+    if (!subt) return token;
+    if (token->text()) {
+        if (subt->size()>1) return ctx.arena.make<Container>(*subt);
+        else if (!subt->empty()) return *subt->begin();
+        return 0;
+    } else {
+        assert(token->isContainer());
+        const Container *c=static_cast<const Container*>(token);
+        return c->clone(ctx.arena, *subt);
+    }
+}
+
+UnorderedList::UnorderedList(const TokenGroup& contents, bool paragraphMode,
+    Kind kind): Container(TokenGroup(), kind)
+{
     if (paragraphMode) {
         // Change each of the text items into paragraphs
         for (auto i=contents.cbegin(), ie=contents.cend(); i!=ie; ++i) {
-            token::ListItem *item=dynamic_cast<token::ListItem*>((*i).get());
-            assert(item!=0);
+            assert((*i)->kind()==cListItem);
+            token::ListItem *item=static_cast<token::ListItem*>(*i);
             item->inhibitParagraphs(false);
             mSubTokens.push_back(*i);
         }
     } else mSubTokens=contents;
 }
 
-void Paragraph::writeAsHtml(std::ostream& out) const {
+void Paragraph::writeAsHtml(OutputSink& out) const {
     preWrite(out);
     for (auto i=mSubTokens.cbegin(), ie=mSubTokens.cend(); i!=ie;) {
         (*i)->writeAsHtml(out);
@@ -828,7 +1775,7 @@ void Paragraph::writeAsHtml(std::ostream& out) const {
 }
 
 
-void BoldOrItalicMarker::writeAsHtml(std::ostream& out) const {
+void BoldOrItalicMarker::writeAsHtml(OutputSink& out) const {
     if (!mDisabled) {
         if (mMatch!=0) {
             assert(mSize>=1 && mSize<=3);
@@ -859,11 +1806,97 @@ void BoldOrItalicMarker::writeToken(std::ostream& out) const {
     }
 }
 
-void Image::writeAsHtml(std::ostream& out) const {
+void Image::writeAsHtml(OutputSink& out) const {
     out << "<img src=\"" << mUrl << "\" alt=\"" << mAltText << "\"";
     if (!mTitle.empty()) out << " title=\"" << mTitle << "\"";
     out << "/>";
 }
 
 } // namespace token
+
+
+
+void HtmlVisitor::enter(const Token& container) {
+    container.preWrite(mOut);
+}
+
+void HtmlVisitor::separate(const Token& container) {
+    // What Paragraph::writeAsHtml() puts between its lines.
+    if (container.kind()==Token::cParagraph) mOut << "\n";
+}
+
+void HtmlVisitor::leave(const Token& container) {
+    container.postWrite(mOut);
+}
+
+void HtmlVisitor::visit(const Token& token) {
+    token.writeAsHtml(mOut);
+}
+
+void TextVisitor::enter(const Token& container) {
+    if (container.kind()!=Token::cContainer) _endLine();
+}
+
+void TextVisitor::separate(const Token& container) {
+    if (container.kind()==Token::cParagraph) _endLine();
+}
+
+void TextVisitor::leave(const Token& container) {
+    // The plain containers are the spans of a line, which go on it.
+    if (container.kind()!=Token::cContainer) _endLine();
+}
+
+void TextVisitor::visit(const Token& token) {
+    string_view text;
+    switch (token.kind()) {
+        case Token::cTextHolder:
+        case Token::cRawText:
+        case Token::cCodeSpan:
+            text=*token.text();
+            break;
+
+        case Token::cCodeBlock:
+        case Token::cFencedCodeBlock:
+            _endLine();
+            text=*token.text();
+            break;
+
+        case Token::cEscapedCharacter: {
+            const char c=static_cast<const token::EscapedCharacter&>(token).character();
+            mOut << c;
+            mAtLineStart=(c=='\n');
+            return;
+        }
+
+        case Token::cImage:
+            text=static_cast<const token::Image&>(token).altText();
+            break;
+
+        case Token::cBoldOrItalicMarker: {
+            // Only the ones that didn't become emphasis are text.
+            const token::BoldOrItalicMarker& marker=static_cast<const token::BoldOrItalicMarker&>(token);
+            if (marker.disabled() || marker.matched()) return;
+            for (size_t i=0; i<marker.size(); ++i) mOut << marker.tokenCharacter();
+            mAtLineStart=false;
+            return;
+        }
+
+        default:
+            // Tags, HTML from the input, and blank lines.
+            return;
+    }
+
+    if (!text.empty()) {
+        mOut << text;
+        mAtLineStart=(text[text.size()-1]=='\n');
+    }
+}
+
+void TextVisitor::_endLine() {
+    if (!mAtLineStart) {
+        mOut << '\n';
+        mAtLineStart=true;
+    }
+}
+
 } // namespace markdown
@@ -10,43 +10,129 @@
 
 #include "markdown.h"
 
+#include <atomic>
 #include <vector>
 
 namespace markdown {
 
 typedef TokenGroup::iterator TokenGroupIter;
 
-class LinkIds {
+// Reference definitions, looked up without regard to case. The ids, URLs and
+// titles are copied into an arena of the table's own, since a table can
+// outlive the documents that fill it (see DocumentStream), and lookups don't
+// allocate anything.
+class LinkIds: private boost::noncopyable {
 public:
+    // The views stay valid for as long as the table does.
     struct Target {
-        string url;
-        string title;
+        string_view url;
+        string_view title;
 
-        Target(const string& url_, const string& title_):
+        Target(string_view url_, string_view title_):
             url(url_), title(title_) { }
+
+        bool operator==(const Target& t) const {
+            return url==t.url && title==t.title;
+        }
     };
 
-    optional<Target> find(const string& id) const;
-    void add(const string& id, const string& url, const
-             string& title);
+    explicit LinkIds(MemoryResource *resource=0): mCount(0), mStrings(cStringChunkSize, resource) { }
+
+    optional<Target> find(string_view id) const;
+
+    // The first definition of an id is the one that counts.
+    void add(string_view id, string_view url, string_view title);
+
+    // Adds the ids of `other` that aren't here yet, the way add() would.
+    void merge(const LinkIds& other);
+    bool operator==(const LinkIds& other) const;
+
+    size_t size() const { return mCount; }
+
+    // Forgets every id, but keeps the slots and the first chunk of strings
+    // for the next document.
+    void clear();
+
+    // Forgets every id, and takes the strings' memory from `resource` from
+    // now on.
+    void setMemoryResource(MemoryResource *resource);
 
 private:
-    typedef std::unordered_map<string, Target> Table;
+    struct Entry {
+        Entry(): used(false), hash(0), target(string_view(), string_view()) { }
+
+        bool used;
+        size_t hash;
+        string_view key; // Already case-folded
+        Target target;
+    };
+
+    // Most documents define only a few references, if any.
+    static const size_t cStringChunkSize=2048;
 
-    static string _scrubKey(string str);
+    static size_t _hash(string_view id);
+    static bool _equal(string_view key, string_view id);
+    const Entry* _find(string_view id, size_t hash) const;
+    void _insert(string_view key, size_t hash, const Target& target);
+    string_view _intern(string_view str, bool fold);
 
-    Table mTable;
+    std::vector<Entry> mSlots; // Open addressing; a power of two long
+    size_t mCount;
+    Arena mStrings;
+};
+
+// What's left of a document's Limits, shared by all of the threads that are
+// finding span-level markup in it.
+class SpanBudget: private boost::noncopyable {
+public:
+    explicit SpanBudget(const Limits& limits);
+
+    const Limits& limits() const { return mLimits; }
+
+    // Takes `steps` out of the budget for a span that's about to be looked
+    // at. Returns false once the steps or the time have run out; the span
+    // should be left as literal text then.
+    bool spend(size_t steps);
+
+private:
+    const Limits& mLimits;
+    std::chrono::steady_clock::time_point mDeadline;
+    std::atomic<size_t> mSteps;
+    std::atomic<bool> mSpent;
+};
+
+// Everything that span-level processing needs to know about the document.
+struct SpanContext {
+    SpanContext(const LinkIds& idTable_, SpanParser parser_, Arena& arena_,
+        SpanBudget& budget_): idTable(idTable_), parser(parser_), arena(arena_),
+        budget(budget_) { }
+
+    const LinkIds& idTable;
+    SpanParser parser;
+    Arena& arena; // Where new tokens go
+    SpanBudget& budget;
 };
 
 class Token {
 public:
-    Token() { }
+    // What a token is, and the things about it that the block passes keep
+    // asking, are kept in the token itself rather than behind virtual calls,
+    // so those questions are cheap and the casts don't have to be dynamic.
+    enum Kind { cTextHolder, cRawText, cHtmlTag, cHtmlAnchorTag,
+        cInlineHtmlContents, cInlineHtmlComment, cCodeBlock, cFencedCodeBlock,
+        cCodeSpan, cBlankLine, cEscapedCharacter, cContainer, cInlineHtmlBlock,
+        cHeader, cListItem, cUnorderedList, cOrderedList, cBlockQuote,
+        cParagraph, cBoldOrItalicMarker, cImage, cKindCount };
+
+    explicit Token(Kind kind, unsigned int flags=0): mKind(kind), mFlags(flags), mPos(0) { }
+
+    Kind kind() const { return mKind; }
 
     int pos() { return mPos; }
     void setPos(int pos) { mPos = pos; }
   
-    virtual void writeAsHtml(std::ostream&) const=0;
-    virtual void writeAsOriginal(std::ostream& out) const {
+    virtual void writeAsHtml(OutputSink&) const=0;
+    virtual void writeAsOriginal(OutputSink& out) const {
         writeAsHtml(out);
     }
     virtual void writeToken(std::ostream& out) const=0;
@@ -55,48 +141,60 @@ public:
         writeToken(out);
     }
     
-    virtual optional<TokenGroup> processSpanElements(const LinkIds& idTable)
+    virtual optional<TokenGroup> processSpanElements(const SpanContext& /*ctx*/)
     {
         return none;
     }
 
-    virtual optional<const string&> text() const {
+    // The view stays valid for as long as the document that made the token.
+    optional<string_view> text() const {
+        if (mFlags & cHasText) return mView;
         return none;
     }
 
-    virtual bool canContainMarkup() const {
-        return false;
-    }
-    virtual bool isBlankLine() const {
-        return false;
-    }
-    virtual bool isContainer() const {
-        return false;
+    bool canContainMarkup() const {
+        return (mFlags & cCanContainMarkup)!=0;
     }
-    virtual bool isUnmatchedOpenMarker() const {
-        return false;
+    bool isBlankLine() const {
+        return (mFlags & cIsBlankLine)!=0;
     }
-    virtual bool isUnmatchedCloseMarker() const {
-        return false;
+    bool isContainer() const {
+        return (mFlags & cIsContainer)!=0;
     }
-    virtual bool isMatchedOpenMarker() const {
-        return false;
+    bool isUnmatchedOpenMarker() const;
+    bool isUnmatchedCloseMarker() const;
+    bool isMatchedOpenMarker() const;
+    bool isMatchedCloseMarker() const;
+    bool isRawText() const {
+        return mKind==cRawText;
     }
-    virtual bool isMatchedCloseMarker() const {
-        return false;
+    bool inhibitParagraphs() const {
+        return (mFlags & cInhibitsParagraphs)!=0;
     }
-    virtual bool isRawText() const {
-        return false;
+
+protected:
+    // For the containers, which it writes a piece at a time.
+    friend class markdown::HtmlVisitor;
+
+    enum Flags { cHasText=0x01, cCanContainMarkup=0x02, cIsBlankLine=0x04,
+        cIsContainer=0x08, cInhibitsParagraphs=0x10 };
+
+    void setText(string_view text) {
+        mView=text;
+        mFlags|=cHasText;
     }
-    virtual bool inhibitParagraphs() const {
-        return false;
+    void setFlag(Flags flag, bool set) {
+        if (set) mFlags|=flag;
+        else mFlags&=~flag;
     }
 
-protected:
-    virtual void preWrite(std::ostream& out) const { }
-    virtual void postWrite(std::ostream& out) const { }
+    virtual void preWrite(OutputSink& out) const { }
+    virtual void postWrite(OutputSink& out) const { }
 
 private:
+    const Kind mKind;
+    unsigned int mFlags;
+    string_view mView;
     size_t mPos;
 };
 
@@ -106,74 +204,80 @@ size_t isValidTag(const string& tag, bool nonBlockFirst=false);
 
 enum EncodingFlags { cAmps=0x01, cDoubleAmps=0x02, cAngles=0x04, cQuotes=0x08 };
 
+// Picks the constructors that take text that's already finished instead of
+// working it out, and borrow it instead of copying it, for the tokens that
+// Document::readBinary() reads back.
+struct Borrowed { };
+
 class TextHolder: public Token {
 public:
-    TextHolder(const string& text, bool canContainMarkup, unsigned int encodingFlags=0, size_t pos=0)
-    : mText(text)
-    , mCanContainMarkup(canContainMarkup)
-    , mEncodingFlags(encodingFlags) { setPos(pos); }
+    TextHolder(const string& text, bool canContainMarkup, unsigned int encodingFlags=0,
+        size_t pos=0, Kind kind=cTextHolder)
+    : Token(kind, (canContainMarkup ? cCanContainMarkup : 0))
+    , mText(text)
+    , mEncodingFlags(encodingFlags) { setText(mText); setPos(pos); }
 
-    virtual void writeAsHtml(std::ostream& out) const;
+    // Doesn't copy the text; it has to live as long as the token does, which
+    // is true of the document's input buffers and of other tokens' text.
+    TextHolder(string_view text, bool canContainMarkup, unsigned int encodingFlags=0,
+        size_t pos=0, Kind kind=cTextHolder)
+    : Token(kind, (canContainMarkup ? cCanContainMarkup : 0))
+    , mEncodingFlags(encodingFlags) { setText(text); setPos(pos); }
 
-    virtual void writeToken(std::ostream& out) const {
-        out << "TextHolder: " << mText << '\n';
-    }
+    virtual void writeAsHtml(OutputSink& out) const;
 
-    virtual optional<const string&> text() const {
-        return mText;
+    virtual void writeToken(std::ostream& out) const {
+        out << "TextHolder: " << *text() << '\n';
     }
 
-    virtual bool canContainMarkup() const {
-        return mCanContainMarkup;
-    }
+    int encodingFlags() const { return mEncodingFlags; }
 
 private:
-    const string mText;
-    const bool mCanContainMarkup;
+    const string mText; // Empty if the text is borrowed
     const int mEncodingFlags;
 };
 
 class RawText: public TextHolder {
 public:
     RawText(const string& text, int pos=0, bool canContainMarkup=true):
-        TextHolder(text, canContainMarkup, cAmps|cAngles|cQuotes, pos) { }
+        TextHolder(text, canContainMarkup, cAmps|cAngles|cQuotes, pos, cRawText) { }
+    RawText(string_view text, int pos=0, bool canContainMarkup=true):
+        TextHolder(text, canContainMarkup, cAmps|cAngles|cQuotes, pos, cRawText) { }
         
     virtual void writeToken(std::ostream& out) const {
         out << "RawText: " << *text() << '\n';
     }
-    virtual bool isRawText() const {
-        return true;
-    }
 
-    virtual optional<TokenGroup> processSpanElements(const LinkIds& idTable);
+    virtual optional<TokenGroup> processSpanElements(const SpanContext& ctx);
 
 private:
     typedef std::vector<TokenPtr> ReplacementTable;
 
-    static string _processHtmlTagAttributes(string src, ReplacementTable& replacements);
-    static string _processCodeSpans(string src, ReplacementTable& replacements);
+    static string _processHtmlTagAttributes(string src, ReplacementTable& replacements, Arena& arena);
+    static string _processCodeSpans(string src, ReplacementTable& replacements, Arena& arena);
     static string _processEscapedCharacters(const string& src);
-    static string _processLinksImagesAndTags(const string& src, ReplacementTable& replacements, const LinkIds& idTable);
-    static string _processSpaceBracketedGroupings(const string& src, ReplacementTable& replacements);
-    static TokenGroup _processBoldAndItalicSpans(const string& src, ReplacementTable& replacements);
+    static string _processLinksImagesAndTags(const string& src, ReplacementTable& replacements, const LinkIds& idTable, size_t maxDelimiters, Arena& arena);
+    static string _processSpaceBracketedGroupings(const string& src, ReplacementTable& replacements, Arena& arena);
+    static TokenGroup _processBoldAndItalicSpans(const string& src, ReplacementTable& replacements, size_t maxDelimiters, Arena& arena);
 
-    static TokenGroup _encodeProcessedItems(const string& src, ReplacementTable& replacements);
+    static TokenGroup _encodeProcessedItems(const string& src, ReplacementTable& replacements, Arena& arena);
     static string _restoreProcessedItems(const string &src, ReplacementTable& replacements);
 };
 
 class HtmlTag: public TextHolder {
 public:
-    HtmlTag(const string& contents): TextHolder(contents, false, cAmps|cAngles) { }
+    HtmlTag(const string& contents): TextHolder(contents, false, cAmps|cAngles, 0, cHtmlTag) { }
+    HtmlTag(Borrowed, string_view contents): TextHolder(contents, false, cAmps|cAngles, 0, cHtmlTag) { }
 
     virtual void writeToken(std::ostream& out) const {
         out << "HtmlTag: " << *text() << '\n';
     }
 
 protected:
-    virtual void preWrite(std::ostream& out) const {
+    virtual void preWrite(OutputSink& out) const {
         out << '<';
     }
-    virtual void postWrite(std::ostream& out) const {
+    virtual void postWrite(OutputSink& out) const {
         out << '>';
     }
 };
@@ -181,6 +285,7 @@ protected:
 class HtmlAnchorTag: public TextHolder {
 public:
     HtmlAnchorTag(const string& url, const string& title=string());
+    HtmlAnchorTag(Borrowed, string_view html): TextHolder(html, false, 0, 0, cHtmlAnchorTag) { }
 
     virtual void writeToken(std::ostream& out) const {
         out << "HtmlAnchorTag: " << *text() << '\n';
@@ -190,7 +295,9 @@ public:
 class InlineHtmlContents: public TextHolder {
 public:
     InlineHtmlContents(const string& contents): TextHolder(contents, false,
-                cAmps|cAngles) { }
+                cAmps|cAngles, 0, cInlineHtmlContents) { }
+    InlineHtmlContents(Borrowed, string_view contents): TextHolder(contents, false,
+                cAmps|cAngles, 0, cInlineHtmlContents) { }
 
     virtual void writeToken(std::ostream& out) const {
         out << "InlineHtmlContents: " << *text() << '\n';
@@ -200,7 +307,9 @@ public:
 class InlineHtmlComment: public TextHolder {
 public:
     InlineHtmlComment(const string& contents): TextHolder(contents, false,
-                0) { }
+                0, 0, cInlineHtmlComment) { }
+    InlineHtmlComment(Borrowed, string_view contents): TextHolder(contents, false,
+                0, 0, cInlineHtmlComment) { }
 
     virtual void writeToken(std::ostream& out) const {
         out << "InlineHtmlComment: " << *text() << '\n';
@@ -210,9 +319,11 @@ public:
 class CodeBlock: public TextHolder {
 public:
     CodeBlock(const string& actualContents): TextHolder(actualContents,
-                false, cDoubleAmps|cAngles|cQuotes) { }
+                false, cDoubleAmps|cAngles|cQuotes, 0, cCodeBlock) { }
+    CodeBlock(Borrowed, string_view actualContents): TextHolder(actualContents,
+                false, cDoubleAmps|cAngles|cQuotes, 0, cCodeBlock) { }
 
-    virtual void writeAsHtml(std::ostream& out) const;
+    virtual void writeAsHtml(OutputSink& out) const;
 
     virtual void writeToken(std::ostream& out) const {
         out << "CodeBlock: " << *text() << '\n';
@@ -222,26 +333,48 @@ public:
 class FencedCodeBlock: public TextHolder {
 public:
     FencedCodeBlock(const string& actualContents, const string& info, SyntaxHighlighter *highlighter)
-        : TextHolder(actualContents, false, cDoubleAmps|cAngles|cQuotes)
+        : TextHolder(actualContents, false, cDoubleAmps|cAngles|cQuotes, 0, cFencedCodeBlock)
         , mInfoString(info)
-        , mHighlighter(highlighter) { }
-    virtual void writeAsHtml(std::ostream& out) const;
+        , mHighlighter(highlighter)
+        , mHighlighted(0) { }
+    FencedCodeBlock(Borrowed, string_view actualContents, const string& info,
+        SyntaxHighlighter *highlighter)
+        : TextHolder(actualContents, false, cDoubleAmps|cAngles|cQuotes, 0, cFencedCodeBlock)
+        , mInfoString(info)
+        , mHighlighter(highlighter)
+        , mHighlighted(0) { }
+    virtual void writeAsHtml(OutputSink& out) const;
 
     virtual void writeToken(std::ostream& out) const {
         out << "FencedCodeBlock: " << *text() << "\n";
     }
+
+    // Only blocks with an info string get highlighted, and then by the
+    // language, its first word.
+    bool isHighlighted() const { return mHighlighter!=0 && !mInfoString.empty(); }
+    const string& infoString() const { return mInfoString; }
+    string language() const;
+
+    // What the document's highlightAll() made of it, to write instead of
+    // calling the highlighter; it has to last as long as the block.
+    void setHighlighted(const string *html) { mHighlighted=html; }
+    const string *highlighted() const { return mHighlighted; }
+
 private:
     const string mInfoString;
     SyntaxHighlighter *mHighlighter;
+    const string *mHighlighted;
 };
 
 class CodeSpan: public TextHolder {
 public:
     CodeSpan(const string& actualContents): TextHolder(actualContents,
-                false, cDoubleAmps|cAngles|cQuotes) { }
+                false, cDoubleAmps|cAngles|cQuotes, 0, cCodeSpan) { }
+    CodeSpan(Borrowed, string_view actualContents): TextHolder(actualContents,
+                false, cDoubleAmps|cAngles|cQuotes, 0, cCodeSpan) { }
 
-    virtual void writeAsHtml(std::ostream& out) const;
-    virtual void writeAsOriginal(std::ostream& out) const;
+    virtual void writeAsHtml(OutputSink& out) const;
+    virtual void writeAsOriginal(OutputSink& out) const;
     virtual void writeToken(std::ostream& out) const {
         out << "CodeSpan: " << *text() << '\n';
     }
@@ -252,35 +385,35 @@ public:
 class BlankLine: public TextHolder {
 public:
     BlankLine(const string& actualContents=string()):
-        TextHolder(actualContents, false, 0) { }
+        TextHolder(actualContents, false, 0, 0, cBlankLine) { setFlag(cIsBlankLine, true); }
+    BlankLine(string_view actualContents):
+        TextHolder(actualContents, false, 0, 0, cBlankLine) { setFlag(cIsBlankLine, true); }
 
     virtual void writeToken(std::ostream& out) const override {
         out << "BlankLine: " << *text() << '\n';
     }
-
-    virtual bool isBlankLine() const override {
-        return true;
-    }
     
 protected:
-    virtual void preWrite(std::ostream& out) const override {}
-    virtual void postWrite(std::ostream& out) const override {}
+    virtual void preWrite(OutputSink& out) const override {}
+    virtual void postWrite(OutputSink& out) const override {}
 };
 
 class EscapedCharacter: public Token {
 public:
-    EscapedCharacter(char c): mChar(c) { }
+    EscapedCharacter(char c): Token(cEscapedCharacter), mChar(c) { }
 
-    virtual void writeAsHtml(std::ostream& out) const {
+    virtual void writeAsHtml(OutputSink& out) const {
         out << mChar;
     }
-    virtual void writeAsOriginal(std::ostream& out) const {
+    virtual void writeAsOriginal(OutputSink& out) const {
         out << '\\' << mChar;
     }
     virtual void writeToken(std::ostream& out) const {
         out << "EscapedCharacter: " << mChar << '\n';
     }
 
+    char character() const { return mChar; }
+
 private:
     const char mChar;
 };
@@ -289,34 +422,38 @@ private:
 
 class Container: public Token {
 public:
-    Container(const TokenGroup& contents=TokenGroup()): mSubTokens(contents),
+    Container(const TokenGroup& contents=TokenGroup(), Kind kind=cContainer,
+        unsigned int flags=0): Token(kind, cIsContainer|flags), mSubTokens(contents),
         mParagraphMode(false) { }
 
     const TokenGroup& subTokens() const {
         return mSubTokens;
     }
     void appendSubtokens(TokenGroup& tokens) {
-        mSubTokens.splice(mSubTokens.end(), tokens);
+        mSubTokens.insert(mSubTokens.end(), tokens.begin(), tokens.end());
+        tokens.clear();
     }
     void swapSubtokens(TokenGroup& tokens) {
         mSubTokens.swap(tokens);
     }
 
-    virtual bool isContainer() const {
-        return true;
-    }
-
-    virtual void writeAsHtml(std::ostream& out) const;
+    virtual void writeAsHtml(OutputSink& out) const;
 
     virtual void writeToken(std::ostream& out) const {
         out << "Container: error!" << '\n';
     }
     virtual void writeToken(size_t indent, std::ostream& out) const;
 
-    virtual optional<TokenGroup> processSpanElements(const LinkIds& idTable);
+    virtual optional<TokenGroup> processSpanElements(const SpanContext& ctx);
+
+    // What processSpanElements() puts in place of the subtoken at `index`, or
+    // null if it's dropped. Subtokens don't depend on each other, so different
+    // ones can be done on different threads, as long as each has an arena of
+    // its own.
+    TokenPtr processSubtoken(size_t index, const SpanContext& ctx);
 
-    virtual TokenPtr clone(const TokenGroup& newContents) const {
-        return TokenPtr(new Container(newContents));
+    virtual TokenPtr clone(Arena& arena, const TokenGroup& newContents) const {
+        return arena.make<Container>(newContents);
     }
     virtual string containerName() const {
         return "Container";
@@ -329,56 +466,46 @@ protected:
 
 class InlineHtmlBlock: public Container {
 public:
+    // Inline HTML blocks always end with a blank line, so they report
+    // themselves as one for parsing purposes.
     InlineHtmlBlock(const TokenGroup& contents, bool isBlockTag=false):
-        Container(contents), mIsBlockTag(isBlockTag) { }
-    InlineHtmlBlock(const string& contents): mIsBlockTag(false) {
-        mSubTokens.push_back(TokenPtr(new InlineHtmlContents(contents)));
-    }
-
-    virtual bool inhibitParagraphs() const {
-        return !mIsBlockTag;
+        Container(contents, cInlineHtmlBlock,
+            cIsBlankLine|(isBlockTag ? 0 : cInhibitsParagraphs)) { }
+    InlineHtmlBlock(Arena& arena, const string& contents):
+        Container(TokenGroup(), cInlineHtmlBlock, cIsBlankLine|cInhibitsParagraphs)
+    {
+        mSubTokens.push_back(arena.make<InlineHtmlContents>(contents));
     }
 
-    virtual TokenPtr clone(const TokenGroup& newContents) const {
-        return TokenPtr(new InlineHtmlBlock(newContents));
+    virtual TokenPtr clone(Arena& arena, const TokenGroup& newContents) const {
+        return arena.make<InlineHtmlBlock>(newContents);
     }
     virtual string containerName() const {
         return "InlineHtmlBlock";
     }
-
-    // Inline HTML blocks always end with a blank line, so report it as one for
-    // parsing purposes.
-    virtual bool isBlankLine() const {
-        return true;
-    }
-
-private:
-    bool mIsBlockTag;
 };
 
 class Header: public Container {
 public:
-    Header(size_t level, const TokenGroup& content): Container(content), mLevel(level) { }
+    Header(size_t level, const TokenGroup& content):
+        Container(content, cHeader, cInhibitsParagraphs), mLevel(level) { }
 
     //virtual void writeToken(std::ostream& out) const override { out << "Header " <<
     //    mLevel << ": " << *text() << '\n'; }
 
-    virtual bool inhibitParagraphs() const override {
-        return true;
-    }
-
-    virtual TokenPtr clone(const TokenGroup& newContents) const {
-        return TokenPtr(new Header(mLevel, newContents));
+    virtual TokenPtr clone(Arena& arena, const TokenGroup& newContents) const {
+        return arena.make<Header>(mLevel, newContents);
     }
+    size_t level() const { return mLevel; }
     virtual string containerName() const {
         return "Header";
     }
 
 protected:
-    virtual void preWrite(std::ostream& out) const override {
+    virtual void preWrite(OutputSink& out) const override {
         out << "<h" << mLevel << ">";
     }
-    virtual void postWrite(std::ostream& out) const override {
+    virtual void postWrite(OutputSink& out) const override {
         out << "</h" << mLevel << ">\n";
     }
 
@@ -388,52 +515,47 @@ private:
 
 class ListItem: public Container {
 public:
-    ListItem(const TokenGroup& contents): Container(contents),
-        mInhibitParagraphs(true) { }
+    ListItem(const TokenGroup& contents):
+        Container(contents, cListItem, cInhibitsParagraphs) { }
 
+    using Token::inhibitParagraphs;
     void inhibitParagraphs(bool set) {
-        mInhibitParagraphs=set;
+        setFlag(cInhibitsParagraphs, set);
     }
 
-    virtual bool inhibitParagraphs() const {
-        return mInhibitParagraphs;
-    }
-
-    virtual TokenPtr clone(const TokenGroup& newContents) const {
-        return TokenPtr(new ListItem(newContents));
+    virtual TokenPtr clone(Arena& arena, const TokenGroup& newContents) const {
+        return arena.make<ListItem>(newContents);
     }
     virtual string containerName() const {
         return "ListItem";
     }
 
 protected:
-    virtual void preWrite(std::ostream& out) const {
+    virtual void preWrite(OutputSink& out) const {
         out << "<li>";
     }
-    virtual void postWrite(std::ostream& out) const {
+    virtual void postWrite(OutputSink& out) const {
         out << "</li>\n";
     }
-
-private:
-    bool mInhibitParagraphs;
 };
 
 class UnorderedList: public Container {
 public:
-    UnorderedList(const TokenGroup& contents, bool paragraphMode=false);
+    UnorderedList(const TokenGroup& contents, bool paragraphMode=false,
+        Kind kind=cUnorderedList);
 
-    virtual TokenPtr clone(const TokenGroup& newContents) const {
-        return TokenPtr(new UnorderedList(newContents));
+    virtual TokenPtr clone(Arena& arena, const TokenGroup& newContents) const {
+        return arena.make<UnorderedList>(newContents);
     }
     virtual string containerName() const {
         return "UnorderedList";
     }
 
 protected:
-    virtual void preWrite(std::ostream& out) const {
+    virtual void preWrite(OutputSink& out) const {
         out << "\n<ul>\n";
     }
-    virtual void postWrite(std::ostream& out) const {
+    virtual void postWrite(OutputSink& out) const {
         out << "</ul>\n";
     }
 };
@@ -441,62 +563,62 @@ protected:
 class OrderedList: public UnorderedList {
 public:
     OrderedList(const TokenGroup& contents, bool paragraphMode=false):
-        UnorderedList(contents, paragraphMode) { }
+        UnorderedList(contents, paragraphMode, cOrderedList) { }
 
-    virtual TokenPtr clone(const TokenGroup& newContents) const {
-        return TokenPtr(new OrderedList(newContents));
+    virtual TokenPtr clone(Arena& arena, const TokenGroup& newContents) const {
+        return arena.make<OrderedList>(newContents);
     }
     virtual string containerName() const {
         return "OrderedList";
     }
 
 protected:
-    virtual void preWrite(std::ostream& out) const {
+    virtual void preWrite(OutputSink& out) const {
         out << "<ol>\n";
     }
-    virtual void postWrite(std::ostream& out) const {
+    virtual void postWrite(OutputSink& out) const {
         out << "</ol>\n";
     }
 };
 
 class BlockQuote: public Container {
 public:
-    BlockQuote(const TokenGroup& contents): Container(contents) { }
+    BlockQuote(const TokenGroup& contents): Container(contents, cBlockQuote) { }
 
-    virtual TokenPtr clone(const TokenGroup& newContents) const {
-        return TokenPtr(new BlockQuote(newContents));
+    virtual TokenPtr clone(Arena& arena, const TokenGroup& newContents) const {
+        return arena.make<BlockQuote>(newContents);
     }
     virtual string containerName() const override {
         return "BlockQuote";
     }
 
 protected:
-    virtual void preWrite(std::ostream& out) const {
+    virtual void preWrite(OutputSink& out) const {
         out << "<blockquote>\n";
     }
-    virtual void postWrite(std::ostream& out) const {
+    virtual void postWrite(OutputSink& out) const {
         out << "</blockquote>\n";
     }
 };
 
 class Paragraph: public Container {
 public:
-    Paragraph() { }
-    Paragraph(const TokenGroup& contents): Container(contents) { }
+    Paragraph(): Container(TokenGroup(), cParagraph) { }
+    Paragraph(const TokenGroup& contents): Container(contents, cParagraph) { }
 
-    virtual void writeAsHtml(std::ostream& out) const override;
-    virtual TokenPtr clone(const TokenGroup& newContents) const {
-        return TokenPtr(new Paragraph(newContents));
+    virtual void writeAsHtml(OutputSink& out) const override;
+    virtual TokenPtr clone(Arena& arena, const TokenGroup& newContents) const {
+        return arena.make<Paragraph>(newContents);
     }
     virtual string containerName() const {
         return "Paragraph";
     }
 
 protected:
-    virtual void preWrite(std::ostream& out) const {
+    virtual void preWrite(OutputSink& out) const {
         out << "<p>";
     }
-    virtual void postWrite(std::ostream& out) const {
+    virtual void postWrite(OutputSink& out) const {
         out << "</p>\n";
     }
 };
@@ -505,23 +627,23 @@ protected:
 
 class BoldOrItalicMarker: public Token {
 public:
-    BoldOrItalicMarker(bool open, char c, size_t size): mOpenMarker(open),
+    BoldOrItalicMarker(bool open, char c, size_t size): Token(cBoldOrItalicMarker), mOpenMarker(open),
         mTokenCharacter(c), mSize(size), mMatch(0), mCannotMatch(false),
         mDisabled(false), mId(-1) { }
 
-    virtual bool isUnmatchedOpenMarker() const {
+    bool isUnmatchedOpenMarker() const {
         return (mOpenMarker && mMatch==0 && !mCannotMatch);
     }
-    virtual bool isUnmatchedCloseMarker() const {
+    bool isUnmatchedCloseMarker() const {
         return (!mOpenMarker && mMatch==0 && !mCannotMatch);
     }
-    virtual bool isMatchedOpenMarker() const {
+    bool isMatchedOpenMarker() const {
         return (mOpenMarker && mMatch!=0);
     }
-    virtual bool isMatchedCloseMarker() const {
+    bool isMatchedCloseMarker() const {
         return (!mOpenMarker && mMatch!=0);
     }
-    virtual void writeAsHtml(std::ostream& out) const;
+    virtual void writeAsHtml(OutputSink& out) const;
     virtual void writeToken(std::ostream& out) const;
 
     bool isOpenMarker() const {
@@ -550,6 +672,9 @@ public:
     void cannotMatch(bool set) {
         mCannotMatch=set;
     }
+    bool disabled() const {
+        return mDisabled;
+    }
     void disable() {
         mCannotMatch=mDisabled=true;
     }
@@ -567,19 +692,41 @@ private:
 class Image: public Token {
 public:
     Image(const string& altText, const string& url, const string&
-          title): mAltText(altText), mUrl(url), mTitle(title) { }
+          title): Token(cImage), mAltText(altText), mUrl(url), mTitle(title) { }
 
-    virtual void writeAsHtml(std::ostream& out) const;
+    virtual void writeAsHtml(OutputSink& out) const;
 
     virtual void writeToken(std::ostream& out) const {
         out << "Image: " << mUrl << '\n';
     }
 
+    const string& altText() const { return mAltText; }
+    const string& url() const { return mUrl; }
+    const string& title() const { return mTitle; }
+
 private:
     const string mAltText, mUrl, mTitle;
 };
 
 } // namespace token
+
+inline bool Token::isUnmatchedOpenMarker() const {
+    return (mKind==cBoldOrItalicMarker &&
+        static_cast<const token::BoldOrItalicMarker*>(this)->isUnmatchedOpenMarker());
+}
+inline bool Token::isUnmatchedCloseMarker() const {
+    return (mKind==cBoldOrItalicMarker &&
+        static_cast<const token::BoldOrItalicMarker*>(this)->isUnmatchedCloseMarker());
+}
+inline bool Token::isMatchedOpenMarker() const {
+    return (mKind==cBoldOrItalicMarker &&
+        static_cast<const token::BoldOrItalicMarker*>(this)->isMatchedOpenMarker());
+}
+inline bool Token::isMatchedCloseMarker() const {
+    return (mKind==cBoldOrItalicMarker &&
+        static_cast<const token::BoldOrItalicMarker*>(this)->isMatchedCloseMarker());
+}
+
 } // namespace markdown
 
 #endif // MARKDOWN_TOKENS_H_INCLUDED
@@ -10,6 +10,10 @@
 #include <fstream>
 #include <vector>
 #include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
 
 #include <boost/optional.hpp>
 //#include <boost/regex.hpp> // For the 'test' option
@@ -25,7 +29,9 @@ namespace {
 
 	class Options {
 		public:
-		Options(): mDebug(false), mTest(false) { }
+		Options(): mDebug(false), mTest(false), mScanner(false), mStress(false),
+			mParallel(false), mStream(false), mPathological(false), mMmap(false), mText(false),
+			mToBinary(false), mFromBinary(false) { }
 
 		bool readOptions(int argc, char *argv[]);
 
@@ -33,11 +39,21 @@ namespace {
 
 		bool debug() const { return mDebug; }
 		bool test() const { return mTest; }
+		bool scanner() const { return mScanner; }
+		bool stress() const { return mStress; }
+		bool parallel() const { return mParallel; }
+		bool stream() const { return mStream; }
+		bool mmap() const { return mMmap; }
+		bool text() const { return mText; }
+		bool toBinary() const { return mToBinary; }
+		bool fromBinary() const { return mFromBinary; }
+		bool pathological() const { return mPathological; }
 		std::string inputFile() const { return mInputFile; }
 
 		private:
 		std::string mInputFile;
-		bool mDebug, mTest;
+		bool mDebug, mTest, mScanner, mStress, mParallel, mStream, mPathological, mMmap, mText,
+			mToBinary, mFromBinary;
 	};
 
 	bool Options::readOptions(int argc, char *argv[]) {
@@ -50,6 +66,24 @@ namespace {
 					mDebug=true;
 				} else if (opt=="test") {
 					mTest=true;
+				} else if (opt=="scanner") {
+					mScanner=true;
+				} else if (opt=="stress") {
+					mStress=true;
+				} else if (opt=="parallel") {
+					mParallel=true;
+				} else if (opt=="stream") {
+					mStream=true;
+				} else if (opt=="to-binary") {
+					mToBinary=true;
+				} else if (opt=="from-binary") {
+					mFromBinary=true;
+				} else if (opt=="text") {
+					mText=true;
+				} else if (opt=="mmap") {
+					mMmap=true;
+				} else if (opt=="pathological") {
+					mPathological=true;
 				} else if (opt=="help") {
 					help=true;
 				} else {
@@ -103,15 +137,266 @@ namespace {
 			"\n"
 			"Available options are:\n"
 			"    -?, --help      Show this screen.\n"
-			"    -d, --debug     Show tokens instead of HTML output.\n";
+			"    -d, --debug     Show tokens instead of HTML output.\n"
+			"    --scanner       Find span-level markup with the single-pass scanner\n"
+			"                    instead of the regular expressions.\n"
+			"    --stress        Render the input many times on several threads at once\n"
+			"                    and check that every result is the same.\n"
+			"    --parallel      Find span-level markup in a big document on one\n"
+			"                    thread per core.\n"
+			"    --stream        Write each block as soon as it's finished, instead of\n"
+			"                    reading all of the input first. Reference-style links\n"
+			"                    only work if they're defined before they're used.\n"
+			"    --text          Write just the text, without any markup, as a search\n"
+			"                    index would want it.\n"
+			"    --to-binary     Write the processed tokens in their binary form instead\n"
+			"                    of HTML.\n"
+			"    --from-binary   Read the binary form of the tokens, as --to-binary\n"
+			"                    writes it, instead of Markdown.\n"
+			"    --mmap          Parse the input file straight from a read-only mapping\n"
+			"                    of it instead of reading it into memory.\n"
+			"    --pathological  Time inputs made to be slow to parse, at two sizes, and\n"
+			"                    fail if the bigger ones go much slower per byte, or\n"
+			"                    much slower than ordinary prose. Needs no input.\n";
 		cerr << endl << cHelpScreen << endl;
 	}
 
+	std::string render(const std::string& input, bool scanner, size_t spanThreads=1) {
+		SyntaxHighlighter highlighter;
+		markdown::Document doc(&highlighter);
+		if (scanner) doc.setSpanParser(markdown::cScannerSpanParser);
+		doc.setSpanThreads(spanThreads);
+		doc.read(input);
+
+		std::string r;
+		StringSink sink(r);
+		doc.write(sink);
+		return r;
+	}
+
+	// Each thread renders its own Documents, which the library promises is
+	// safe; run it under ThreadSanitizer (tools/stressTest.sh) to check that.
+	// The threads all start from scratch, so that whatever the library sets
+	// up on first use gets set up while they race.
+	int stressTest(const std::string& input, bool scanner) {
+		const size_t cRounds=20;
+
+		size_t threadCount=std::thread::hardware_concurrency();
+		if (threadCount<4) threadCount=4;
+
+		std::vector<std::string> firsts(threadCount);
+		std::atomic<size_t> failures(0);
+		std::vector<std::thread> threads;
+		for (size_t t=0; t<threadCount; ++t) {
+			threads.push_back(std::thread([&, t]() {
+				firsts[t]=render(input, scanner);
+				for (size_t x=1; x<cRounds; ++x)
+					if (render(input, scanner)!=firsts[t]) ++failures;
+			}));
+		}
+		for (size_t t=0; t<threadCount; ++t) threads[t].join();
+
+		const std::string expected=render(input, scanner);
+		for (size_t t=0; t<threadCount; ++t)
+			if (firsts[t]!=expected) ++failures;
+		if (render(input, scanner, threadCount)!=expected) ++failures;
+
+		// Copies of one document share its lines, so this has them all
+		// reading those at once.
+		SyntaxHighlighter highlighter;
+		markdown::Document original(&highlighter);
+		if (scanner) original.setSpanParser(markdown::cScannerSpanParser);
+		original.read(input);
+		threads.clear();
+		for (size_t t=0; t<threadCount; ++t) {
+			threads.push_back(std::thread([&]() {
+				for (size_t x=0; x<cRounds; ++x) {
+					std::string r;
+					StringSink sink(r);
+					original.copy()->write(sink);
+					if (r!=expected) ++failures;
+				}
+			}));
+		}
+		for (size_t t=0; t<threadCount; ++t) threads[t].join();
+
+		// The batch interface only knows the default span parser. Every
+		// seventh input is left empty, so the workers' shares come out
+		// uneven and they have to steal from each other.
+		if (!scanner) {
+			SyntaxHighlighter highlighter;
+			std::vector<std::string> batch(threadCount*cRounds, input);
+			for (size_t i=0; i<batch.size(); i+=7) batch[i].clear();
+			std::vector<std::string> outputs=Procesoro::renderMany(batch, &highlighter);
+			for (size_t i=0; i<batch.size(); ++i)
+				if (outputs[i]!=(batch[i].empty() ? std::string() : expected)) ++failures;
+		}
+
+		cerr << threadCount << " threads x " << cRounds << " renders, "
+			<< failures << " different from a single-threaded one." << endl;
+		return (failures==0 ? 0 : 1);
+	}
+
+	// Inputs that have been slow to parse, and a random mix of markup
+	// characters; each is made at a given scale.
+	std::string nestedQuotes(size_t n) { return std::string(n, '>')+" x\n"; }
+
+	std::string nestedLists(size_t n) {
+		std::string r;
+		for (size_t i=0; i<n/8; ++i) r+=std::string((i%64)*2, ' ')+"- x\n";
+		return r;
+	}
+
+	std::string repeated(const char *unit, size_t n, size_t perLine) {
+		std::string line, r;
+		for (size_t i=0; i<perLine; ++i) line+=unit;
+		line+="\n\n";
+		while (r.length()<n) r+=line;
+		return r;
+	}
+
+	// Ordinary text with a little emphasis, code and links in it, for the
+	// others to be held to.
+	std::string prose(size_t n) {
+		const char *cWords[]={ "the", "quick", "brown", "fox", "jumps", "over",
+			"a", "lazy", "dog", "while", "markdown", "parsers", "keep", "running" };
+		const size_t cWordCount=sizeof(cWords)/sizeof(cWords[0]), cPerLine=14;
+		std::string r;
+		for (size_t i=0; r.length()<n; ++i) {
+			for (size_t j=0; j<cPerLine; ++j) {
+				const std::string word=cWords[(i*7+j*3)%cWordCount];
+				switch ((i*5+j)%23) {
+					case 0: r+="*"+word+"*"; break;
+					case 5: r+="**"+word+"**"; break;
+					case 9: r+="`"+word+"`"; break;
+					case 14: r+="["+word+"](http://example.com/"+word+")"; break;
+					default: r+=word;
+				}
+				r+=(j+1<cPerLine ? " " : i%4==3 ? ".\n\n" : "\n");
+			}
+		}
+		return r;
+	}
+
+	std::string openBrackets(size_t n) { return repeated("[", n, 5000); }
+	std::string fewOpenBrackets(size_t n) { return repeated("[", n, 150); }
+	std::string openLinks(size_t n) { return repeated("[a](", n, 5000); }
+	std::string fewOpenLinks(size_t n) { return repeated("[a](", n, 150); }
+	std::string emphasisOpeners(size_t n) { return repeated("*a _b ", n, 2000); }
+	std::string fewEmphasisOpeners(size_t n) { return repeated("*a _b ", n, 60); }
+	std::string tags(size_t n) { return repeated("<a ", n, 150); }
+	// The whole input on one line, so that they grow with it.
+	std::string lineOfOpenBrackets(size_t n) { return repeated("[", n, n); }
+	std::string lineOfOpenLinks(size_t n) { return repeated("[a](", n, n/4); }
+	std::string lineOfEmphasisOpeners(size_t n) { return repeated("*a _b ", n, n/6); }
+	std::string lineOfMismatchedEmphasis(size_t n) { return repeated("_a b* ", n, n/6); }
+	std::string lineOfOpenTitles(size_t n) { return repeated("[a](x (t ", n, n/9); }
+	std::string lineOfLinksInBrackets(size_t n) { return repeated("[ [a](b) ", n, n/9); }
+	std::string lineOfEmphasis(size_t n) { return repeated("w **b** and *i*, ", n, n/17); }
+	std::string lineOfLinks(size_t n) { return repeated("[a](/u) [b] ", n, n/12) + "[b]: /b\n"; }
+	std::string tagAttributes(size_t n) { return "<div"+repeated(" b=\"x\"", n, 30)+" !"; }
+
+	std::string backtickRuns(size_t n) {
+		std::string r;
+		for (size_t i=0; r.length()<n; ++i) {
+			r+=std::string(i%50+1, '`')+'a';
+			if (i%100==99) r+="\n\n";
+		}
+		return r;
+	}
+
+	std::string randomMarkup(size_t n) {
+		const char cCharacters[]="**__[]()<>!`\\> -#1.a a a\n";
+		std::string r;
+		unsigned int seed=12345;
+		while (r.length()<n) {
+			seed=seed*1103515245+12345;
+			r+=cCharacters[(seed>>16)%(sizeof(cCharacters)-1)];
+		}
+		return r;
+	}
+
+	double secondsToRender(const std::string& input, bool scanner) {
+		// The best of a few, to keep other things on the machine out of it.
+		double best=0;
+		for (size_t x=0; x<3; ++x) {
+			auto start=std::chrono::steady_clock::now();
+			render(input, scanner);
+			std::chrono::duration<double> t=std::chrono::steady_clock::now()-start;
+			if (x==0 || t.count()<best) best=t.count();
+		}
+		return best;
+	}
+
+	// Comparing each input with one four times its size makes the check
+	// independent of how fast the machine is: anything that isn't linear
+	// shows up as the bigger one going slower per byte. Each is also compared
+	// with ordinary prose of the bigger size, on the same parser, so that one
+	// that's linear but still much slower fails too. (Input that's all markup
+	// is honestly several times more work per byte than prose, hence the
+	// wide margin; the failures this is for run a hundred times slower.)
+	int pathologicalTest() {
+		const size_t cSmall=32*1024, cScale=4;
+		const double cMaxSlowdown=2.5, cMaxSlowdownFromProse=16;
+
+		struct Case {
+			const char *name;
+			std::string (*make)(size_t);
+		};
+		const Case cCases[]= {
+			{ "nested quotes", nestedQuotes },
+			{ "nested lists", nestedLists },
+			{ "open brackets", openBrackets },
+			{ "open brackets, short lines", fewOpenBrackets },
+			{ "open links", openLinks },
+			{ "open links, short lines", fewOpenLinks },
+			{ "emphasis openers", emphasisOpeners },
+			{ "emphasis openers, short lines", fewEmphasisOpeners },
+			{ "unclosed tags", tags },
+			{ "open brackets, one line", lineOfOpenBrackets },
+			{ "open links, one line", lineOfOpenLinks },
+			{ "open titles, one line", lineOfOpenTitles },
+			{ "links in open brackets, one line", lineOfLinksInBrackets },
+			{ "emphasis openers, one line", lineOfEmphasisOpeners },
+			{ "mismatched emphasis, one line", lineOfMismatchedEmphasis },
+			{ "emphasis, one line", lineOfEmphasis },
+			{ "links, one line", lineOfLinks },
+			{ "attributes in unclosed tags", tagAttributes },
+			{ "backtick runs", backtickRuns },
+			{ "random markup", randomMarkup }
+		};
+
+		double proseRates[2];
+		const std::string plain=prose(cSmall*cScale);
+		for (int scanner=0; scanner<2; ++scanner) {
+			proseRates[scanner]=plain.length()/secondsToRender(plain, scanner!=0)/1e6;
+			cerr << "prose" << (scanner ? " (scanner): " : ": ")
+				<< proseRates[scanner] << " MB/s" << endl;
+		}
+
+		int failures=0;
+		for (size_t c=0; c<sizeof(cCases)/sizeof(cCases[0]); ++c) {
+			const std::string small=cCases[c].make(cSmall), big=cCases[c].make(cSmall*cScale);
+			for (int scanner=0; scanner<2; ++scanner) {
+				double smallRate=small.length()/secondsToRender(small, scanner!=0)/1e6;
+				double bigRate=big.length()/secondsToRender(big, scanner!=0)/1e6;
+				bool slow=(bigRate*cMaxSlowdown<smallRate ||
+					bigRate*cMaxSlowdownFromProse<proseRates[scanner]);
+				if (slow) ++failures;
+				cerr << cCases[c].name << (scanner ? " (scanner): " : ": ")
+					<< smallRate << " MB/s, then " << bigRate << " MB/s"
+					<< (slow ? " -- too slow" : "") << endl;
+			}
+		}
+		return (failures==0 ? 0 : 1);
+	}
+
 } // namespace
 
 int main(int argc, char *argv[]) {
 	Options cfg;
 	if (!cfg.readOptions(argc, argv)) return 1;
+	if (cfg.pathological()) return pathologicalTest();
 
 //	if (cfg.test()) {
 //		return 1;
@@ -120,21 +405,67 @@ int main(int argc, char *argv[]) {
 	std::ifstream ifile;
 
 	std::istream *in=&std::cin;
-	if (!cfg.inputFile().empty()) {
+	if (cfg.mmap() && (cfg.inputFile().empty() || cfg.stress() || cfg.stream())) {
+		cerr << "Error: --mmap needs an input file, and doesn't go with --stress or "
+			"--stream." << endl;
+		return 1;
+	} else if (cfg.mmap()) {
+		cerr << "Mapping file '" << cfg.inputFile() << "'..." << endl;
+	} else if (!cfg.inputFile().empty()) {
 		cerr << "Reading file '" << cfg.inputFile() << "'..." << endl;
-		ifile.open(cfg.inputFile().c_str());
+		ifile.open(cfg.inputFile().c_str(), cfg.fromBinary() ? std::ios::in|std::ios::binary : std::ios::in);
 		if (!ifile) {
 			cerr << "Error: Can't open file." << endl;
 			return 1;
 		} else in=&ifile;
 	} else cerr << "Reading standard input..." << endl;
 
+	if (cfg.stress()) {
+		std::ostringstream input;
+		input << in->rdbuf();
+		return stressTest(input.str(), cfg.scanner());
+	}
+
         SyntaxHighlighter highlighter;
+	if (cfg.stream()) {
+		StreamSink out(cout);
+		markdown::DocumentStream stream(out, &highlighter);
+		if (cfg.scanner()) stream.setSpanParser(markdown::cScannerSpanParser);
+		stream.read(*in);
+		stream.finish();
+		return 0;
+	}
+
+	// The tokens that readBinary() makes borrow their text from it.
+	string binary;
 	markdown::Document doc(&highlighter);
-	doc.read(*in);
+	if (cfg.scanner()) doc.setSpanParser(markdown::cScannerSpanParser);
+	if (cfg.parallel()) doc.setSpanThreads(0);
+	if (cfg.fromBinary()) {
+		std::ostringstream input;
+		input << in->rdbuf();
+		binary=input.str();
+		if (!doc.readBinary(binary)) {
+			cerr << "Error: The input isn't in the tokens' binary form." << endl;
+			return 1;
+		}
+		doc.write(cout);
+		return 0;
+	} else if (!cfg.mmap()) doc.read(*in);
+	else if (!doc.readFile(cfg.inputFile())) {
+		cerr << "Error: Can't open file." << endl;
+		return 1;
+	}
 
 	if (cfg.debug()) doc.writeTokens(cout);
-	else doc.write(cout);
+	else if (cfg.toBinary()) {
+		StreamSink out(cout);
+		doc.writeBinary(out);
+	} else if (cfg.text()) {
+		StreamSink out(cout);
+		markdown::TextVisitor text(out);
+		doc.accept(text);
+	} else doc.write(cout);
 
 	return 0;
 }
@@ -0,0 +1,10 @@
+#!/bin/bash
+# Times inputs made to be slow to parse, with an optimized build, and fails if
+# any of them gets slower per byte as it gets bigger.
+
+cd "$(dirname "$0")/.." || exit 1
+mkdir -p build || exit 1
+${CXX:-g++} -std=c++11 -O2 -pthread lib/*.cpp test/main.cpp \
+    -lboost_regex -o build/markdown-pathological || exit 1
+
+build/markdown-pathological --pathological
@@ -0,0 +1,20 @@
+#!/bin/bash
+# Renders each file given (or the spec, by default) on several threads at once
+# with a ThreadSanitizer build, using both span parsers.
+
+cd "$(dirname "$0")/.." || exit 1
+mkdir -p build || exit 1
+${CXX:-g++} -std=c++11 -g -O1 -fsanitize=thread -pthread lib/*.cpp test/main.cpp \
+    -lboost_regex -o build/markdown-tsan || exit 1
+
+files=("$@")
+[ ${#files[@]} -eq 0 ] && files=(test/CommonMark/spec.txt)
+
+status=0
+for f in "${files[@]}"; do
+    for parser in "" --scanner; do
+        echo "$f $parser"
+        TSAN_OPTIONS="halt_on_error=1 suppressions=tools/tsan.supp" build/markdown-tsan --stress $parser "$f" || status=1
+    done
+done
+exit $status